@@ -16,5 +16,9 @@
 #include <akari/scenegraph.h>
 
 namespace akari {
-    void render_scenegraph(scene::P<scene::SceneGraph> graph);
+    namespace render {
+        class RenderControl;
+    }
+    // control: optional, to cancel the render from another thread; the integrator's time limit is applied to it
+    void render_scenegraph(scene::P<scene::SceneGraph> graph, render::RenderControl *control = nullptr);
 }
\ No newline at end of file
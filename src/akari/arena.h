@@ -0,0 +1,125 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <akari/util.h>
+
+namespace akari {
+    // Bump allocator for per-thread scratch memory.
+    // Blocks are never returned to the upstream resource before destruction; rewinding only moves the cursor
+    // back, so blocks are reused in order and stay warm. Allocation is a pointer bump, moving on to the next
+    // block is O(1).
+    class alignas(64) Arena : public astd::pmr::memory_resource {
+      public:
+        static constexpr size_t DEFAULT_BLOCK_SIZE = 262144ull;
+        struct Mark {
+            size_t block = 0;
+            size_t pos   = 0;
+            size_t used  = 0; // bytes in blocks [0, block)
+        };
+        explicit Arena(astd::pmr::memory_resource *upstream = astd::pmr::new_delete_resource(),
+                       size_t block_size                   = DEFAULT_BLOCK_SIZE)
+            : upstream(upstream), block_size(block_size) {}
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+        ~Arena() {
+            for (auto &block : blocks) {
+                upstream->deallocate(block.data, block.size, block_alignment);
+            }
+        }
+        Mark mark() const { return Mark{current, pos, used}; }
+        // frees everything allocated after m was taken
+        void rewind(const Mark &m) {
+            current = m.block;
+            pos     = m.pos;
+            used    = m.used;
+        }
+        void release() { rewind(Mark{}); }
+        size_t bytes_used() const { return used + pos; }
+        size_t bytes_reserved() const { return reserved; }
+        // largest bytes_used() since construction or the last reset_high_water_mark()
+        size_t high_water_mark() const { return high_water; }
+        void reset_high_water_mark() { high_water = bytes_used(); }
+
+      protected:
+        void *do_allocate(size_t bytes, size_t alignment) override {
+            if (current < blocks.size()) {
+                auto &block   = blocks[current];
+                size_t offset = align_offset(block.data + pos, alignment);
+                if (pos + offset + bytes <= block.size) {
+                    void *p = block.data + pos + offset;
+                    pos += offset + bytes;
+                    high_water = std::max(high_water, used + pos);
+                    return p;
+                }
+            }
+            return allocate_from_next_block(bytes, alignment);
+        }
+        void do_deallocate(void *, size_t, size_t) override {}
+        bool do_is_equal(const memory_resource &other) const noexcept override { return this == &other; }
+
+      private:
+        static constexpr size_t block_alignment = 64;
+        struct Block {
+            astd::byte *data;
+            size_t size;
+        };
+        static size_t align_offset(const astd::byte *p, size_t alignment) {
+            return (alignment - (uintptr_t)p % alignment) % alignment;
+        }
+        void *allocate_from_next_block(size_t bytes, size_t alignment) {
+            if (current < blocks.size()) {
+                used += blocks[current].size;
+                current++;
+            }
+            // blocks too small for this request are left in place for later frames
+            const size_t required = bytes + std::max(alignment, block_alignment);
+            if (current == blocks.size() || blocks[current].size < required) {
+                const size_t size = (std::max(required, block_size) + block_alignment - 1) & ~(block_alignment - 1);
+                auto *data        = (astd::byte *)upstream->allocate(size, block_alignment);
+                AKR_ASSERT(data);
+                blocks.insert(blocks.begin() + current, Block{data, size});
+                reserved += size;
+            }
+            pos = 0;
+            return do_allocate(bytes, alignment);
+        }
+        astd::pmr::memory_resource *upstream;
+        size_t block_size;
+        std::vector<Block> blocks;
+        size_t current    = 0;
+        size_t pos        = 0;
+        size_t used       = 0;
+        size_t reserved   = 0;
+        size_t high_water = 0;
+    };
+
+    // Scratch allocations made during the lifetime of a frame are freed when it ends.
+    // Frames on the same arena must be nested.
+    class ArenaFrame {
+        Arena &arena;
+        Arena::Mark m;
+
+      public:
+        explicit ArenaFrame(Arena &arena) : arena(arena), m(arena.mark()) {}
+        ArenaFrame(const ArenaFrame &) = delete;
+        ArenaFrame &operator=(const ArenaFrame &) = delete;
+        ~ArenaFrame() { arena.rewind(m); }
+        Allocator<> allocator() const { return Allocator<>(&arena); }
+        // frees what was allocated since the frame started, e.g. between two samples
+        void reset() { arena.rewind(m); }
+    };
+} // namespace akari
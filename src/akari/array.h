@@ -36,6 +36,7 @@ namespace akari {
             return tmp;
         }
         Array2D(const ivec2 &size, Allocator alloc) : dimension_(size), data_(size.x * size.y, alloc) {}
+        Allocator get_allocator() const { return data_.get_allocator(); }
         void fill(const T &v) {
             for (auto &i : data_) {
                 i = v;
@@ -66,7 +67,7 @@ namespace akari {
         return tmp;                                                                                                    \
     }                                                                                                                  \
     friend Array2D operator op(const T &lhs, const Array2D &rhs) {                                                     \
-        auto tmp = Array2D(rhs.dimension());                                                                           \
+        auto tmp = Array2D(rhs.dimension(), rhs.get_allocator());                                                      \
         tmp.fill(lhs);                                                                                                 \
         tmp assign_op rhs;                                                                                             \
         return tmp;                                                                                                    \
@@ -83,7 +84,7 @@ namespace akari {
         // template <typename = std::enable_if_t<!vec_trait<T>::is_vector>>
         Array2D safe_div(const Array2D &rhs) const {
             AKR_ASSERT(glm::all(glm::equal(rhs.dimension_, dimension_)));
-            auto tmp = Array2D(rhs.dimension());
+            auto tmp = Array2D(rhs.dimension(), get_allocator());
             if constexpr (!vec_trait<T>::is_vector) {
                 for (int i = 0; i < hprod(dimension_); i++) {
                     tmp.data_[i] = data_[i] / (rhs.data_[i] == T(0) ? T(1) : rhs.data_[i]);
@@ -102,13 +103,21 @@ namespace akari {
             return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return x + y; });
         }
         T prod() const {
-            return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return x * y; });
+            return thread::parallel_reduce(data_.begin(), data_.end(), T(1.0), [](T x, T y) { return x * y; });
         }
+        // 0 for an empty array
         T max() const {
-            return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return std::max(x, y); });
+            if (data_.empty())
+                return T(0.0);
+            return thread::parallel_reduce(data_.begin(), data_.end(), data_[0],
+                                           [](T x, T y) { return std::max(x, y); });
         }
+        // 0 for an empty array
         T min() const {
-            return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return std::min(x, y); });
+            if (data_.empty())
+                return T(0.0);
+            return thread::parallel_reduce(data_.begin(), data_.end(), data_[0],
+                                           [](T x, T y) { return std::min(x, y); });
         }
         void resize(const ivec2 &size) {
             dimension_ = size;
@@ -120,16 +129,16 @@ namespace akari {
         }
         template <class F>
         Array2D map(F &&f) const {
-            Array2D out(dimension());
+            Array2D out(dimension(), get_allocator());
             thread::parallel_for(thread::blocked_range<2>(out.dimension(), ivec2(64)),
-                                 [&](ivec2 id) { out(id) = f((*this)(id)); });
+                                 [&](ivec2 id, uint32_t) { out(id) = f((*this)(id)); });
             return out;
         }
     };
 
     template <class T, class A, class A2>
     Array2D<T, A> convolve(const Array2D<T, A> &image, const Array2D<T, A2> &kernel, const ivec2 &stride) {
-        Array2D<T, A> out(image.dimension() / stride);
+        Array2D<T, A> out(image.dimension() / stride, image.get_allocator());
         thread::parallel_for(thread::blocked_range<2>(out.dimension(), ivec2(64)), [&](ivec2 id, uint32_t) {
             T sum = T(0.0);
             for (int y = 0; y < kernel.dimension().y; y++) {
@@ -154,6 +163,7 @@ namespace akari {
         Array3D() : Array3D(ivec3(1)) {}
         Array3D(const ivec3 &size) : Array3D(size, Allocator()) {}
         Array3D(const ivec3 &size, Allocator alloc) : dimension_(size), data_(size.x * size.y * size.z, alloc) {}
+        Allocator get_allocator() const { return data_.get_allocator(); }
         template <class U, class A>
         Array3D(const Array3D<U, A> &rhs, Allocator alloc)
             : dimension_(rhs.dimension()), data_(hprod(dimension_), alloc) {
@@ -192,7 +202,7 @@ namespace akari {
         return tmp;                                                                                                    \
     }                                                                                                                  \
     friend Array3D operator op(const T &lhs, const Array3D &rhs) {                                                     \
-        auto tmp = Array3D(rhs.dimension());                                                                           \
+        auto tmp = Array3D(rhs.dimension(), rhs.get_allocator());                                                      \
         tmp.fill(lhs);                                                                                                 \
         tmp assign_op rhs;                                                                                             \
         return tmp;                                                                                                    \
@@ -214,13 +224,21 @@ namespace akari {
             return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return x + y; });
         }
         T prod() const {
-            return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return x * y; });
+            return thread::parallel_reduce(data_.begin(), data_.end(), T(1.0), [](T x, T y) { return x * y; });
         }
+        // 0 for an empty array
         T max() const {
-            return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return std::max(x, y); });
+            if (data_.empty())
+                return T(0.0);
+            return thread::parallel_reduce(data_.begin(), data_.end(), data_[0],
+                                           [](T x, T y) { return std::max(x, y); });
         }
+        // 0 for an empty array
         T min() const {
-            return thread::parallel_reduce(data_.begin(), data_.end(), T(0.0), [](T x, T y) { return std::min(x, y); });
+            if (data_.empty())
+                return T(0.0);
+            return thread::parallel_reduce(data_.begin(), data_.end(), data_[0],
+                                           [](T x, T y) { return std::min(x, y); });
         }
         void resize(const ivec3 &size) {
             dimension_ = size;
@@ -233,7 +251,7 @@ namespace akari {
         }
         template <class F>
         Array3D map(F &&f) const {
-            Array3D out(dimension());
+            Array3D out(dimension(), get_allocator());
             thread::parallel_for(thread::blocked_range<3>(out.dimension(), ivec3(64)),
                                  [&](ivec3 id, uint32_t) { out(id) = f((*this)(id)); });
             return out;
@@ -242,7 +260,7 @@ namespace akari {
 
     template <class T, class A, class A2>
     Array3D<T, A> convolve(const Array3D<T, A> &image, const Array3D<T, A2> &kernel, const ivec3 &stride) {
-        Array3D<T, A> out(image.dimension() / stride);
+        Array3D<T, A> out(image.dimension() / stride, image.get_allocator());
         thread::parallel_for(thread::blocked_range<3>(out.dimension(), ivec3(16)), [&](ivec3 id, uint32_t) {
             T sum = T(0.0);
             for (int z = 0; z < kernel.dimension().z; z++) {
@@ -0,0 +1,703 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <thread>
+#include <unordered_map>
+#include <akari/bvh.h>
+#include <akari/scenegraph.h>
+#include <akari/render.h>
+#include <akari/profile.h>
+#include <akari/memory.h>
+#include <spdlog/spdlog.h>
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#endif
+#ifdef _WIN32
+#    include <process.h>
+#else
+#    include <unistd.h>
+#endif
+
+namespace akari::render {
+    namespace bvh_internal {
+        // Past this depth ranges are split at the median, so that a leaf is reached by MAX_BVH_DEPTH for any number
+        // of primitives that fits into 32 bits.
+        static constexpr int MAX_SAH_DEPTH = MAX_BVH_DEPTH - 32;
+        // relative padding of BVHBuildSettings::pad_bounds
+        static constexpr Float BOUNDS_PADDING = 8 * MachineEpsilon;
+        // ranges with at least this many primitives are binned in parallel and their subtrees built as tasks
+        static constexpr uint32_t PARALLEL_BUILD_THRESHOLD = 16 * 1024;
+        struct BuildPrim {
+            Bounds3f bounds;
+            vec3 centroid;
+            uint32_t index;
+        };
+        struct RangeBounds {
+            Bounds3f bounds, centroid_bounds;
+            RangeBounds merge(const RangeBounds &rhs) const {
+                return RangeBounds{bounds.merge(rhs.bounds), centroid_bounds.merge(rhs.centroid_bounds)};
+            }
+        };
+        struct Bins {
+            std::array<Bounds3f, MAX_SAH_BINS> bounds;
+            std::array<uint32_t, MAX_SAH_BINS> count{};
+            Bins merge(const Bins &rhs) const {
+                Bins r;
+                for (uint32_t i = 0; i < MAX_SAH_BINS; i++) {
+                    r.bounds[i] = bounds[i].merge(rhs.bounds[i]);
+                    r.count[i]  = count[i] + rhs.count[i];
+                }
+                return r;
+            }
+        };
+        // Nodes are laid out depth first. A subtree built as a task goes to its own vector and is appended to the
+        // parent's afterwards, the primitives are reordered in place as the ranges of the tasks are disjoint.
+        class Builder {
+            const BVHBuildSettings &settings;
+            const uint32_t n_bins;
+            std::vector<BuildPrim> &prims;
+
+          public:
+            Builder(const BVHBuildSettings &settings, std::vector<BuildPrim> &prims)
+                : settings(settings), n_bins(std::clamp<uint32_t>(settings.sah_bins, 2, MAX_SAH_BINS)),
+                  prims(prims) {}
+            // appends the subtree over prims [begin, end) to nodes and returns its root
+            uint32_t build(std::vector<BVHNode> &nodes, uint32_t begin, uint32_t end, int depth) {
+                const uint32_t n        = end - begin;
+                const auto range        = range_bounds(begin, end);
+                const auto &bounds      = range.bounds;
+                const uint32_t node_idx = (uint32_t)nodes.size();
+                nodes.emplace_back();
+                nodes[node_idx].pmin = bounds.pmin;
+                nodes[node_idx].pmax = bounds.pmax;
+                if (settings.pad_bounds) {
+                    const vec3 pad = BOUNDS_PADDING * glm::max(glm::abs(bounds.pmin), glm::abs(bounds.pmax));
+                    nodes[node_idx].pmin -= pad;
+                    nodes[node_idx].pmax += pad;
+                }
+                // the depth check only guards the bound of the traversal stack, median splits end earlier
+                if (n <= settings.max_leaf_size || depth >= MAX_BVH_DEPTH) {
+                    AKR_ASSERT(n <= std::numeric_limits<uint16_t>::max());
+                    make_leaf(nodes[node_idx], begin, n);
+                    return node_idx;
+                }
+                const auto &centroid_bounds = range.centroid_bounds;
+                const vec3 extents          = centroid_bounds.extents();
+                int axis                    = 0;
+                if (extents[1] > extents[axis])
+                    axis = 1;
+                if (extents[2] > extents[axis])
+                    axis = 2;
+                // past the depth limit or with coincident centroids the range is halved without reordering
+                uint32_t mid = begin + n / 2;
+                if (depth < MAX_SAH_DEPTH && extents[axis] > 0) {
+                    if (auto bin = find_sah_split(begin, end, axis, centroid_bounds)) {
+                        auto pivot =
+                            std::partition(prims.begin() + begin, prims.begin() + end, [&](const BuildPrim &p) {
+                                return bin_of(p.centroid, axis, centroid_bounds) < *bin;
+                            });
+                        mid = (uint32_t)(pivot - prims.begin());
+                    }
+                }
+                if (mid == begin || mid == end) {
+                    mid = begin + n / 2;
+                }
+                nodes[node_idx].axis = (uint8_t)axis;
+                if (n < PARALLEL_BUILD_THRESHOLD) {
+                    build(nodes, begin, mid, depth + 1);
+                    nodes[node_idx].offset = build(nodes, mid, end, depth + 1);
+                    return node_idx;
+                }
+                std::vector<BVHNode> right_nodes;
+                {
+                    thread::TaskGroup group;
+                    group.run([&] { build(right_nodes, mid, end, depth + 1); });
+                    build(nodes, begin, mid, depth + 1);
+                    group.wait();
+                }
+                const uint32_t right = (uint32_t)nodes.size();
+                for (auto node : right_nodes) {
+                    if (!node.is_leaf()) {
+                        node.offset += right;
+                    }
+                    nodes.emplace_back(node);
+                }
+                nodes[node_idx].offset = right;
+                return node_idx;
+            }
+
+          private:
+            static void make_leaf(BVHNode &node, uint32_t begin, uint32_t n) {
+                node.offset = begin;
+                node.count  = (uint16_t)n;
+            }
+            // F :: (size_t begin, size_t end) -> T
+            template <class T, class F>
+            static T reduce_range(uint32_t begin, uint32_t end, F &&f) {
+                const uint32_t n = end - begin;
+                if (n < PARALLEL_BUILD_THRESHOLD) {
+                    return f(begin, end);
+                }
+                const size_t n_blocks = (n + PARALLEL_BUILD_THRESHOLD / 4 - 1) / (PARALLEL_BUILD_THRESHOLD / 4);
+                return thread::parallel_map_reduce(
+                    n_blocks, T(),
+                    [&](size_t block) { return f(begin + n * block / n_blocks, begin + n * (block + 1) / n_blocks); },
+                    [](const T &a, const T &b) { return a.merge(b); });
+            }
+            RangeBounds range_bounds(uint32_t begin, uint32_t end) const {
+                return reduce_range<RangeBounds>(begin, end, [&](size_t b, size_t e) {
+                    RangeBounds r;
+                    for (size_t i = b; i < e; i++) {
+                        r.bounds          = r.bounds.merge(prims[i].bounds);
+                        r.centroid_bounds = r.centroid_bounds.expand(prims[i].centroid);
+                    }
+                    return r;
+                });
+            }
+            uint32_t bin_of(const vec3 &c, int axis, const Bounds3f &centroid_bounds) const {
+                const Float rel = (c[axis] - centroid_bounds.pmin[axis]) / centroid_bounds.extents()[axis];
+                return std::min<uint32_t>(n_bins - 1, (uint32_t)(rel * n_bins));
+            }
+            // returns the first bin of the right child with the lowest surface area heuristic
+            std::optional<uint32_t> find_sah_split(uint32_t begin, uint32_t end, int axis,
+                                                   const Bounds3f &centroid_bounds) const {
+                const Bins bins = reduce_range<Bins>(begin, end, [&](size_t b, size_t e) {
+                    Bins r;
+                    for (size_t i = b; i < e; i++) {
+                        auto bin      = bin_of(prims[i].centroid, axis, centroid_bounds);
+                        r.bounds[bin] = r.bounds[bin].merge(prims[i].bounds);
+                        r.count[bin]++;
+                    }
+                    return r;
+                });
+                // right_area[i], right_count[i] describe bins [i, n_bins)
+                std::array<Float, MAX_SAH_BINS> right_area;
+                std::array<uint32_t, MAX_SAH_BINS> right_count;
+                Bounds3f acc;
+                uint32_t count = 0;
+                for (uint32_t i = n_bins - 1; i > 0; i--) {
+                    acc = acc.merge(bins.bounds[i]);
+                    count += bins.count[i];
+                    right_area[i]  = acc.surface_area();
+                    right_count[i] = count;
+                }
+                std::optional<uint32_t> best;
+                Float best_cost = Inf;
+                acc.reset();
+                count = 0;
+                for (uint32_t i = 1; i < n_bins; i++) {
+                    acc = acc.merge(bins.bounds[i - 1]);
+                    count += bins.count[i - 1];
+                    if (count == 0 || right_count[i] == 0)
+                        continue;
+                    Float cost = acc.surface_area() * count + right_area[i] * right_count[i];
+                    if (cost < best_cost) {
+                        best      = i;
+                        best_cost = cost;
+                    }
+                }
+                return best;
+            }
+        };
+
+        template <int N>
+        class Collapser {
+            const std::vector<BVHNode> &nodes;
+            std::vector<WideBVHNode<N>> &wide;
+
+          public:
+            Collapser(const std::vector<BVHNode> &nodes, std::vector<WideBVHNode<N>> &wide)
+                : nodes(nodes), wide(wide) {}
+            // collapses the subtree of nodes[idx] into a new wide node
+            uint32_t collapse(uint32_t idx) {
+                const uint32_t wide_idx = (uint32_t)wide.size();
+                wide.emplace_back();
+                std::array<uint32_t, N> children;
+                int n_children = 0;
+                if (nodes[idx].is_leaf()) {
+                    children[n_children++] = idx;
+                } else {
+                    children[n_children++] = idx + 1;
+                    children[n_children++] = nodes[idx].offset;
+                }
+                while (n_children < N) {
+                    int best        = -1;
+                    Float best_area = -1;
+                    for (int i = 0; i < n_children; i++) {
+                        const auto &child = nodes[children[i]];
+                        if (!child.is_leaf() && child.bounds().surface_area() > best_area) {
+                            best      = i;
+                            best_area = child.bounds().surface_area();
+                        }
+                    }
+                    if (best < 0) {
+                        break;
+                    }
+                    const uint32_t opened  = children[best];
+                    children[best]         = opened + 1;
+                    children[n_children++] = nodes[opened].offset;
+                }
+                for (int i = 0; i < n_children; i++) {
+                    const auto &child = nodes[children[i]];
+                    // collapsing the child may reallocate wide
+                    const uint32_t target = child.is_leaf() ? child.offset : collapse(children[i]);
+                    auto &node            = wide[wide_idx];
+                    for (int a = 0; a < 3; a++) {
+                        node.pmin[a][i] = child.pmin[a];
+                        node.pmax[a][i] = child.pmax[a];
+                    }
+                    node.child[i] = target;
+                    node.count[i] = child.count;
+                }
+                return wide_idx;
+            }
+        };
+
+        // FNV-1a over 64-bit words with an extra fold per word, finished with the splitmix64 mixer
+        static uint64_t hash_bytes(const void *data, size_t size, uint64_t h) {
+            const auto *p = (const uint8_t *)data;
+            size_t i      = 0;
+            for (; i + 8 <= size; i += 8) {
+                uint64_t w;
+                std::memcpy(&w, p + i, 8);
+                h = (h ^ w) * 0x100000001b3ull;
+                h ^= h >> 32;
+            }
+            for (; i < size; i++) {
+                h = (h ^ p[i]) * 0x100000001b3ull;
+            }
+            h ^= size;
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+            return h ^ (h >> 31);
+        }
+
+        static constexpr uint64_t CACHE_MAGIC   = 0x31484356424b4124ull; // "$AKBVCH1"
+        static constexpr uint32_t CACHE_VERSION = 2;
+        struct CacheHeader {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t pad;
+            uint64_t key;
+            uint64_t node_count;
+            uint64_t prim_count;
+            uint64_t reserved[3];
+        };
+        static_assert(sizeof(CacheHeader) == 64);
+
+        // Read-only view of a whole file. Mapped where mmap is available, read into memory otherwise.
+        class MappedFile {
+            const char *data_ = nullptr;
+            size_t size_      = 0;
+            std::vector<char> buffer;
+
+          public:
+            explicit MappedFile(const fs::path &path) {
+#ifdef __linux__
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0) {
+                    return;
+                }
+                struct stat st;
+                if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                    void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p != MAP_FAILED) {
+                        data_ = (const char *)p;
+                        size_ = (size_t)st.st_size;
+                    }
+                }
+                close(fd);
+#else
+                std::ifstream in(path, std::ios::binary);
+                if (!in) {
+                    return;
+                }
+                buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                data_ = buffer.data();
+                size_ = buffer.size();
+#endif
+            }
+            MappedFile(const MappedFile &) = delete;
+            MappedFile &operator=(const MappedFile &) = delete;
+            ~MappedFile() {
+#ifdef __linux__
+                if (data_) {
+                    munmap((void *)data_, size_);
+                }
+#endif
+            }
+            const char *data() const { return data_; }
+            size_t size() const { return size_; }
+        };
+
+        static bool intersect_triangle(const scene::Mesh &mesh, uint32_t prim, const vec3 &o, const vec3 &d,
+                                       Float tmin, Float tmax, Float &t, vec2 &uv) {
+            const auto &idx = mesh.indices[prim];
+            return render::intersect_triangle(mesh.vertices[idx[0]], mesh.vertices[idx[1]], mesh.vertices[idx[2]], o,
+                                              d, tmin, tmax, t, uv);
+        }
+        // N-wide BVH over the triangles of one mesh in object space
+        template <int N>
+        struct MeshBVH {
+            const scene::Mesh *mesh = nullptr;
+            BufferView<const WideBVHNode<N>> nodes;
+            BufferView<const uint32_t> prim_indices;
+            std::vector<WideBVHNode<N>> node_storage;
+            std::vector<uint32_t> prim_storage;
+            std::unique_ptr<MappedFile> file;
+            memory::Footprint footprint{memory::Accel};
+            bool from_cache = false;
+        };
+        template <int N>
+        struct InstanceBVH {
+            const MeshBVH<N> *blas = nullptr;
+            Transform to_object;
+        };
+
+        static BVHBuildSettings mesh_build_settings(AccelProfile profile) {
+            BVHBuildSettings settings;
+            switch (profile) {
+            case AccelProfile::Fast:
+                settings.max_leaf_size = 8;
+                settings.sah_bins      = 8;
+                break;
+            case AccelProfile::Compact:
+                // fewer, fuller leaves
+                settings.max_leaf_size = 8;
+                break;
+            case AccelProfile::Robust:
+                settings.sah_bins   = 32;
+                settings.pad_bounds = true;
+                break;
+            default:
+                settings.sah_bins = 32;
+                break;
+            }
+            return settings;
+        }
+        static uint64_t cache_key(const scene::Mesh &mesh, const BVHBuildSettings &settings, uint32_t width) {
+            uint64_t h = 0xcbf29ce484222325ull;
+            h = hash_bytes(&CACHE_VERSION, sizeof(CACHE_VERSION), h);
+            h = hash_bytes(&width, sizeof(width), h);
+            h = hash_bytes(&settings.max_leaf_size, sizeof(settings.max_leaf_size), h);
+            h = hash_bytes(&settings.sah_bins, sizeof(settings.sah_bins), h);
+            h = hash_bytes(&settings.pad_bounds, sizeof(settings.pad_bounds), h);
+            h = hash_bytes(mesh.vertices.data(), sizeof(vec3) * mesh.vertices.size(), h);
+            h = hash_bytes(mesh.indices.data(), sizeof(uvec3) * mesh.indices.size(), h);
+            return h;
+        }
+        template <int N>
+        static bool load_cached(MeshBVH<N> &bvh, const fs::path &path, uint64_t key) {
+            auto file = std::make_unique<MappedFile>(path);
+            if (!file->data() || file->size() < sizeof(CacheHeader)) {
+                return false;
+            }
+            CacheHeader header;
+            std::memcpy(&header, file->data(), sizeof(header));
+            if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.key != key ||
+                header.prim_count != bvh.mesh->indices.size() ||
+                file->size() != sizeof(CacheHeader) + header.node_count * sizeof(WideBVHNode<N>) +
+                                    header.prim_count * sizeof(uint32_t)) {
+                spdlog::warn("ignoring stale bvh cache {}", path.string());
+                return false;
+            }
+            const char *nodes = file->data() + sizeof(CacheHeader);
+            const char *prims = nodes + header.node_count * sizeof(WideBVHNode<N>);
+            // The header keeps the nodes aligned in a page-aligned mapping. A file read into memory is not aligned for
+            // the SIMD loads of the traversal, so its nodes are copied.
+            if ((uintptr_t)nodes % alignof(WideBVHNode<N>) == 0) {
+                bvh.nodes = BufferView<const WideBVHNode<N>>((const WideBVHNode<N> *)nodes, header.node_count);
+            } else {
+                bvh.node_storage.resize(header.node_count);
+                std::memcpy((void *)bvh.node_storage.data(), nodes, header.node_count * sizeof(WideBVHNode<N>));
+                bvh.nodes = BufferView<const WideBVHNode<N>>(bvh.node_storage.data(), bvh.node_storage.size());
+            }
+            bvh.prim_indices = BufferView<const uint32_t>((const uint32_t *)prims, header.prim_count);
+            bvh.footprint.set(file->size());
+            bvh.file       = std::move(file);
+            bvh.from_cache = true;
+            return true;
+        }
+        template <int N>
+        static void write_cache(const MeshBVH<N> &bvh, const fs::path &path, uint64_t key) {
+            CacheHeader header{};
+            header.magic      = CACHE_MAGIC;
+            header.version    = CACHE_VERSION;
+            header.key        = key;
+            header.node_count = bvh.nodes.size();
+            header.prim_count = bvh.prim_indices.size();
+            // written under a name of its own per process and thread, so that concurrent renders sharing the cache
+            // directory never write the same file or map a partial one
+            auto tmp = path;
+#ifdef _WIN32
+            const uint64_t pid = _getpid();
+#else
+            const uint64_t pid = getpid();
+#endif
+            tmp += fmt::format(".{}.{}.tmp", pid, (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id()));
+            {
+                std::ofstream out(tmp, std::ios::binary);
+                out.write((const char *)&header, sizeof(header));
+                out.write((const char *)bvh.nodes.begin(), sizeof(WideBVHNode<N>) * bvh.nodes.size());
+                out.write((const char *)bvh.prim_indices.begin(), sizeof(uint32_t) * bvh.prim_indices.size());
+                if (!out) {
+                    spdlog::warn("failed to write bvh cache {}", tmp.string());
+                    return;
+                }
+            }
+            std::error_code ec;
+            fs::rename(tmp, path, ec);
+            if (ec) {
+                spdlog::warn("failed to write bvh cache {}: {}", path.string(), ec.message());
+                fs::remove(tmp, ec);
+            }
+        }
+        template <int N>
+        static void build_mesh_bvh(MeshBVH<N> &bvh, const BVHBuildSettings &settings) {
+            const auto &mesh = *bvh.mesh;
+            std::vector<Bounds3f> prim_bounds(mesh.indices.size());
+            for (size_t i = 0; i < mesh.indices.size(); i++) {
+                const auto &idx = mesh.indices[i];
+                prim_bounds[i]  = Bounds3f()
+                                     .expand(mesh.vertices[idx[0]])
+                                     .expand(mesh.vertices[idx[1]])
+                                     .expand(mesh.vertices[idx[2]]);
+            }
+            auto binary      = build_bvh(prim_bounds, settings);
+            bvh.node_storage = collapse_bvh<N>(binary.nodes);
+            bvh.prim_storage = std::move(binary.prim_indices);
+            bvh.nodes        = BufferView<const WideBVHNode<N>>(bvh.node_storage.data(), bvh.node_storage.size());
+            bvh.prim_indices = BufferView<const uint32_t>(bvh.prim_storage.data(), bvh.prim_storage.size());
+            bvh.footprint.set(sizeof(WideBVHNode<N>) * bvh.nodes.size() + sizeof(uint32_t) * bvh.prim_indices.size());
+        }
+    } // namespace bvh_internal
+
+    BVHBuildResult build_bvh(const std::vector<Bounds3f> &prim_bounds, const BVHBuildSettings &settings) {
+        using namespace bvh_internal;
+        BVHBuildResult result;
+        if (prim_bounds.empty()) {
+            return result;
+        }
+        std::vector<BuildPrim> prims(prim_bounds.size());
+        thread::parallel_for(
+            prims.size(),
+            [&](size_t i, uint32_t) {
+                prims[i].bounds   = prim_bounds[i];
+                prims[i].centroid = prim_bounds[i].centroid();
+                prims[i].index    = (uint32_t)i;
+            },
+            4096);
+        result.nodes.reserve(2 * prims.size() / std::max<uint32_t>(1, settings.max_leaf_size) + 1);
+        Builder(settings, prims).build(result.nodes, 0, (uint32_t)prims.size(), 0);
+        result.nodes.shrink_to_fit();
+        result.prim_indices.resize(prims.size());
+        for (size_t i = 0; i < prims.size(); i++) {
+            result.prim_indices[i] = prims[i].index;
+        }
+        return result;
+    }
+    template <int N>
+    std::vector<WideBVHNode<N>> collapse_bvh(const std::vector<BVHNode> &nodes) {
+        std::vector<WideBVHNode<N>> wide;
+        if (nodes.empty()) {
+            return wide;
+        }
+        wide.reserve(nodes.size() / (N - 1) + 1);
+        bvh_internal::Collapser<N>(nodes, wide).collapse(0);
+        wide.shrink_to_fit();
+        return wide;
+    }
+    template std::vector<WideBVHNode<4>> collapse_bvh<4>(const std::vector<BVHNode> &nodes);
+    template std::vector<WideBVHNode<8>> collapse_bvh<8>(const std::vector<BVHNode> &nodes);
+
+    // Two-level N-wide BVH: one BVH per mesh in object space and one over the instances. Mesh BVHs are cached on
+    // disk when a cache directory is given.
+    template <int N>
+    class BVHAccelImpl : public EmbreeAccel {
+        fs::path cache_dir;
+        AccelProfile profile;
+        std::unordered_map<const scene::Mesh *, std::unique_ptr<bvh_internal::MeshBVH<N>>> mesh_bvhs;
+        std::vector<bvh_internal::InstanceBVH<N>> instances;
+        std::vector<WideBVHNode<N>> top_storage;
+        std::vector<uint32_t> top_prim_indices;
+        BufferView<const WideBVHNode<N>> top_nodes;
+
+        static Bounds3f node_bounds(const WideBVHNode<N> &node) {
+            Bounds3f bounds;
+            for (int i = 0; i < N; i++) {
+                bounds = bounds.merge(Bounds3f(vec3(node.pmin[0][i], node.pmin[1][i], node.pmin[2][i]),
+                                               vec3(node.pmax[0][i], node.pmax[1][i], node.pmax[2][i])));
+            }
+            return bounds;
+        }
+        template <bool AnyHit>
+        bool traverse(const Ray &ray, Float &tmax, Intersection *isct) const {
+            auto intersect_instance = [&](uint32_t i, Float &t_top) {
+                const uint32_t inst_id = top_prim_indices[i];
+                const auto &inst       = instances[inst_id];
+                const vec3 o           = inst.to_object.apply_point(ray.o);
+                const vec3 d           = inst.to_object.apply_vector(ray.d);
+                const auto &blas       = *inst.blas;
+                // the ray is not renormalized, so t is the same in both spaces
+                auto intersect_prim = [&](uint32_t j, Float &t_blas) {
+                    const uint32_t prim = blas.prim_indices[j];
+                    Float t;
+                    vec2 uv;
+                    if (!bvh_internal::intersect_triangle(*blas.mesh, prim, o, d, ray.tmin, t_blas, t, uv)) {
+                        return false;
+                    }
+                    t_blas = t;
+                    if (isct) {
+                        isct->t       = t;
+                        isct->uv      = uv;
+                        isct->geom_id = (int)inst_id;
+                        isct->prim_id = (int)prim;
+                    }
+                    return true;
+                };
+                return traverse_wide_bvh<N, AnyHit>(blas.nodes, o, d, ray.tmin, t_top, intersect_prim);
+            };
+            return traverse_wide_bvh<N, AnyHit>(top_nodes, ray.o, ray.d, ray.tmin, tmax, intersect_instance);
+        }
+
+      public:
+        BVHAccelImpl(fs::path cache_dir, AccelProfile profile) : cache_dir(std::move(cache_dir)), profile(profile) {}
+        void build(const Scene &scene, const std::shared_ptr<scene::SceneGraph> &scene_graph) override {
+            using namespace bvh_internal;
+            AKR_TRACE_SCOPE("bvh build");
+            spdlog::info("building {}-wide bvh for {} meshes, {} instances", N, scene_graph->meshes.size(),
+                         scene.instances.size());
+            Timer timer;
+            timer.start();
+            std::vector<MeshBVH<N> *> blas;
+            for (auto &mesh : scene_graph->meshes) {
+                auto &bvh = mesh_bvhs[mesh.get()];
+                if (!bvh) {
+                    bvh       = std::make_unique<MeshBVH<N>>();
+                    bvh->mesh = mesh.get();
+                    blas.emplace_back(bvh.get());
+                }
+            }
+            if (!cache_dir.empty()) {
+                std::error_code ec;
+                fs::create_directories(cache_dir, ec);
+            }
+            const auto settings = mesh_build_settings(profile);
+            std::atomic_uint32_t cached{0};
+            // meshes are built concurrently, the build of a large mesh is parallel itself
+            thread::parallel_for(
+                blas.size(),
+                [&](size_t i, uint32_t) {
+                    auto &bvh = *blas[i];
+                    if (cache_dir.empty()) {
+                        build_mesh_bvh(bvh, settings);
+                        return;
+                    }
+                    const uint64_t key = cache_key(*bvh.mesh, settings, N);
+                    const auto path    = cache_dir / fmt::format("{:016x}.bvh", key);
+                    if (load_cached(bvh, path, key)) {
+                        cached++;
+                        return;
+                    }
+                    build_mesh_bvh(bvh, settings);
+                    write_cache(bvh, path, key);
+                },
+                1);
+            instances.clear();
+            std::vector<Bounds3f> instance_bounds;
+            for (auto &instance : scene.instances) {
+                InstanceBVH<N> inst;
+                inst.blas      = mesh_bvhs.at(instance.mesh).get();
+                inst.to_object = instance.transform.inverse();
+                Bounds3f bounds;
+                if (inst.blas->nodes.size() > 0) {
+                    const auto local = node_bounds(inst.blas->nodes[0]);
+                    for (int c = 0; c < 8; c++) {
+                        vec3 corner((c & 1) ? local.pmax.x : local.pmin.x, (c & 2) ? local.pmax.y : local.pmin.y,
+                                    (c & 4) ? local.pmax.z : local.pmin.z);
+                        bounds = bounds.expand(instance.transform.apply_point(corner));
+                    }
+                }
+                instances.emplace_back(inst);
+                instance_bounds.emplace_back(bounds);
+            }
+            auto top_settings          = settings;
+            top_settings.max_leaf_size = 1;
+            auto top                   = build_bvh(instance_bounds, top_settings);
+            top_storage                = collapse_bvh<N>(top.nodes);
+            top_prim_indices           = std::move(top.prim_indices);
+            top_nodes                  = BufferView<const WideBVHNode<N>>(top_storage.data(), top_storage.size());
+            timer.stop();
+            spdlog::info("bvh built in {:.3f}s, {} of {} meshes loaded from cache", timer.elapsed_seconds(),
+                         cached.load(), blas.size());
+        }
+        std::optional<Intersection> intersect1(const Ray &ray) const override {
+            Intersection isct;
+            Float tmax = ray.tmax;
+            if (!traverse<false>(ray, tmax, &isct)) {
+                return std::nullopt;
+            }
+            return isct;
+        }
+        bool occlude1(const Ray &ray) const override {
+            Float tmax = ray.tmax;
+            return traverse<true>(ray, tmax, nullptr);
+        }
+        void intersect_stream(const RayStream &rays, HitStream &hits) const override {
+            hits.resize(rays.size());
+            for (size_t i = 0; i < rays.size(); i++) {
+                Intersection isct;
+                Float tmax = rays.tmax[i];
+                Ray ray(vec3(rays.ox[i], rays.oy[i], rays.oz[i]), vec3(rays.dx[i], rays.dy[i], rays.dz[i]),
+                        rays.tmin[i], rays.tmax[i]);
+                traverse<false>(ray, tmax, &isct);
+                hits.t[i]       = isct.t;
+                hits.u[i]       = isct.uv.x;
+                hits.v[i]       = isct.uv.y;
+                hits.geom_id[i] = isct.geom_id;
+                hits.prim_id[i] = isct.prim_id;
+            }
+        }
+        void occlude_stream(const RayStream &rays, std::vector<uint8_t> &occluded) const override {
+            occluded.resize(rays.size());
+            for (size_t i = 0; i < rays.size(); i++) {
+                Float tmax = rays.tmax[i];
+                Ray ray(vec3(rays.ox[i], rays.oy[i], rays.oz[i]), vec3(rays.dx[i], rays.dy[i], rays.dz[i]),
+                        rays.tmin[i], rays.tmax[i]);
+                occluded[i] = traverse<true>(ray, tmax, nullptr);
+            }
+        }
+        Bounds3f world_bounds() const override {
+            if (top_nodes.size() == 0) {
+                return Bounds3f();
+            }
+            return node_bounds(top_nodes[0]);
+        }
+    };
+    std::shared_ptr<EmbreeAccel> create_bvh_accel(const std::string &cache_dir, int width, AccelProfile profile) {
+        if (width == 4) {
+            return std::make_shared<BVHAccelImpl<4>>(fs::path(cache_dir), profile);
+        }
+        if (width != 8) {
+            spdlog::warn("unsupported bvh width {}, using 8", width);
+        }
+        return std::make_shared<BVHAccelImpl<8>>(fs::path(cache_dir), profile);
+    }
+} // namespace akari::render
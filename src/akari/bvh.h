@@ -0,0 +1,289 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <vector>
+#include <akari/util.h>
+#ifdef __AVX2__
+#    include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#    include <intrin.h>
+#endif
+
+namespace akari::render {
+    // Node of a flattened binary BVH. The first child of an interior node follows it directly, the second one is at
+    // offset. A leaf holds count primitives starting at offset in the primitive order of the BVH.
+    struct alignas(32) BVHNode {
+        vec3 pmin;
+        uint32_t offset = 0;
+        vec3 pmax;
+        uint16_t count = 0; // 0 for interior nodes
+        uint8_t axis   = 0;
+        uint8_t pad    = 0;
+        bool is_leaf() const { return count > 0; }
+        Bounds3f bounds() const { return Bounds3f(pmin, pmax); }
+    };
+    static_assert(sizeof(BVHNode) == 32);
+
+    struct BVHBuildSettings {
+        uint32_t max_leaf_size = 4;
+        uint32_t sah_bins      = 16; // at most MAX_SAH_BINS
+        // grows the node bounds by a few ulps so that rounding in the slab test cannot miss them
+        bool pad_bounds = false;
+    };
+    static constexpr uint32_t MAX_SAH_BINS = 32;
+    // bound on the depth of the BVHs built by build_bvh, which sizes the traversal stacks
+    static constexpr int MAX_BVH_DEPTH = 64;
+    struct BVHBuildResult {
+        std::vector<BVHNode> nodes;
+        // primitive order referenced by the leaves
+        std::vector<uint32_t> prim_indices;
+    };
+    // Binned SAH build over the bounds of the primitives. Large ranges are binned in parallel and large subtrees
+    // are built as separate tasks of the thread pool.
+    AKR_EXPORT BVHBuildResult build_bvh(const std::vector<Bounds3f> &prim_bounds, const BVHBuildSettings &settings);
+
+    // Node of an N-wide BVH with the bounds of its children in SoA form. Unused slots have empty bounds.
+    template <int N>
+    struct alignas(32) WideBVHNode {
+        static_assert(N == 4 || N == 8);
+        float pmin[3][N];
+        float pmax[3][N];
+        // node index of an interior child, first primitive of a leaf child
+        uint32_t child[N];
+        uint16_t count[N]; // 0 for interior children
+        WideBVHNode() {
+            for (int i = 0; i < N; i++) {
+                for (int a = 0; a < 3; a++) {
+                    pmin[a][i] = Inf;
+                    pmax[a][i] = -Inf;
+                }
+                child[i] = 0;
+                count[i] = 0;
+            }
+        }
+    };
+    static_assert(sizeof(WideBVHNode<4>) == 128);
+    static_assert(sizeof(WideBVHNode<8>) == 256);
+    // Collapses a binary BVH by repeatedly opening the interior child with the largest surface area. The primitive
+    // order is unchanged.
+    template <int N>
+    std::vector<WideBVHNode<N>> collapse_bvh(const std::vector<BVHNode> &nodes);
+
+    // slab test against the box of a node, inv_d = 1 / direction
+    inline bool intersect_node(const BVHNode &node, const vec3 &o, const vec3 &inv_d, Float tmin, Float tmax) {
+        vec3 t0 = (node.pmin - o) * inv_d;
+        vec3 t1 = (node.pmax - o) * inv_d;
+        Float t_enter = std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)), std::min(t0.z, t1.z));
+        Float t_exit  = std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)), std::max(t0.z, t1.z));
+        return t_enter <= t_exit && t_exit >= tmin && t_enter <= tmax;
+    }
+
+    // Moller-Trumbore test against the triangle v0 v1 v2. A ray is treated as parallel to the plane of the triangle
+    // when the cosine of their angle is below about 1e-7, which does not depend on the size of the triangle.
+    inline bool intersect_triangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, const vec3 &o, const vec3 &d,
+                                   Float tmin, Float tmax, Float &t, vec2 &uv) {
+        const vec3 e1 = v1 - v0;
+        const vec3 e2 = v2 - v0;
+        const vec3 h  = cross(d, e2);
+        const Float a = dot(e1, h);
+        // |a| = |d| |e1 x e2| cos, bounded with |e1 x e2| <= |e1| |e2|
+        if (a * a <= Float(1e-14f) * dot(d, d) * dot(e1, e1) * dot(e2, e2))
+            return false;
+        const Float f = 1.0f / a;
+        const vec3 s  = o - v0;
+        const Float u = f * dot(s, h);
+        if (u < 0.0f || u > 1.0f)
+            return false;
+        const vec3 q  = cross(s, e1);
+        const Float v = f * dot(d, q);
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+        t = f * dot(e2, q);
+        if (t <= tmin || t >= tmax)
+            return false;
+        uv = vec2(u, v);
+        return true;
+    }
+
+    // Visits the leaves hit by a ray front to back. intersect_leaf(prim, tmax) tests the primitive at the given
+    // position of the BVH order, shrinking tmax on a hit, and returns whether it hit.
+    template <bool AnyHit, class F>
+    bool traverse_bvh(BufferView<const BVHNode> nodes, const vec3 &o, const vec3 &d, Float tmin, Float &tmax,
+                      F &&intersect_leaf) {
+        if (nodes.size() == 0) {
+            return false;
+        }
+        const vec3 inv_d  = vec3(1.0f) / d;
+        const bool neg[3] = {inv_d.x < 0, inv_d.y < 0, inv_d.z < 0};
+        uint32_t stack[MAX_BVH_DEPTH];
+        int sp       = 0;
+        uint32_t idx = 0;
+        bool hit     = false;
+        while (true) {
+            const auto &node = nodes[idx];
+            if (intersect_node(node, o, inv_d, tmin, tmax)) {
+                if (node.is_leaf()) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        if (intersect_leaf(i, tmax)) {
+                            hit = true;
+                            if constexpr (AnyHit) {
+                                return true;
+                            }
+                        }
+                    }
+                } else {
+                    if (neg[node.axis]) {
+                        stack[sp++] = idx + 1;
+                        idx         = node.offset;
+                    } else {
+                        stack[sp++] = node.offset;
+                        idx         = idx + 1;
+                    }
+                    continue;
+                }
+            }
+            if (sp == 0) {
+                break;
+            }
+            idx = stack[--sp];
+        }
+        return hit;
+    }
+
+    // x != 0
+    inline int count_trailing_zeros(uint32_t x) {
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, x);
+        return (int)i;
+#else
+        return __builtin_ctz(x);
+#endif
+    }
+
+    // Slab test against all children of a wide node. Returns the mask of the children hit and their entry distances.
+    // The node coordinates come first in min/max so that the NaN of a ray in the plane of a slab drops out.
+    template <int N>
+    inline uint32_t intersect_wide_node(const WideBVHNode<N> &node, const vec3 &o, const vec3 &inv_d,
+                                        const bool neg[3], Float tmin, Float tmax, Float *t_near) {
+        uint32_t mask = 0;
+        for (int i = 0; i < N; i++) {
+            Float t_enter = tmin, t_exit = tmax;
+            for (int a = 0; a < 3; a++) {
+                const Float t0 = ((neg[a] ? node.pmax[a][i] : node.pmin[a][i]) - o[a]) * inv_d[a];
+                const Float t1 = ((neg[a] ? node.pmin[a][i] : node.pmax[a][i]) - o[a]) * inv_d[a];
+                t_enter        = t0 > t_enter ? t0 : t_enter;
+                t_exit         = t1 < t_exit ? t1 : t_exit;
+            }
+            t_near[i] = t_enter;
+            mask |= uint32_t(t_enter <= t_exit) << i;
+        }
+        return mask;
+    }
+#ifdef __AVX2__
+    template <>
+    inline uint32_t intersect_wide_node<4>(const WideBVHNode<4> &node, const vec3 &o, const vec3 &inv_d,
+                                           const bool neg[3], Float tmin, Float tmax, Float *t_near) {
+        __m128 t_enter = _mm_set1_ps(tmin);
+        __m128 t_exit  = _mm_set1_ps(tmax);
+        for (int a = 2; a >= 0; a--) {
+            const __m128 oa = _mm_set1_ps(o[a]);
+            const __m128 ia = _mm_set1_ps(inv_d[a]);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg[a] ? node.pmax[a] : node.pmin[a]), oa), ia);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg[a] ? node.pmin[a] : node.pmax[a]), oa), ia);
+            t_enter         = _mm_max_ps(t0, t_enter);
+            t_exit          = _mm_min_ps(t1, t_exit);
+        }
+        _mm_storeu_ps(t_near, t_enter);
+        return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+    }
+    template <>
+    inline uint32_t intersect_wide_node<8>(const WideBVHNode<8> &node, const vec3 &o, const vec3 &inv_d,
+                                           const bool neg[3], Float tmin, Float tmax, Float *t_near) {
+        __m256 t_enter = _mm256_set1_ps(tmin);
+        __m256 t_exit  = _mm256_set1_ps(tmax);
+        for (int a = 2; a >= 0; a--) {
+            const __m256 oa = _mm256_set1_ps(o[a]);
+            const __m256 ia = _mm256_set1_ps(inv_d[a]);
+            const __m256 t0 =
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(neg[a] ? node.pmax[a] : node.pmin[a]), oa), ia);
+            const __m256 t1 =
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(neg[a] ? node.pmin[a] : node.pmax[a]), oa), ia);
+            t_enter = _mm256_max_ps(t0, t_enter);
+            t_exit  = _mm256_min_ps(t1, t_exit);
+        }
+        _mm256_storeu_ps(t_near, t_enter);
+        return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+    }
+#endif
+
+    // Same contract as traverse_bvh for an N-wide BVH. Children are visited nearest first and skipped once they
+    // start behind the closest hit.
+    template <int N, bool AnyHit, class F>
+    bool traverse_wide_bvh(BufferView<const WideBVHNode<N>> nodes, const vec3 &o, const vec3 &d, Float tmin,
+                           Float &tmax, F &&intersect_leaf) {
+        if (nodes.size() == 0) {
+            return false;
+        }
+        struct Entry {
+            uint32_t index;
+            uint32_t count; // 0 for nodes
+            Float t;
+        };
+        const vec3 inv_d  = vec3(1.0f) / d;
+        const bool neg[3] = {inv_d.x < 0, inv_d.y < 0, inv_d.z < 0};
+        // each level of the binary BVH adds at most N - 1 entries
+        Entry stack[MAX_BVH_DEPTH * N];
+        int sp      = 0;
+        stack[sp++] = Entry{0, 0, tmin};
+        bool hit    = false;
+        while (sp > 0) {
+            const Entry entry = stack[--sp];
+            if (entry.t > tmax) {
+                continue;
+            }
+            if (entry.count > 0) {
+                for (uint32_t i = entry.index; i < entry.index + entry.count; i++) {
+                    if (intersect_leaf(i, tmax)) {
+                        hit = true;
+                        if constexpr (AnyHit) {
+                            return true;
+                        }
+                    }
+                }
+                continue;
+            }
+            const auto &node = nodes[entry.index];
+            alignas(32) Float t_near[N];
+            uint32_t mask = intersect_wide_node<N>(node, o, inv_d, neg, tmin, tmax, t_near);
+            // pushed by decreasing distance so that the nearest child is popped first
+            const int first = sp;
+            while (mask) {
+                const int i = count_trailing_zeros(mask);
+                mask &= mask - 1;
+                Entry e{node.child[i], node.count[i], t_near[i]};
+                int j = sp++;
+                if constexpr (!AnyHit) {
+                    for (; j > first && stack[j - 1].t < e.t; j--) {
+                        stack[j] = stack[j - 1];
+                    }
+                }
+                stack[j] = e;
+            }
+        }
+        return hit;
+    }
+} // namespace akari::render
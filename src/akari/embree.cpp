@@ -12,9 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifdef AKR_BACKEND_EMBREE
 #include <unordered_map>
 #include <akari/scenegraph.h>
 #include <akari/render.h>
+#include <akari/profile.h>
+#include <akari/memory.h>
 #include <spdlog/spdlog.h>
 #include <embree3/rtcore.h>
 namespace akari::render {
@@ -32,12 +35,29 @@ namespace akari::render {
         ray.flags = 0;
         return ray;
     }
+    static inline void load_ray(const RayStream &rays, size_t i, RTCRay &ray) {
+        ray.org_x = rays.ox[i];
+        ray.org_y = rays.oy[i];
+        ray.org_z = rays.oz[i];
+        ray.dir_x = rays.dx[i];
+        ray.dir_y = rays.dy[i];
+        ray.dir_z = rays.dz[i];
+        ray.tnear = rays.tmin[i];
+        ray.tfar  = rays.tmax[i];
+        ray.mask  = ~0u;
+        ray.time  = 0.0f;
+        ray.flags = 0;
+    }
     using scene::Mesh;
     using scene::P;
     class EmbreeAccelImpl : public EmbreeAccel {
-        RTCScene rtcScene = nullptr;
-        RTCDevice device = nullptr;
+        RTCScene rtcScene       = nullptr;
+        RTCDevice device        = nullptr;
+        RTCBuildQuality quality = RTC_BUILD_QUALITY_HIGH;
+        RTCSceneFlags flags     = RTC_SCENE_FLAG_NONE;
         std::unordered_map<const Mesh *, RTCScene> per_mesh_scene;
+        // rays are handed to embree in chunks of this size, staged in AoS form on the stack
+        static constexpr size_t STREAM_CHUNK_SIZE = 256;
 #define EMBREE_CHECK(expr)                                                                                             \
     [&] {                                                                                                              \
         expr;                                                                                                          \
@@ -46,20 +66,53 @@ namespace akari::render {
             spdlog::error("embree error: {}", err);                                                                    \
         }                                                                                                              \
     }()
+        // called by embree for every allocation (bytes > 0) and deallocation (bytes < 0) of the device
+        static bool memory_monitor(void *, ssize_t bytes, bool) {
+            if (bytes > 0) {
+                memory::record_allocation(memory::Accel, size_t(bytes));
+            } else {
+                memory::record_deallocation(memory::Accel, size_t(-bytes));
+            }
+            return true;
+        }
+
       public:
-        EmbreeAccelImpl() { device = rtcNewDevice(nullptr); }
+        explicit EmbreeAccelImpl(AccelProfile profile) {
+            switch (profile) {
+            case AccelProfile::Fast:
+                quality = RTC_BUILD_QUALITY_LOW;
+                break;
+            case AccelProfile::Compact:
+                quality = RTC_BUILD_QUALITY_MEDIUM;
+                flags   = RTC_SCENE_FLAG_COMPACT;
+                break;
+            case AccelProfile::Robust:
+                flags = RTC_SCENE_FLAG_ROBUST;
+                break;
+            default:
+                break;
+            }
+            device = rtcNewDevice(memory::huge_pages_enabled() ? "hugepages=1" : nullptr);
+            rtcSetDeviceMemoryMonitorFunction(device, memory_monitor, nullptr);
+        }
         void build(const Scene &scene, const std::shared_ptr<scene::SceneGraph> &scene_graph) override {
+            AKR_TRACE_SCOPE("embree build");
             spdlog::info("building acceleration structure for {} meshes, {} instances", scene_graph->meshes.size(),
                          scene.instances.size());
             if (rtcScene) {
                 rtcReleaseScene(rtcScene);
             }
             rtcScene = rtcNewScene(device);
-            rtcSetSceneBuildQuality(rtcScene, RTC_BUILD_QUALITY_HIGH);
+            rtcSetSceneFlags(rtcScene, flags);
+            rtcSetSceneBuildQuality(rtcScene, quality);
             for (auto &mesh : scene_graph->meshes) {
                 const auto m_scene = rtcNewScene(device);
+                rtcSetSceneFlags(m_scene, flags);
+                rtcSetSceneBuildQuality(m_scene, quality);
                 {
                     const auto geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+                    // high quality triangle geometry enables spatial splits
+                    rtcSetGeometryBuildQuality(geometry, quality);
                     AKR_ASSERT(mesh->vertices.data() != nullptr);
                     EMBREE_CHECK(rtcSetSharedGeometryBuffer(geometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
                                                             &mesh->vertices[0], 0, sizeof(float) * 3,
@@ -116,6 +169,60 @@ namespace akari::render {
             intersection.t = rayHit.ray.tfar;
             return intersection;
         }
+        void intersect_stream(const RayStream &rays, HitStream &hits) const override {
+            const size_t n = rays.size();
+            hits.resize(n);
+            RTCIntersectContext context;
+            rtcInitIntersectContext(&context);
+            context.flags = rays.coherent ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+            RTCRayHit packet[STREAM_CHUNK_SIZE];
+            for (size_t begin = 0; begin < n; begin += STREAM_CHUNK_SIZE) {
+                const size_t m = std::min<size_t>(STREAM_CHUNK_SIZE, n - begin);
+                for (size_t j = 0; j < m; j++) {
+                    auto &rayHit = packet[j];
+                    load_ray(rays, begin + j, rayHit.ray);
+                    rayHit.hit.geomID    = RTC_INVALID_GEOMETRY_ID;
+                    rayHit.hit.primID    = RTC_INVALID_GEOMETRY_ID;
+                    rayHit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+                }
+                rtcIntersect1M(rtcScene, &context, packet, (unsigned int)m, sizeof(RTCRayHit));
+                for (size_t j = 0; j < m; j++) {
+                    const auto &rayHit = packet[j];
+                    const size_t i     = begin + j;
+                    if (rayHit.hit.geomID == RTC_INVALID_GEOMETRY_ID || rayHit.hit.primID == RTC_INVALID_GEOMETRY_ID) {
+                        hits.t[i]       = Inf;
+                        hits.u[i]       = 0;
+                        hits.v[i]       = 0;
+                        hits.geom_id[i] = -1;
+                        hits.prim_id[i] = -1;
+                        continue;
+                    }
+                    hits.t[i]       = rayHit.ray.tfar;
+                    hits.u[i]       = rayHit.hit.u;
+                    hits.v[i]       = rayHit.hit.v;
+                    hits.geom_id[i] = rayHit.hit.instID[0];
+                    hits.prim_id[i] = rayHit.hit.primID;
+                }
+            }
+        }
+        void occlude_stream(const RayStream &rays, std::vector<uint8_t> &occluded) const override {
+            const size_t n = rays.size();
+            occluded.resize(n);
+            RTCIntersectContext context;
+            rtcInitIntersectContext(&context);
+            context.flags = rays.coherent ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+            RTCRay packet[STREAM_CHUNK_SIZE];
+            for (size_t begin = 0; begin < n; begin += STREAM_CHUNK_SIZE) {
+                const size_t m = std::min<size_t>(STREAM_CHUNK_SIZE, n - begin);
+                for (size_t j = 0; j < m; j++) {
+                    load_ray(rays, begin + j, packet[j]);
+                }
+                rtcOccluded1M(rtcScene, &context, packet, (unsigned int)m, sizeof(RTCRay));
+                for (size_t j = 0; j < m; j++) {
+                    occluded[begin + j] = packet[j].tfar == -std::numeric_limits<float>::infinity();
+                }
+            }
+        }
         Bounds3f world_bounds() const override {
             RTCBounds bounds;
             rtcGetSceneBounds(rtcScene, &bounds);
@@ -130,5 +237,8 @@ namespace akari::render {
             rtcReleaseDevice(device);
         }
     };
-    std::shared_ptr<EmbreeAccel> create_embree_accel() { return std::make_shared<EmbreeAccelImpl>(); }
-} // namespace akari::render
\ No newline at end of file
+    std::shared_ptr<EmbreeAccel> create_embree_accel(AccelProfile profile) {
+        return std::make_shared<EmbreeAccelImpl>(profile);
+    }
+} // namespace akari::render
+#endif
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <akari/image.h>
+#include <akari/profile.h>
 #include <spdlog/spdlog.h>
 #include <stb/stb_image.h>
 #include <stb/stb_image_write.h>
@@ -164,6 +165,7 @@ namespace akari {
         }
     }
     bool write_generic_image(const Image &image, const fs::path &path) {
+        AKR_TRACE_SCOPE("write image");
         if (path.extension() == ".exr") {
             return write_hdr(image, path);
         } else {
@@ -0,0 +1,201 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <atomic>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+#include <akari/memory.h>
+#include <spdlog/spdlog.h>
+#ifdef __linux__
+#    include <sys/mman.h>
+#    include <unistd.h>
+#endif
+
+namespace akari::memory {
+    namespace memory_internal {
+        struct alignas(64) Counter {
+            std::atomic_size_t current{0};
+            std::atomic_size_t peak{0};
+        };
+        static Counter counters[NumCategories];
+        static const char *names[NumCategories] = {"mesh",  "texture", "accel", "film",
+                                                   "sdtree", "light",  "scene", "scratch"};
+        static std::atomic_bool huge_pages{false};
+
+        class HugePageResource : public astd::pmr::memory_resource {
+            static bool mapped(size_t bytes, size_t alignment) {
+#ifdef __linux__
+                return bytes >= HUGE_PAGE_SIZE && alignment <= HUGE_PAGE_SIZE;
+#else
+                (void)bytes;
+                (void)alignment;
+                return false;
+#endif
+            }
+#ifdef __linux__
+            static size_t mapping_size(size_t bytes) {
+                static const auto page_size = (size_t)sysconf(_SC_PAGESIZE);
+                return (bytes + page_size - 1) & ~(page_size - 1);
+            }
+#endif
+            // blocks of mapped sizes that came from new_delete_resource() because mmap failed
+            std::mutex fallback_m;
+            std::unordered_set<void *> fallback_blocks;
+
+          protected:
+            void *do_allocate(size_t bytes, size_t alignment) override {
+                if (!mapped(bytes, alignment)) {
+                    return astd::pmr::new_delete_resource()->allocate(bytes, alignment);
+                }
+#ifdef __linux__
+                // map one huge page more than needed and trim the mapping to start at a huge page boundary,
+                // only fully covered 2 MiB extents can be backed by huge pages
+                const size_t size = mapping_size(bytes);
+                void *raw = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                 -1, 0);
+                if (raw == MAP_FAILED) {
+                    static std::once_flag flag;
+                    std::call_once(flag, [] { spdlog::warn("mmap failed, large buffers use regular allocations"); });
+                    void *p = astd::pmr::new_delete_resource()->allocate(bytes, alignment);
+                    std::lock_guard<std::mutex> lock(fallback_m);
+                    fallback_blocks.emplace(p);
+                    return p;
+                }
+                auto begin = ((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+                if (begin > (uintptr_t)raw) {
+                    munmap(raw, begin - (uintptr_t)raw);
+                }
+                munmap((void *)(begin + size), (uintptr_t)raw + HUGE_PAGE_SIZE - begin);
+                if (madvise((void *)begin, size, MADV_HUGEPAGE) != 0) {
+                    static std::once_flag flag;
+                    std::call_once(flag, [] { spdlog::warn("MADV_HUGEPAGE failed, using regular pages"); });
+                }
+                return (void *)begin;
+#else
+                return nullptr;
+#endif
+            }
+            void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+                if (!mapped(bytes, alignment)) {
+                    astd::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+                    return;
+                }
+#ifdef __linux__
+                {
+                    std::lock_guard<std::mutex> lock(fallback_m);
+                    if (fallback_blocks.erase(p) != 0) {
+                        astd::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+                        return;
+                    }
+                }
+                munmap(p, mapping_size(bytes));
+#endif
+            }
+            bool do_is_equal(const memory_resource &other) const noexcept override { return this == &other; }
+        };
+
+        static std::array<TrackingResource *, NumCategories> make_trackers(astd::pmr::memory_resource *upstream) {
+            std::array<TrackingResource *, NumCategories> r;
+            for (int i = 0; i < NumCategories; i++) {
+                r[i] = new TrackingResource(Category(i), upstream);
+            }
+            return r;
+        }
+    } // namespace memory_internal
+
+    const char *category_name(Category c) { return memory_internal::names[c]; }
+    void record_allocation(Category c, size_t bytes) {
+        auto &counter = memory_internal::counters[c];
+        auto current  = counter.current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        auto peak     = counter.peak.load(std::memory_order_relaxed);
+        while (current > peak && !counter.peak.compare_exchange_weak(peak, current, std::memory_order_relaxed)) {
+        }
+    }
+    void record_deallocation(Category c, size_t bytes) {
+        memory_internal::counters[c].current.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    Report report() {
+        Report r;
+        for (int c = 0; c < NumCategories; c++) {
+            r[c].current = memory_internal::counters[c].current.load(std::memory_order_relaxed);
+            r[c].peak    = memory_internal::counters[c].peak.load(std::memory_order_relaxed);
+        }
+        return r;
+    }
+    void reset_peaks() {
+        for (auto &counter : memory_internal::counters) {
+            counter.peak.store(counter.current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+    void print(const Report &report) {
+        size_t current = 0, peak = 0;
+        for (int c = 0; c < NumCategories; c++) {
+            if (report[c].peak == 0)
+                continue;
+            spdlog::info("memory {:>8}: {:10.2f} MB current, {:10.2f} MB peak", category_name(Category(c)),
+                         report[c].current / 1048576.0, report[c].peak / 1048576.0);
+            current += report[c].current;
+            peak += report[c].peak;
+        }
+        // the sum of the peaks is an upper bound, the categories peak at different times
+        spdlog::info("memory    total: {:10.2f} MB current, {:10.2f} MB peak (sum)", current / 1048576.0,
+                     peak / 1048576.0);
+    }
+    astd::pmr::memory_resource *resource(Category c) {
+        // never destroyed, blocks may still be returned during static destruction
+        static const auto resources = memory_internal::make_trackers(astd::pmr::new_delete_resource());
+        return resources[c];
+    }
+    astd::pmr::memory_resource *huge_page_resource() {
+        static auto *resource = new memory_internal::HugePageResource();
+        return resource;
+    }
+    void set_huge_pages(bool enable) {
+        memory_internal::huge_pages = enable;
+        if (!enable) {
+            return;
+        }
+#ifdef __linux__
+        std::ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string mode;
+        std::getline(in, mode);
+        if (mode.find("[never]") != std::string::npos) {
+            spdlog::warn("transparent huge pages are disabled by the kernel, buffers will use regular pages");
+        }
+#else
+        spdlog::warn("huge pages are not supported on this platform");
+#endif
+    }
+    bool huge_pages_enabled() { return memory_internal::huge_pages; }
+    astd::pmr::memory_resource *buffer_resource(Category c) {
+        static const auto resources = memory_internal::make_trackers(huge_page_resource());
+        return huge_pages_enabled() ? resources[c] : resource(c);
+    }
+    size_t available_system_memory() {
+#ifdef __linux__
+        std::ifstream in("/proc/meminfo");
+        std::string key;
+        size_t kb = 0;
+        while (in >> key >> kb) {
+            if (key == "MemAvailable:") {
+                return kb * 1024;
+            }
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+#endif
+        return 0;
+    }
+} // namespace akari::memory
@@ -0,0 +1,123 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <array>
+#include <string>
+#include <akari/util.h>
+
+// Memory accounting by subsystem
+namespace akari::memory {
+    enum Category {
+        Mesh,    // vertex and index buffers
+        Texture, // decoded images
+        Accel,   // BVH, as reported by the ray tracing backend
+        Film,
+        SDTree,
+        Light,   // light objects and light sampler
+        Scene,   // materials, media and other scene objects
+        Scratch, // per-thread arenas of the integrators
+        NumCategories
+    };
+    AKR_EXPORT const char *category_name(Category c);
+    AKR_EXPORT void record_allocation(Category c, size_t bytes);
+    AKR_EXPORT void record_deallocation(Category c, size_t bytes);
+    struct Usage {
+        size_t current = 0;
+        size_t peak    = 0;
+    };
+    using Report = std::array<Usage, NumCategories>;
+    AKR_EXPORT Report report();
+    // peaks restart from the current values
+    AKR_EXPORT void reset_peaks();
+    AKR_EXPORT void print(const Report &report);
+
+    // Adaptor recording every block that goes through it in its category
+    class AKR_EXPORT TrackingResource : public astd::pmr::memory_resource {
+        astd::pmr::memory_resource *upstream;
+        Category category;
+
+      public:
+        TrackingResource(Category category, astd::pmr::memory_resource *upstream)
+            : upstream(upstream), category(category) {}
+        astd::pmr::memory_resource *upstream_resource() const { return upstream; }
+
+      protected:
+        void *do_allocate(size_t bytes, size_t alignment) override {
+            void *p = upstream->allocate(bytes, alignment);
+            record_allocation(category, bytes);
+            return p;
+        }
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+            upstream->deallocate(p, bytes, alignment);
+            record_deallocation(category, bytes);
+        }
+        bool do_is_equal(const memory_resource &other) const noexcept override { return this == &other; }
+    };
+    // process-wide tracking resource of a category on top of new_delete_resource()
+    AKR_EXPORT astd::pmr::memory_resource *resource(Category c);
+
+    // Blocks of at least HUGE_PAGE_SIZE bytes are mapped at a 2 MiB boundary and advised as transparent huge pages,
+    // smaller blocks go to new_delete_resource(). Falls back to new_delete_resource() entirely where mmap is not
+    // available.
+    static constexpr size_t HUGE_PAGE_SIZE = 2ull * 1024 * 1024;
+    AKR_EXPORT astd::pmr::memory_resource *huge_page_resource();
+    AKR_EXPORT void set_huge_pages(bool enable);
+    AKR_EXPORT bool huge_pages_enabled();
+    // resource for large, long-lived buffers (film, meshes): resource(c), or a tracking resource of c on top of
+    // huge_page_resource() when huge pages are enabled. Blocks go back to the resource they came from, so toggling
+    // huge pages only affects later allocations.
+    AKR_EXPORT astd::pmr::memory_resource *buffer_resource(Category c);
+    // physical memory that can be allocated without swapping, in bytes; 0 where unknown
+    AKR_EXPORT size_t available_system_memory();
+
+    // Accounts for storage that does not come from a memory_resource, such as std::vector members.
+    // The owner calls set() whenever the size changes; copies count again.
+    class Footprint {
+        Category category;
+        size_t bytes = 0;
+
+      public:
+        explicit Footprint(Category category) : category(category) {}
+        Footprint(const Footprint &rhs) : category(rhs.category) { set(rhs.bytes); }
+        Footprint(Footprint &&rhs) noexcept : category(rhs.category), bytes(rhs.bytes) { rhs.bytes = 0; }
+        Footprint &operator=(const Footprint &rhs) {
+            if (this != &rhs) {
+                set(0);
+                category = rhs.category;
+                set(rhs.bytes);
+            }
+            return *this;
+        }
+        Footprint &operator=(Footprint &&rhs) noexcept {
+            if (this != &rhs) {
+                set(0);
+                category  = rhs.category;
+                bytes     = rhs.bytes;
+                rhs.bytes = 0;
+            }
+            return *this;
+        }
+        ~Footprint() { set(0); }
+        void set(size_t new_bytes) {
+            if (new_bytes > bytes) {
+                record_allocation(category, new_bytes - bytes);
+            } else if (new_bytes < bytes) {
+                record_deallocation(category, bytes - new_bytes);
+            }
+            bytes = new_bytes;
+        }
+        size_t size() const { return bytes; }
+    };
+} // namespace akari::memory
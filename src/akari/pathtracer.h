@@ -16,6 +16,7 @@
 
 #include <akari/util.h>
 #include <akari/render.h>
+#include <akari/profile.h>
 
 namespace akari::render ::pt {
 
@@ -202,6 +203,7 @@ namespace akari::render ::pt {
             : PathTracerBase(scene, sampler, alloc, min_depth, max_depth), visitor(this) {}
 
         CameraSample camera_ray(const Camera *camera, const ivec2 &p) noexcept {
+            stats::add(stats::CameraRays);
             CameraSample sample = camera->generate_ray(sampler->next2d(), sampler->next2d(), p);
             return sample;
         }
@@ -272,21 +274,19 @@ namespace akari::render ::pt {
         std::optional<SurfaceVertex> on_surface_scatter(const Vec3 &wo, SurfaceInteraction &si,
                                                         const std::optional<PathVertex> &prev_vertex) noexcept {
             auto *material = si.material();
-            if (si.triangle.light) {
-                on_hit_light(si.triangle.light, wo, si.sp(), prev_vertex);
+            if (si.light()) {
+                on_hit_light(si.light(), wo, si.sp(), prev_vertex);
                 return std::nullopt;
             } else if (depth < max_depth) {
                 SurfaceVertex vertex(wo, si);
                 auto bsdf = material->evaluate(*sampler, allocator, si);
                 BSDFSampleContext sample_ctx{sampler->next1d(), sampler->next2d(), wo};
                 auto sample = bsdf.sample(sample_ctx);
-                if (!sample) {
+                if (!sample || sample->pdf == 0.0f) {
+                    stats::add(stats::BSDFSampleFailures);
                     return std::nullopt;
                 }
                 AKR_ASSERT(sample->pdf >= 0.0f);
-                if (sample->pdf == 0.0f) {
-                    return std::nullopt;
-                }
                 vertex.bsdf = bsdf;
                 vertex.ray = Ray(si.p, sample->wi, Eps / std::abs(glm::dot(si.ng, sample->wi)));
                 vertex.beta = sample->f * (std::abs(glm::dot(si.ns, sample->wi)) / sample->pdf);
@@ -327,6 +327,7 @@ namespace akari::render ::pt {
                     if (continue_prob > sampler->next1d()) {
                         accumulate_beta(Spectrum(1.0 / continue_prob));
                     } else {
+                        stats::add(stats::RussianRouletteTerminations);
                         break;
                     }
                 }
@@ -342,6 +343,8 @@ namespace akari::render ::pt {
             auto camera_sample = camera_ray(camera, p);
             Ray ray = camera_sample.ray;
             run_megakernel(ray, std::nullopt);
+            stats::add(stats::Paths);
+            stats::add(stats::PathVertices, depth);
         }
     };
 
@@ -359,6 +362,7 @@ namespace akari::render ::pt {
         UnifiedPathTracer(const Scene *scene, Sampler *sampler, Allocator<> alloc, int min_depth, int max_depth)
             : PathTracerBase(scene, sampler, alloc, min_depth, max_depth), visitor(this) {}
         CameraSample camera_ray(const Camera *camera, const ivec2 &p) noexcept {
+            stats::add(stats::CameraRays);
             CameraSample sample = camera->generate_ray(sampler->next2d(), sampler->next2d(), p);
             return sample;
         }
@@ -469,13 +473,11 @@ namespace akari::render ::pt {
                 auto bsdf = material->evaluate(*sampler, allocator, si);
                 BSDFSampleContext sample_ctx{sampler->next1d(), sampler->next2d(), wo};
                 auto sample = bsdf.sample(sample_ctx);
-                if (!sample) {
+                if (!sample || sample->pdf == 0.0f) {
+                    stats::add(stats::BSDFSampleFailures);
                     return std::nullopt;
                 }
                 AKR_ASSERT(sample->pdf >= 0.0f);
-                if (sample->pdf == 0.0f) {
-                    return std::nullopt;
-                }
                 vertex.bsdf = bsdf;
                 vertex.ray = spawn_ray(si.p, sample->wi, si.ng);
                 // vertex.ray = Ray(si.p, sample->wi, Eps / std::abs(glm::dot(si.ng, sample->wi)));
@@ -496,6 +498,7 @@ namespace akari::render ::pt {
                 if (!st.empty()) {
                     tr *= st.top()->transmittance(ray, *sampler);
                 }
+                stats::add(stats::TransmittanceSteps);
                 iter++;
                 if (iter > 1024) {
                     fprintf(stderr, "Max iteration in transmittance() reached\n");
@@ -536,8 +539,8 @@ namespace akari::render ::pt {
                     if (!mi)
                         st.update(*si, ray);
 
-                    if (si->triangle.light) {
-                        on_hit_light(si->triangle.light, wo, si->sp(), prev_vertex);
+                    if (si->light()) {
+                        on_hit_light(si->light(), wo, si->sp(), prev_vertex);
                         break;
                     }
                 }
@@ -602,6 +605,7 @@ namespace akari::render ::pt {
                     if (continue_prob > sampler->next1d()) {
                         accumulate_beta(Spectrum(1.0 / continue_prob));
                     } else {
+                        stats::add(stats::RussianRouletteTerminations);
                         break;
                     }
                 }
@@ -614,6 +618,8 @@ namespace akari::render ::pt {
             Ray ray = camera_sample.ray;
             MediumStack<> st;
             run_megakernel(ray, st, std::nullopt);
+            stats::add(stats::Paths);
+            stats::add(stats::PathVertices, depth);
         }
     };
 
@@ -12,6 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <akari/pmr.h>
 
 namespace akari::astd {
@@ -25,7 +31,8 @@ namespace akari::astd {
                 AKR_ASSERT(p);
                 return p;
 #else
-                return aligned_alloc(alignment, bytes);
+                // aligned_alloc requires the size to be a multiple of the alignment
+                return aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
 #endif
             }
             void do_deallocate(void *p, size_t bytes, size_t alignment) {
@@ -46,5 +53,349 @@ namespace akari::astd {
             return tmp;
         }
         AKR_EXPORT memory_resource *get_default_resource() noexcept { return _default_resource; }
+
+        namespace pool_internal {
+            static constexpr size_t CHUNK_SIZE            = 65536;
+            static constexpr size_t MIN_BLOCK_SIZE        = 16;
+            static constexpr size_t MAX_BLOCK_SIZE        = CHUNK_SIZE / 4;
+            static constexpr size_t DEFAULT_LARGEST_BLOCK = 4096;
+            static constexpr size_t MAX_ALIGNMENT         = 64;
+            static constexpr size_t NUM_SIZE_CLASSES      = 11; // 16 .. MAX_BLOCK_SIZE
+            // empty chunks a heap keeps before returning them upstream
+            static constexpr size_t MAX_EMPTY_CHUNKS = 4;
+
+            struct FreeBlock {
+                FreeBlock *next;
+            };
+            struct Heap;
+            // placed at the start of its chunk, so that the chunk of a block is found by masking its address
+            struct Chunk {
+                Heap *heap;
+                size_t index; // in Heap::chunks
+                uint32_t size_class, block_size;
+                uint32_t capacity, carved, used;
+                FreeBlock *free;
+                // list of chunks of the same size class with free blocks
+                Chunk *prev, *next;
+                bool linked;
+                astd::byte *block(uint32_t i);
+            };
+            static constexpr size_t CHUNK_HEADER_SIZE = 2 * MAX_ALIGNMENT;
+            static_assert(sizeof(Chunk) <= CHUNK_HEADER_SIZE);
+            inline astd::byte *Chunk::block(uint32_t i) {
+                return (astd::byte *)this + CHUNK_HEADER_SIZE + size_t(i) * block_size;
+            }
+            static Chunk *chunk_of(void *p) { return (Chunk *)((uintptr_t)p & ~(uintptr_t(CHUNK_SIZE) - 1)); }
+            static uint32_t size_class_of(size_t bytes) {
+                uint32_t c = 0;
+                while ((MIN_BLOCK_SIZE << c) < bytes) {
+                    c++;
+                }
+                return c;
+            }
+
+            // Free lists owned by one thread
+            struct Heap {
+                memory_resource *upstream;
+                uint32_t max_blocks_per_chunk;
+                std::array<Chunk *, NUM_SIZE_CLASSES> available{};
+                std::vector<Chunk *> chunks;
+                std::vector<Chunk *> empty;
+                // blocks freed by other threads
+                std::atomic<FreeBlock *> remote_free{nullptr};
+
+                Heap(memory_resource *upstream, uint32_t max_blocks_per_chunk)
+                    : upstream(upstream), max_blocks_per_chunk(max_blocks_per_chunk) {}
+                Heap(const Heap &) = delete;
+                ~Heap() { release(); }
+                void *allocate(uint32_t size_class) {
+                    if (!available[size_class]) {
+                        collect_remote_free();
+                    }
+                    if (!available[size_class]) {
+                        init_chunk(new_chunk(), size_class);
+                    }
+                    Chunk *c = available[size_class];
+                    void *p;
+                    if (c->free) {
+                        p       = c->free;
+                        c->free = c->free->next;
+                    } else {
+                        p = c->block(c->carved++);
+                    }
+                    if (++c->used == c->capacity) {
+                        unlink(c);
+                    }
+                    return p;
+                }
+                void deallocate(void *p) {
+                    Chunk *c = chunk_of(p);
+                    AKR_ASSERT(c->heap == this && c->used > 0);
+                    auto *block = (FreeBlock *)p;
+                    block->next = c->free;
+                    c->free     = block;
+                    if (c->used-- == c->capacity) {
+                        link(c);
+                    }
+                    // the last chunk of a size class is kept, so that a single block does not cause a chunk
+                    // to be created and retired over and over
+                    if (c->used == 0 && (c->prev || c->next)) {
+                        unlink(c);
+                        retire(c);
+                    }
+                }
+                // may be called by any thread
+                void deallocate_remote(void *p) {
+                    auto *block = (FreeBlock *)p;
+                    block->next = remote_free.load(std::memory_order_relaxed);
+                    while (!remote_free.compare_exchange_weak(block->next, block, std::memory_order_release,
+                                                              std::memory_order_relaxed)) {
+                    }
+                }
+                void collect_remote_free() {
+                    auto *block = remote_free.exchange(nullptr, std::memory_order_acquire);
+                    while (block) {
+                        auto *next = block->next;
+                        deallocate(block);
+                        block = next;
+                    }
+                }
+                void release() {
+                    for (auto *c : chunks) {
+                        upstream->deallocate(c, CHUNK_SIZE, CHUNK_SIZE);
+                    }
+                    chunks.clear();
+                    empty.clear();
+                    available.fill(nullptr);
+                    remote_free.store(nullptr);
+                }
+
+              private:
+                Chunk *new_chunk() {
+                    if (!empty.empty()) {
+                        auto *c = empty.back();
+                        empty.pop_back();
+                        return c;
+                    }
+                    auto *c = (Chunk *)upstream->allocate(CHUNK_SIZE, CHUNK_SIZE);
+                    AKR_ASSERT(c && chunk_of(c) == c);
+                    c->index = chunks.size();
+                    chunks.emplace_back(c);
+                    return c;
+                }
+                void init_chunk(Chunk *c, uint32_t size_class) {
+                    c->heap       = this;
+                    c->size_class = size_class;
+                    c->block_size = uint32_t(MIN_BLOCK_SIZE << size_class);
+                    c->capacity   = std::min<uint32_t>(uint32_t((CHUNK_SIZE - CHUNK_HEADER_SIZE) / c->block_size),
+                                                     max_blocks_per_chunk);
+                    c->carved     = 0;
+                    c->used       = 0;
+                    c->free       = nullptr;
+                    c->prev = c->next = nullptr;
+                    c->linked         = false;
+                    link(c);
+                }
+                void retire(Chunk *c) {
+                    if (empty.size() < MAX_EMPTY_CHUNKS) {
+                        empty.emplace_back(c);
+                        return;
+                    }
+                    chunks.back()->index = c->index;
+                    chunks[c->index]     = chunks.back();
+                    chunks.pop_back();
+                    upstream->deallocate(c, CHUNK_SIZE, CHUNK_SIZE);
+                }
+                void link(Chunk *c) {
+                    AKR_ASSERT(!c->linked);
+                    auto &head = available[c->size_class];
+                    c->prev    = nullptr;
+                    c->next    = head;
+                    if (head)
+                        head->prev = c;
+                    head      = c;
+                    c->linked = true;
+                }
+                void unlink(Chunk *c) {
+                    AKR_ASSERT(c->linked);
+                    if (c->prev)
+                        c->prev->next = c->next;
+                    else
+                        available[c->size_class] = c->next;
+                    if (c->next)
+                        c->next->prev = c->prev;
+                    c->prev = c->next = nullptr;
+                    c->linked         = false;
+                }
+            };
+
+            // state shared by both pool resources: options and blocks too large to be pooled
+            struct PoolBase {
+                pool_options options;
+                memory_resource *upstream;
+                std::unordered_map<void *, std::pair<size_t, size_t>> large_blocks;
+                PoolBase(const pool_options &opts, memory_resource *upstream) : options(opts), upstream(upstream) {
+                    if (options.largest_required_pool_block == 0) {
+                        options.largest_required_pool_block = DEFAULT_LARGEST_BLOCK;
+                    }
+                    options.largest_required_pool_block =
+                        MIN_BLOCK_SIZE << size_class_of(std::min(options.largest_required_pool_block, MAX_BLOCK_SIZE));
+                    const size_t max_capacity = (CHUNK_SIZE - CHUNK_HEADER_SIZE) / MIN_BLOCK_SIZE;
+                    if (options.max_blocks_per_chunk == 0 || options.max_blocks_per_chunk > max_capacity) {
+                        options.max_blocks_per_chunk = max_capacity;
+                    }
+                }
+                ~PoolBase() { release_large(); }
+                bool pooled(size_t bytes, size_t alignment) const {
+                    return bytes <= options.largest_required_pool_block && alignment <= MAX_ALIGNMENT;
+                }
+                // blocks are aligned to min(block size, MAX_ALIGNMENT)
+                static uint32_t size_class(size_t bytes, size_t alignment) {
+                    return size_class_of(std::max(bytes, alignment));
+                }
+                Heap *new_heap() const { return new Heap(upstream, uint32_t(options.max_blocks_per_chunk)); }
+                void *allocate_large(size_t bytes, size_t alignment) {
+                    void *p = upstream->allocate(bytes, alignment);
+                    large_blocks.emplace(p, std::make_pair(bytes, alignment));
+                    return p;
+                }
+                void deallocate_large(void *p) {
+                    auto it = large_blocks.find(p);
+                    AKR_ASSERT(it != large_blocks.end());
+                    upstream->deallocate(p, it->second.first, it->second.second);
+                    large_blocks.erase(it);
+                }
+                void release_large() {
+                    for (auto &[p, block] : large_blocks) {
+                        upstream->deallocate(p, block.first, block.second);
+                    }
+                    large_blocks.clear();
+                }
+            };
+
+            static std::atomic_uint64_t next_pool_id{1};
+            // Heaps of a thread, keyed by the id of their resource. The resources a thread allocated from share it
+            // and erase their entry when destroyed, which may happen after the thread has exited.
+            struct ThreadHeaps {
+                std::mutex m;
+                std::unordered_map<uint64_t, Heap *> heaps;
+            };
+            static thread_local std::shared_ptr<ThreadHeaps> thread_heaps = std::make_shared<ThreadHeaps>();
+            // ids are never reused, so the entry of a destroyed resource is never matched again
+            static thread_local std::pair<uint64_t, Heap *> last_heap{0, nullptr};
+        } // namespace pool_internal
+
+        struct synchronized_pool_resource::Impl : pool_internal::PoolBase {
+            const uint64_t id = pool_internal::next_pool_id++;
+            std::mutex m;
+            std::vector<std::unique_ptr<pool_internal::Heap>> heaps;
+            // threads that have a heap of this resource
+            std::vector<std::shared_ptr<pool_internal::ThreadHeaps>> threads;
+            using PoolBase::PoolBase;
+            ~Impl() {
+                for (auto &thread : threads) {
+                    std::lock_guard<std::mutex> lock(thread->m);
+                    thread->heaps.erase(id);
+                }
+            }
+            // nullptr if the calling thread has not allocated from this resource yet
+            pool_internal::Heap *find_heap() const {
+                using namespace pool_internal;
+                if (last_heap.first == id)
+                    return last_heap.second;
+                std::lock_guard<std::mutex> lock(thread_heaps->m);
+                auto it = thread_heaps->heaps.find(id);
+                if (it == thread_heaps->heaps.end())
+                    return nullptr;
+                last_heap = *it;
+                return it->second;
+            }
+            pool_internal::Heap *heap() {
+                using namespace pool_internal;
+                if (auto *h = find_heap())
+                    return h;
+                Heap *h = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    heaps.emplace_back(new_heap());
+                    h = heaps.back().get();
+                    threads.emplace_back(thread_heaps);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(thread_heaps->m);
+                    thread_heaps->heaps.emplace(id, h);
+                }
+                last_heap = {id, h};
+                return h;
+            }
+        };
+        synchronized_pool_resource::synchronized_pool_resource(const pool_options &opts, memory_resource *upstream)
+            : impl(std::make_unique<Impl>(opts, upstream)) {}
+        synchronized_pool_resource::~synchronized_pool_resource() { release(); }
+        // heaps are kept, threads may still refer to them
+        void synchronized_pool_resource::release() {
+            std::lock_guard<std::mutex> lock(impl->m);
+            for (auto &heap : impl->heaps) {
+                heap->release();
+            }
+            impl->release_large();
+        }
+        memory_resource *synchronized_pool_resource::upstream_resource() const { return impl->upstream; }
+        pool_options synchronized_pool_resource::options() const { return impl->options; }
+        void *synchronized_pool_resource::do_allocate(size_t bytes, size_t alignment) {
+            if (!impl->pooled(bytes, alignment)) {
+                std::lock_guard<std::mutex> lock(impl->m);
+                return impl->allocate_large(bytes, alignment);
+            }
+            return impl->heap()->allocate(Impl::size_class(bytes, alignment));
+        }
+        void synchronized_pool_resource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+            if (!impl->pooled(bytes, alignment)) {
+                std::lock_guard<std::mutex> lock(impl->m);
+                impl->deallocate_large(p);
+                return;
+            }
+            auto *owner = pool_internal::chunk_of(p)->heap;
+            if (owner == impl->find_heap()) {
+                owner->deallocate(p);
+            } else {
+                owner->deallocate_remote(p);
+            }
+        }
+        bool synchronized_pool_resource::do_is_equal(const memory_resource &other) const noexcept {
+            return this == &other;
+        }
+
+        struct unsynchronized_pool_resource::Impl : pool_internal::PoolBase {
+            std::unique_ptr<pool_internal::Heap> heap;
+            Impl(const pool_options &opts, memory_resource *upstream)
+                : PoolBase(opts, upstream), heap(new_heap()) {}
+        };
+        unsynchronized_pool_resource::unsynchronized_pool_resource(const pool_options &opts,
+                                                                   memory_resource *upstream)
+            : impl(std::make_unique<Impl>(opts, upstream)) {}
+        unsynchronized_pool_resource::~unsynchronized_pool_resource() { release(); }
+        void unsynchronized_pool_resource::release() {
+            impl->heap->release();
+            impl->release_large();
+        }
+        memory_resource *unsynchronized_pool_resource::upstream_resource() const { return impl->upstream; }
+        pool_options unsynchronized_pool_resource::options() const { return impl->options; }
+        void *unsynchronized_pool_resource::do_allocate(size_t bytes, size_t alignment) {
+            if (!impl->pooled(bytes, alignment)) {
+                return impl->allocate_large(bytes, alignment);
+            }
+            return impl->heap->allocate(Impl::size_class(bytes, alignment));
+        }
+        void unsynchronized_pool_resource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+            if (!impl->pooled(bytes, alignment)) {
+                impl->deallocate_large(p);
+                return;
+            }
+            impl->heap->deallocate(p);
+        }
+        bool unsynchronized_pool_resource::do_is_equal(const memory_resource &other) const noexcept {
+            return this == &other;
+        }
     } // namespace pmr
 } // namespace akari::astd
\ No newline at end of file
@@ -15,6 +15,7 @@
 #pragma once
 #include <cstddef>
 #include <list>
+#include <memory>
 #include <akari/common.h>
 // enabling C++20 pmr
 
@@ -71,7 +72,7 @@ namespace akari::astd {
             bool operator!=(const polymorphic_allocator<T> &rhs) const {
                 return resource() != rhs.resource();
             }
-            void deallocate(Tp *p, size_t n) { resource()->deallocate(p, n); }
+            void deallocate(Tp *p, size_t n) { resource()->deallocate(p, n * sizeof(Tp), alignof(Tp)); }
 
             void *allocate_bytes(size_t nbytes, size_t alignment = alignof(max_align_t)) {
                 return resource()->allocate(nbytes, alignment);
@@ -107,12 +108,18 @@ namespace akari::astd {
             memory_resource *memoryResource;
         };
 
+        // zero selects the default
         struct pool_options {
             size_t max_blocks_per_chunk = 0;
             size_t largest_required_pool_block = 0;
         };
 
-        class synchronized_pool_resource : public memory_resource {
+        // Blocks up to largest_required_pool_block bytes are carved from 64KB chunks, one size class (a power of two)
+        // per chunk. Freed blocks go back to their chunk; chunks that become empty are kept for reuse by any size
+        // class. Larger blocks are forwarded to the upstream resource.
+        // Every thread allocates from its own set of chunks. A block freed by another thread is pushed onto a
+        // lock-free list of the owning thread and picked up by that thread the next time it runs out of blocks.
+        class AKR_EXPORT synchronized_pool_resource : public memory_resource {
           public:
             synchronized_pool_resource(const pool_options &opts, memory_resource *upstream);
 
@@ -136,9 +143,14 @@ namespace akari::astd {
             void do_deallocate(void *p, size_t bytes, size_t alignment) override;
 
             bool do_is_equal(const memory_resource &other) const noexcept override;
+
+          private:
+            struct Impl;
+            std::unique_ptr<Impl> impl;
         };
 
-        class unsynchronized_pool_resource : public memory_resource {
+        // same as synchronized_pool_resource with a single set of chunks and without locking
+        class AKR_EXPORT unsynchronized_pool_resource : public memory_resource {
           public:
             unsynchronized_pool_resource(const pool_options &opts, memory_resource *upstream);
 
@@ -162,6 +174,10 @@ namespace akari::astd {
             void do_deallocate(void *p, size_t bytes, size_t alignment) override;
 
             bool do_is_equal(const memory_resource &other) const noexcept override;
+
+          private:
+            struct Impl;
+            std::unique_ptr<Impl> impl;
         };
 
         class monotonic_buffer_resource : public memory_resource {
@@ -0,0 +1,189 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <akari/profile.h>
+#include <akari/memory.h>
+#include <spdlog/spdlog.h>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <vector>
+
+namespace akari::trace {
+    namespace trace_internal {
+        // events of one thread; only the owning thread writes, the oldest events are overwritten when full
+        struct RingBuffer {
+            static constexpr size_t capacity = 1u << 16u;
+            std::unique_ptr<Event[]> events{new Event[capacity]};
+            std::atomic_uint64_t head{0};
+            uint32_t tid = 0;
+        };
+        static std::mutex buffers_m;
+        // kept alive after their threads exit, so that short-lived threads still show up in the trace
+        static std::vector<std::shared_ptr<RingBuffer>> buffers;
+        static RingBuffer &local_buffer() {
+            static thread_local std::shared_ptr<RingBuffer> buffer;
+            if (!buffer) {
+                buffer = std::make_shared<RingBuffer>();
+                std::lock_guard<std::mutex> lock(buffers_m);
+                buffer->tid = (uint32_t)buffers.size();
+                buffers.emplace_back(buffer);
+            }
+            return *buffer;
+        }
+        static void write_string(std::ostream &out, const char *s) {
+            out << '"';
+            for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                    out << '\\';
+                out << *s;
+            }
+            out << '"';
+        }
+    } // namespace trace_internal
+
+    uint64_t now() {
+        using clock             = std::chrono::steady_clock;
+        static const auto start = clock::now();
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+    void record(const Event &event) {
+        auto &buffer = trace_internal::local_buffer();
+        auto head    = buffer.head.load(std::memory_order_relaxed);
+        buffer.events[head % trace_internal::RingBuffer::capacity] = event;
+        buffer.head.store(head + 1, std::memory_order_release);
+    }
+    bool write_chrome_trace(const std::string &path) {
+        using namespace trace_internal;
+#ifndef AKR_ENABLE_TRACE
+        spdlog::warn("tracing is disabled, rebuild with AKR_ENABLE_TRACE to write {}", path);
+        return false;
+#else
+        std::ofstream out(path);
+        if (!out) {
+            spdlog::error("cannot write trace to {}", path);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(buffers_m);
+        size_t n_events = 0;
+        out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (auto &buffer : buffers) {
+            const uint64_t head  = buffer->head.load(std::memory_order_acquire);
+            const uint64_t begin = head > RingBuffer::capacity ? head - RingBuffer::capacity : 0;
+            for (uint64_t i = begin; i < head; i++) {
+                const auto &event = buffer->events[i % RingBuffer::capacity];
+                out << (first ? "" : ",\n") << "{\"name\":";
+                first = false;
+                write_string(out, event.name);
+                out << ",\"pid\":0,\"tid\":" << buffer->tid << ",\"ts\":" << event.begin / 1000.0;
+                if (event.is_counter) {
+                    out << ",\"ph\":\"C\",\"args\":{\"value\":" << event.value << "}}";
+                } else {
+                    out << ",\"ph\":\"X\",\"dur\":" << event.duration / 1000.0 << "}";
+                }
+                n_events++;
+            }
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        spdlog::info("wrote {} trace events to {}", n_events, path);
+        return bool(out);
+#endif
+    }
+} // namespace akari::trace
+
+namespace akari::stats {
+    namespace stats_internal {
+        static std::mutex blocks_m;
+        // never freed, so that counts of exited threads are kept and thread_local pointers stay valid
+        static std::vector<std::unique_ptr<CounterBlock>> blocks;
+        static const char *names[NumCounters] = {"camera_rays",
+                                                 "rays",
+                                                 "shadow_rays",
+                                                 "shadow_rays_occluded",
+                                                 "transmittance_steps",
+                                                 "paths",
+                                                 "path_vertices",
+                                                 "russian_roulette_terminations",
+                                                 "bsdf_sample_failures"};
+        static double ratio(uint64_t a, uint64_t b) { return b == 0 ? 0.0 : double(a) / double(b); }
+    } // namespace stats_internal
+
+    CounterBlock *new_counter_block() {
+        using namespace stats_internal;
+        std::lock_guard<std::mutex> lock(blocks_m);
+        blocks.emplace_back(std::make_unique<CounterBlock>());
+        return blocks.back().get();
+    }
+    Snapshot snapshot() {
+        using namespace stats_internal;
+        Snapshot s{};
+        std::lock_guard<std::mutex> lock(blocks_m);
+        for (auto &block : blocks) {
+            for (uint32_t i = 0; i < NumCounters; i++) {
+                s[i] += block->values[i].load(std::memory_order_relaxed);
+            }
+        }
+        return s;
+    }
+    void reset() {
+        using namespace stats_internal;
+        std::lock_guard<std::mutex> lock(blocks_m);
+        for (auto &block : blocks) {
+            for (auto &value : block->values) {
+                value.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+    void print(const Snapshot &s, double seconds) {
+        using namespace stats_internal;
+        spdlog::info("rays: {} camera, {} extension, {} shadow; {:.2f} Mrays/s", s[CameraRays],
+                     s[Rays] - std::min(s[Rays], s[CameraRays]), s[ShadowRays],
+                     double(total_rays(s)) / std::max(seconds, 1e-9) * 1e-6);
+        spdlog::info("paths: {}, average depth {:.2f}, russian roulette {:.1f}%, bsdf sample failures {}", s[Paths],
+                     ratio(s[PathVertices], s[Paths]), ratio(s[RussianRouletteTerminations], s[Paths]) * 100.0,
+                     s[BSDFSampleFailures]);
+        spdlog::info("NEE occlusion rate {:.1f}%, transmittance steps {}",
+                     ratio(s[ShadowRaysOccluded], s[ShadowRays]) * 100.0, s[TransmittanceSteps]);
+    }
+    bool write_json(const Snapshot &s, double seconds, const std::string &path) {
+        using namespace stats_internal;
+        std::ofstream out(path);
+        if (!out) {
+            spdlog::error("cannot write stats to {}", path);
+            return false;
+        }
+        out << "{\n";
+        for (uint32_t i = 0; i < NumCounters; i++) {
+            out << "    \"" << names[i] << "\": " << s[i] << ",\n";
+        }
+        out << "    \"seconds\": " << seconds << ",\n";
+        out << "    \"mrays_per_second\": " << double(total_rays(s)) / std::max(seconds, 1e-9) * 1e-6 << ",\n";
+        out << "    \"average_path_depth\": " << ratio(s[PathVertices], s[Paths]) << ",\n";
+        out << "    \"russian_roulette_rate\": " << ratio(s[RussianRouletteTerminations], s[Paths]) << ",\n";
+        out << "    \"nee_occlusion_rate\": " << ratio(s[ShadowRaysOccluded], s[ShadowRays]) << ",\n";
+        const auto usage = memory::report();
+        out << "    \"memory\": {\n";
+        for (int c = 0; c < memory::NumCategories; c++) {
+            out << "        \"" << memory::category_name(memory::Category(c)) << "\": {\"current\": "
+                << usage[c].current << ", \"peak\": " << usage[c].peak << "}"
+                << (c + 1 < memory::NumCategories ? ",\n" : "\n");
+        }
+        out << "    }\n";
+        out << "}\n";
+        spdlog::info("wrote render stats to {}", path);
+        return bool(out);
+    }
+} // namespace akari::stats
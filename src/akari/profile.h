@@ -14,9 +14,99 @@
 
 #pragma once
 #include <akari/util.h>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <mutex>
+#include <string>
 namespace akari {
+    // Scoped spans and counters, recorded into a ring buffer per thread and exported in the Chrome trace_event
+    // format (chrome://tracing, ui.perfetto.dev). Recording compiles to nothing unless AKR_ENABLE_TRACE is defined.
+    namespace trace {
+        struct Event {
+            const char *name  = nullptr; // must outlive the trace, e.g. a string literal
+            uint64_t begin    = 0;       // ns
+            uint64_t duration = 0;       // ns, spans only
+            double value      = 0.0;     // counters only
+            bool is_counter   = false;
+        };
+        // ns since the first call
+        AKR_EXPORT uint64_t now();
+        AKR_EXPORT void record(const Event &event);
+        // Writes the events of all threads; call it while no other thread is recording.
+        // Returns false if tracing is disabled or the file could not be written.
+        AKR_EXPORT bool write_chrome_trace(const std::string &path);
+        class Scope {
+            const char *name;
+            uint64_t begin;
+
+          public:
+            explicit Scope(const char *name) : name(name), begin(now()) {}
+            Scope(const Scope &) = delete;
+            Scope &operator=(const Scope &) = delete;
+            ~Scope() {
+                Event event;
+                event.name     = name;
+                event.begin    = begin;
+                event.duration = now() - begin;
+                record(event);
+            }
+        };
+        inline void counter(const char *name, double value) {
+            Event event;
+            event.name       = name;
+            event.begin      = now();
+            event.value      = value;
+            event.is_counter = true;
+            record(event);
+        }
+    } // namespace trace
+    // Counters of the render loop. Every thread counts into its own cache-line-aligned block, so counting is a
+    // plain load and store; the blocks are summed when a report is made.
+    namespace stats {
+        enum Counter : uint32_t {
+            CameraRays,
+            // closest-hit queries, including camera rays
+            Rays,
+            ShadowRays,
+            ShadowRaysOccluded,
+            TransmittanceSteps,
+            Paths,
+            PathVertices,
+            RussianRouletteTerminations,
+            BSDFSampleFailures,
+            NumCounters
+        };
+        struct alignas(64) CounterBlock {
+            std::atomic_uint64_t values[NumCounters] = {};
+        };
+        using Snapshot = std::array<uint64_t, NumCounters>;
+        // registers a block for the calling thread
+        AKR_EXPORT CounterBlock *new_counter_block();
+        inline void add(Counter counter, uint64_t n = 1) {
+            static thread_local CounterBlock *block = nullptr;
+            if (!block) {
+                block = new_counter_block();
+            }
+            auto &value = block->values[counter];
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        AKR_EXPORT Snapshot snapshot();
+        // call while no thread is counting
+        AKR_EXPORT void reset();
+        inline uint64_t total_rays(const Snapshot &s) { return s[Rays] + s[ShadowRays]; }
+        AKR_EXPORT void print(const Snapshot &s, double seconds);
+        AKR_EXPORT bool write_json(const Snapshot &s, double seconds, const std::string &path);
+    } // namespace stats
+#define AKR_TRACE_CONCAT_(a, b) a##b
+#define AKR_TRACE_CONCAT(a, b)  AKR_TRACE_CONCAT_(a, b)
+#ifdef AKR_ENABLE_TRACE
+#define AKR_TRACE_SCOPE(name)          ::akari::trace::Scope AKR_TRACE_CONCAT(_akr_trace_scope_, __LINE__)(name)
+#define AKR_TRACE_COUNTER(name, value) ::akari::trace::counter(name, double(value))
+#else
+#define AKR_TRACE_SCOPE(name)          ((void)0)
+#define AKR_TRACE_COUNTER(name, value) ((void)0)
+#endif
     class Timer {
         using TP = decltype(std::chrono::high_resolution_clock::now());
         TP t0, t1;
@@ -34,7 +124,8 @@ namespace akari {
             return diff.count();
         }
     };
-    inline void show_progress(double progress, double elpased, double remaining) {
+    // mrays_per_second < 0 hides the throughput
+    inline void show_progress(double progress, double elpased, double remaining, double mrays_per_second = -1.0) {
         printf("[");
         size_t width = 80; // terminal_width() - 30;
         size_t pos = size_t(width * progress);
@@ -46,7 +137,10 @@ namespace akari {
             else
                 printf(" ");
         }
-        printf("] %2d %% (%.3fs|%.3fs)\r", int(progress * 100.0), elpased, remaining);
+        printf("] %2d %% (%.3fs|%.3fs)", int(progress * 100.0), elpased, remaining);
+        if (mrays_per_second >= 0.0)
+            printf(" %.2f Mrays/s", mrays_per_second);
+        printf("\r");
         fflush(stdout);
     }
     inline void show_progress(double progress, size_t width) {
@@ -65,7 +159,8 @@ namespace akari {
     }
     struct ProgressReporter {
         explicit ProgressReporter(size_t total, double min_report_interval = 0.5)
-            : total(total), min_report_interval(min_report_interval) {
+            : total(total), min_report_interval(min_report_interval),
+              start_rays(stats::total_rays(stats::snapshot())) {
             timer.start();
         }
         void update() {
@@ -75,8 +170,10 @@ namespace akari {
                 return;
             if (timer.seconds_since_start() - last_report_time >= min_report_interval) {
                 last_report_time = timer.seconds_since_start();
-                auto remaining = last_report_time * double(total) / cur - last_report_time;
-                show_progress(double(cur) / total, last_report_time, remaining);
+                auto remaining   = last_report_time * double(total) / cur - last_report_time;
+                auto rays        = stats::total_rays(stats::snapshot()) - start_rays;
+                show_progress(double(cur) / total, last_report_time, remaining,
+                              rays > 0 ? rays / last_report_time * 1e-6 : -1.0);
             }
         }
 
@@ -84,6 +181,7 @@ namespace akari {
         std::atomic<size_t> total;
         double min_report_interval;
         double last_report_time = 0;
+        uint64_t start_rays;
         Timer timer;
         std::mutex m;
         std::atomic<size_t> count = 0;
@@ -16,6 +16,7 @@
 #include <akari/api.h>
 #include <akari/render.h>
 #include <akari/render_ppg.h>
+#include <akari/profile.h>
 #include <spdlog/spdlog.h>
 namespace akari::render {
     Spectrum FresnelNoOp::evaluate(Float cosThetaI) const { return Spectrum(1.0f); }
@@ -52,48 +53,50 @@ namespace akari::render {
         return sample;
     }
 
-    [[nodiscard]] Float MixBSDF::evaluate_pdf(const Vec3 &wo, const Vec3 &wi) const {
-        return (1.0 - fraction) * bsdf_A->evaluate_pdf(wo, wi) + fraction * bsdf_B->evaluate_pdf(wo, wi);
-    }
-    [[nodiscard]] BSDFValue MixBSDF::evaluate(const Vec3 &wo, const Vec3 &wi) const {
-        return BSDFValue::mix(fraction, bsdf_A->evaluate(wo, wi), bsdf_B->evaluate(wo, wi));
-    }
-    [[nodiscard]] BSDFType MixBSDF::type() const { return BSDFType(bsdf_A->type() | bsdf_B->type()); }
-    BSDFValue MixBSDF::albedo() const { return BSDFValue::mix(fraction, bsdf_A->albedo(), bsdf_B->albedo()); }
-    std::optional<BSDFSample> MixBSDF::sample(const vec2 &u, const Vec3 &wo) const {
-        BSDFSample sample;
-        std::optional<BSDFSample> inner_sample;
-        bool selA = true;
-        if (u[0] < fraction) {
-            vec2 u_(u[0] / fraction, u[1]);
-            inner_sample = bsdf_B->sample(u_, wo);
-            selA = false;
-        } else {
-            vec2 u_((u[0] - fraction) / (1.0 - fraction), u[1]);
-            inner_sample = bsdf_A->sample(u_, wo);
+    PMJ02BNPixelSamples::PMJ02BNPixelSamples(int spp_, int tile_size_) {
+        spp = 1;
+        while (spp < std::min(spp_, N_PMJ02BN_SAMPLES)) {
+            spp *= 4;
         }
-        if (!inner_sample) {
-            return std::nullopt;
+        tile_size = 1;
+        while (tile_size * 2 <= tile_size_ && tile_size * tile_size * 4 * spp <= N_PMJ02BN_SAMPLES) {
+            tile_size *= 2;
         }
-        if ((inner_sample->type & BSDFType::Specular) != BSDFType::Unset) {
-            sample = *inner_sample;
-            sample.pdf *= selA ? fraction : (1.0f - fraction);
-            // AKR_ASSERT(sample.pdf >= 0.0);
-            // AKR_ASSERT(pdf_select >= 0.0);
-            // AKR_ASSERT(sample.pdf >= 0.0);
-            return sample;
-        } else {
-            sample = *inner_sample;
-            if (selA) {
-                sample.f = BSDFValue::mix(fraction, sample.f, bsdf_B->evaluate(wo, sample.wi));
-                sample.pdf = (1.0 - fraction) * sample.pdf + fraction * bsdf_B->evaluate_pdf(wo, sample.wi);
-            } else {
-                sample.f = BSDFValue::mix(fraction, bsdf_A->evaluate(wo, sample.wi), sample.f);
-                sample.pdf = fraction * sample.pdf + (1.0 - fraction) * bsdf_A->evaluate_pdf(wo, sample.wi);
+        // a power-of-4 prefix of a (0,2) sequence puts the same number of points in every pixel of the tile
+        const int n = tile_size * tile_size * spp;
+        samples.resize(n);
+        std::vector<int> n_stored(tile_size * tile_size, 0);
+        for (int i = 0; i < n; i++) {
+            const vec2 p     = pmj02bn(0, i) * Float(tile_size);
+            const ivec2 ip   = glm::min(ivec2(p), ivec2(tile_size - 1));
+            const int offset = ip.x + ip.y * tile_size;
+            AKR_ASSERT(n_stored[offset] < spp);
+            samples[offset * spp + n_stored[offset]++] = p - vec2(ip);
+        }
+    }
+    void build_sampler_tables(SamplerConfig &config) {
+        if (config.type == SamplerConfig::PMJ02BN && !config.pmj02bn_pixel_samples) {
+            if (config.spp > N_PMJ02BN_SAMPLES) {
+                spdlog::warn("pmj02bn: {} spp exceeds the {} samples of the table", config.spp, N_PMJ02BN_SAMPLES);
+            }
+            config.pmj02bn_pixel_samples =
+                std::make_shared<const PMJ02BNPixelSamples>(config.spp, config.pixel_tile_size);
+            if (config.pmj02bn_pixel_samples->spp != config.spp) {
+                spdlog::warn("pmj02bn: using {} spp instead of {}", config.pmj02bn_pixel_samples->spp, config.spp);
+                config.spp = config.pmj02bn_pixel_samples->spp;
+            }
+        } else if (config.type == SamplerConfig::ZSOBOL) {
+            int spp = 1;
+            while (spp < config.spp) {
+                spp *= 2;
+            }
+            if (spp != config.spp) {
+                spdlog::warn("zsobol: using {} spp instead of {}", spp, config.spp);
+                config.spp = spp;
             }
-            return sample;
         }
     }
+
     BSDF Material::evaluate(Sampler &sampler, Allocator<> alloc, const SurfaceInteraction &si) const {
         auto sp = si.sp();
         BSDF bsdf(Frame(si.ns, si.dpdu));
@@ -121,21 +124,36 @@ namespace akari::render {
             } else if (m > 1 - 1e-5f) {
                 bsdf.set_closure(glossy);
             } else {
-                MixBSDF mix(m, alloc.new_object<BSDFClosure>(diffuse), alloc.new_object<BSDFClosure>(glossy));
-                bsdf.set_closure(mix);
+                bsdf.add_lobe(1.0f - m, diffuse);
+                bsdf.add_lobe(m, glossy);
             }
         }
         return bsdf;
     }
-    bool Scene::occlude(const Ray &ray) const { return accel->occlude1(ray); }
+    bool Scene::occlude(const Ray &ray) const {
+        stats::add(stats::ShadowRays);
+        if (accel->occlude1(ray)) {
+            stats::add(stats::ShadowRaysOccluded);
+            return true;
+        }
+        return false;
+    }
+    void Scene::intersect_stream(const RayStream &rays, HitStream &hits) const {
+        stats::add(stats::Rays, rays.size());
+        accel->intersect_stream(rays, hits);
+    }
+    void Scene::occlude_stream(const RayStream &rays, std::vector<uint8_t> &occluded) const {
+        stats::add(stats::ShadowRays, rays.size());
+        accel->occlude_stream(rays, occluded);
+        stats::add(stats::ShadowRaysOccluded, std::count(occluded.begin(), occluded.begin() + rays.size(), 1));
+    }
     std::optional<SurfaceInteraction> Scene::intersect(const Ray &ray) const {
+        stats::add(stats::Rays);
         std::optional<Intersection> isct = accel->intersect1(ray);
         if (!isct) {
             return std::nullopt;
         }
-        Triangle triangle = instances[isct->geom_id].get_triangle(isct->prim_id);
-        SurfaceInteraction si(isct->uv, triangle);
-        si.shape = &instances[isct->geom_id];
+        SurfaceInteraction si(&instances[isct->geom_id], isct->prim_id, isct->uv);
         ray.tmax = isct->t;
         return si;
     }
@@ -146,15 +164,157 @@ namespace akari::render {
         lights.clear();
         delete rsrc;
     }
+    // Copies the vertices and normals of transformed instances to world space, smallest instances first until the
+    // budget is exhausted
+    static void build_geometry_cache(Scene &scene, size_t budget) {
+        AKR_TRACE_SCOPE("build geometry cache");
+        auto bytes = [](const MeshInstance *inst) {
+            return sizeof(vec3) * (inst->vertices.size() + inst->normals.size());
+        };
+        std::vector<MeshInstance *> candidates;
+        for (auto &inst : scene.instances) {
+            if (!inst.world_space) {
+                candidates.emplace_back(&inst);
+            }
+        }
+        if (candidates.empty()) {
+            return;
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [&](const MeshInstance *a, const MeshInstance *b) { return bytes(a) < bytes(b); });
+        size_t count = 0, used = 0;
+        while (count < candidates.size() && used + bytes(candidates[count]) <= budget) {
+            used += bytes(candidates[count]);
+            count++;
+        }
+        Allocator<> alloc(memory::buffer_resource(memory::Mesh));
+        scene.geometry_cache.reserve(2 * count);
+        for (size_t i = 0; i < count; i++) {
+            scene.geometry_cache.emplace_back(candidates[i]->vertices.size(), alloc);
+            scene.geometry_cache.emplace_back(candidates[i]->normals.size(), alloc);
+        }
+        thread::parallel_for(count, [&](size_t i, uint32_t) {
+            auto *inst     = candidates[i];
+            auto &vertices = scene.geometry_cache[2 * i];
+            auto &normals  = scene.geometry_cache[2 * i + 1];
+            thread::parallel_for(
+                vertices.size(),
+                [&](size_t v, uint32_t) { vertices[v] = inst->transform.apply_point(inst->vertices[v]); }, 4096);
+            thread::parallel_for(
+                normals.size(),
+                [&](size_t n, uint32_t) { normals[n] = inst->transform.apply_normal(inst->normals[n]); }, 4096);
+            inst->vertices    = BufferView<const vec3>(vertices.data(), vertices.size());
+            inst->normals     = BufferView<const vec3>(normals.data(), normals.size());
+            inst->world_space = true;
+        });
+        spdlog::info("geometry cache: {} of {} transformed instances, {:.2f} MB", count, candidates.size(),
+                     used / 1048576.0);
+    }
+    std::optional<AccelProfile> parse_accel_profile(const std::string &name) {
+        for (auto profile : {AccelProfile::Auto, AccelProfile::Fast, AccelProfile::HighQuality, AccelProfile::Compact,
+                             AccelProfile::Robust}) {
+            if (name == accel_profile_name(profile)) {
+                return profile;
+            }
+        }
+        return std::nullopt;
+    }
+    const char *accel_profile_name(AccelProfile profile) {
+        switch (profile) {
+        case AccelProfile::Auto:
+            return "auto";
+        case AccelProfile::Fast:
+            return "fast";
+        case AccelProfile::HighQuality:
+            return "high-quality";
+        case AccelProfile::Compact:
+            return "compact";
+        case AccelProfile::Robust:
+            return "robust";
+        }
+        return "unknown";
+    }
+    static uint32_t integrator_spp(const scene::Integrator *integrator) {
+        if (!integrator)
+            return 0;
+        if (auto p = integrator->as<scene::PathTracer>())
+            return p->spp;
+        if (auto p = integrator->as<scene::UnifiedPathTracer>())
+            return p->spp;
+        if (auto p = integrator->as<scene::GuidedPathTracer>())
+            return p->spp;
+        if (auto p = integrator->as<scene::MCMC>())
+            return p->spp;
+        if (auto p = integrator->as<scene::SMCMC>())
+            return p->spp;
+        if (auto p = integrator->as<scene::VPL>())
+            return p->spp;
+        if (auto p = integrator->as<scene::BDPT>())
+            return p->spp;
+        return 0;
+    }
+    // Picks a build profile for AccelProfile::Auto. A high-quality build costs a few times more per triangle than a
+    // fast one, which only pays off when enough samples are traced per triangle.
+    static AccelProfile select_accel_profile(const scene::SceneGraph &graph) {
+        // rough size of a high-quality BVH with spatial splits
+        static constexpr size_t HIGH_QUALITY_BYTES_PER_TRIANGLE   = 128;
+        static constexpr uint64_t FAST_BUILD_SAMPLES_PER_TRIANGLE = 8;
+
+        size_t triangles = 0;
+        for (auto &mesh : graph.meshes) {
+            triangles += mesh->indices.size();
+        }
+        const size_t available = memory::available_system_memory();
+        if (available > 0 && triangles * HIGH_QUALITY_BYTES_PER_TRIANGLE > available / 4) {
+            spdlog::info("accel profile: compact, {} triangles with {:.0f} MB available", triangles,
+                         available / 1048576.0);
+            return AccelProfile::Compact;
+        }
+        const ivec2 resolution = graph.camera ? graph.camera->resolution : ivec2(0);
+        const uint64_t samples = uint64_t(integrator_spp(graph.integrator.get())) * resolution.x * resolution.y;
+        if (samples < FAST_BUILD_SAMPLES_PER_TRIANGLE * triangles) {
+            spdlog::info("accel profile: fast, {} samples for {} triangles", samples, triangles);
+            return AccelProfile::Fast;
+        }
+        spdlog::info("accel profile: high-quality, {} samples for {} triangles", samples, triangles);
+        return AccelProfile::HighQuality;
+    }
+    // average time of a closest-hit query for random rays inside the scene bounds, on the calling thread
+    static double measure_traversal_ns(const EmbreeAccel &accel) {
+        static constexpr int PROBE_RAYS = 4096;
+        const auto bounds = accel.world_bounds();
+        if (bounds.empty()) {
+            return 0.0;
+        }
+        Rng rng(0);
+        std::vector<Ray> rays;
+        for (int i = 0; i < PROBE_RAYS; i++) {
+            const vec3 u(rng.uniform_float(), rng.uniform_float(), rng.uniform_float());
+            const vec3 o = bounds.pmin + u * bounds.extents();
+            const vec3 d = uniform_sphere_sampling(vec2(rng.uniform_float(), rng.uniform_float()));
+            rays.emplace_back(o, d);
+        }
+        Timer timer;
+        timer.start();
+        for (auto &ray : rays) {
+            (void)accel.intersect1(ray);
+        }
+        timer.stop();
+        return timer.elapsed_seconds() * 1e9 / rays.size();
+    }
     std::shared_ptr<const Scene> create_scene(Allocator<> alloc,
                                               const std::shared_ptr<scene::SceneGraph> &scene_graph) {
+        AKR_TRACE_SCOPE("create_scene");
         scene_graph->commit();
         auto scene = make_pmr_shared<Scene>(alloc);
         {
             auto rsrc = alloc.resource();
-            scene->rsrc = new astd::pmr::monotonic_buffer_resource(rsrc);
+            scene->scene_tracker = std::make_unique<memory::TrackingResource>(memory::Scene, rsrc);
+            scene->light_tracker = std::make_unique<memory::TrackingResource>(memory::Light, rsrc);
+            scene->rsrc = new astd::pmr::monotonic_buffer_resource(scene->scene_tracker.get());
             scene->allocator = Allocator<>(scene->rsrc);
         }
+        Allocator<> light_alloc(scene->light_tracker.get());
         scene->camera = [&] {
             std::optional<Camera> camera;
             if (auto perspective = scene_graph->camera->as<scene::PerspectiveCamera>()) {
@@ -176,7 +336,13 @@ namespace akari::render {
                 tex.emplace(ConstantTexture(rgb_tex->value));
             } else if (auto img_tex = tex_node->as<scene::ImageTexture>()) {
                 std::shared_ptr<Image> img;
-                img.reset(new Image(read_generic_image(img_tex->path)));
+                auto *image = new Image(read_generic_image(img_tex->path));
+                const size_t bytes = sizeof(float) * image->channels() * hprod(image->resolution());
+                memory::record_allocation(memory::Texture, bytes);
+                img.reset(image, [bytes](Image *p) {
+                    memory::record_deallocation(memory::Texture, bytes);
+                    delete p;
+                });
                 tex.emplace(ImageTexture(std::move(img)));
             }
             return tex.value();
@@ -215,6 +381,7 @@ namespace akari::render {
                 Transform T = node_T * instance->transform();
                 MeshInstance inst;
                 inst.transform = T;
+                inst.world_space = T.m == Mat4(1.0);
                 inst.material = create_mat(instance->material);
                 inst.medium = create_volume(instance->volume);
                 inst.indices = BufferView<const uvec3>(instance->mesh->indices.data(), instance->mesh->indices.size());
@@ -233,7 +400,7 @@ namespace akari::render {
                         std::vector<const Light *> lights;
                         for (int i = 0; i < (int)inst.indices.size(); i++) {
                             AreaLight area_light(inst.get_triangle(i), inst.material->emission, false);
-                            auto light = alloc.new_object<Light>(area_light);
+                            auto light = light_alloc.new_object<Light>(area_light);
                             scene->lights.emplace_back(light);
                             lights.emplace_back(light);
                         }
@@ -247,6 +414,7 @@ namespace akari::render {
             }
         };
         create_instance(Transform(), scene_graph->root, create_instance);
+        build_geometry_cache(*scene, size_t(scene_graph->geometry_cache_mb) * 1024 * 1024);
         {
             BufferView<const Light *> lights(scene->lights.data(), scene->lights.size());
             std::vector<Float> power;
@@ -254,37 +422,126 @@ namespace akari::render {
                 (void)light;
                 power.emplace_back(1.0);
             }
-            scene->light_sampler = std::make_shared<PowerLightSampler>(alloc, lights, power);
+            scene->light_sampler = std::make_shared<PowerLightSampler>(light_alloc, lights, power);
+        }
+        if (scene_graph->accel != "embree" && scene_graph->accel != "bvh") {
+            spdlog::warn("unknown accel \"{}\"", scene_graph->accel);
+        }
+        const auto parsed_profile = parse_accel_profile(scene_graph->accel_profile);
+        if (!parsed_profile) {
+            spdlog::warn("unknown accel profile \"{}\", using high-quality", scene_graph->accel_profile);
+        }
+        auto profile = parsed_profile.value_or(AccelProfile::HighQuality);
+        if (profile == AccelProfile::Auto) {
+            profile = select_accel_profile(*scene_graph);
+        }
+#ifdef AKR_BACKEND_EMBREE
+        if (scene_graph->accel != "bvh") {
+            scene->accel = create_embree_accel(profile);
+        } else {
+            scene->accel = create_bvh_accel(scene_graph->bvh_cache_dir, scene_graph->bvh_width, profile);
+        }
+#else
+        if (scene_graph->accel == "embree") {
+            spdlog::warn("built without embree, using the bvh backend");
+        }
+        scene->accel = create_bvh_accel(scene_graph->bvh_cache_dir, scene_graph->bvh_width, profile);
+#endif
+        {
+            const size_t accel_memory = memory::report()[memory::Accel].current;
+            Timer timer;
+            timer.start();
+            scene->accel->build(*scene, scene_graph);
+            timer.stop();
+            const size_t bytes = memory::report()[memory::Accel].current - accel_memory;
+            spdlog::info("accel ({}): built in {:.3f}s, {:.2f} MB, {:.0f} ns per closest-hit ray",
+                         accel_profile_name(profile), timer.elapsed_seconds(), bytes / 1048576.0,
+                         measure_traversal_ns(*scene->accel));
         }
-        scene->accel = create_embree_accel();
-        scene->accel->build(*scene, scene_graph);
         return scene;
     }
 } // namespace akari::render
 
 namespace akari {
-    void render_scenegraph(scene::P<scene::SceneGraph> graph) {
+    // the sampler may round spp, which the caller takes from the returned config
+    static render::SamplerConfig create_sampler_config(const scene::Integrator &integrator, uint32_t spp,
+                                                       const ivec2 &resolution) {
+        render::SamplerConfig config;
+        config.spp        = int(spp);
+        config.resolution = resolution;
+        config.seed       = integrator.seed;
+        if (integrator.sampler == "pmj02bn") {
+            config.type = render::SamplerConfig::PMJ02BN;
+        } else if (integrator.sampler == "zsobol") {
+            config.type = render::SamplerConfig::ZSOBOL;
+        } else if (integrator.sampler == "lcg") {
+            config.type = render::SamplerConfig::LCG;
+        } else if (integrator.sampler != "pcg") {
+            spdlog::warn("unknown sampler \"{}\", using pcg", integrator.sampler);
+        }
+        render::build_sampler_tables(config);
+        return config;
+    }
+    void render_scenegraph(scene::P<scene::SceneGraph> graph, render::RenderControl *control) {
         if (!graph->integrator) {
             std::cerr << "no integrator!" << std::endl;
             exit(1);
         }
+        // combinations the path tracers cannot render are errors rather than silently rendering something else
+        if (auto pt = graph->integrator->as<scene::PathTracer>()) {
+            if (pt->wavefront &&
+                (pt->adaptive || pt->spp_per_pass > 0 || !pt->checkpoint.empty() || pt->time_limit > 0.0)) {
+                throw std::runtime_error("the wavefront path tracer does not support adaptive sampling, progressive "
+                                         "passes, checkpoints or a time limit");
+            }
+            if (pt->adaptive && (pt->spp_per_pass > 0 || !pt->checkpoint.empty())) {
+                throw std::runtime_error("progressive passes and checkpoints are not supported with adaptive sampling");
+            }
+        }
         Allocator<> alloc;
         auto scene = render::create_scene(alloc, graph);
+        render::RenderControl default_control;
+        if (!control) {
+            control = &default_control;
+        }
+        if (graph->integrator->time_limit > 0.0) {
+            spdlog::info("time limit: {}s", graph->integrator->time_limit);
+            control->set_time_limit(graph->integrator->time_limit);
+        }
+        // the budget covers rendering only, not scene loading and BVH construction
+        control->start();
+        stats::reset();
+        Timer timer;
+        timer.start();
         if (auto pt = graph->integrator->as<scene::PathTracer>()) {
             render::PTConfig config;
             config.min_depth = pt->min_depth;
             config.max_depth = pt->max_depth;
             config.spp = pt->spp;
-            config.sampler = render::PCGSampler();
-            auto film = render::render_pt(config, *scene);
+            config.sampler = create_sampler_config(*graph->integrator, config.spp, scene->camera->resolution());
+            config.spp = config.sampler.spp;
+            config.control = control;
+            config.adaptive = pt->adaptive;
+            config.adaptive_min_spp = pt->adaptive_min_spp;
+            config.adaptive_threshold = pt->adaptive_threshold;
+            config.adaptive_target = pt->adaptive_target;
+            config.spp_per_pass = pt->spp_per_pass;
+            config.checkpoint = pt->checkpoint;
+            auto film =
+                pt->wavefront ? render::render_pt_wavefront(config, *scene) : render::render_pt(config, *scene);
             auto image = film.to_rgb_image();
             write_generic_image(image, graph->output_path);
+            if (pt->adaptive) {
+                write_generic_image(film.sample_count_image(),
+                                    fs::path(graph->output_path).replace_extension(".spp.exr"));
+            }
         } else if (auto upt = graph->integrator->as<scene::UnifiedPathTracer>()) {
             render::UPTConfig config;
             config.min_depth = upt->min_depth;
             config.max_depth = upt->max_depth;
             config.spp = upt->spp;
-            config.sampler = render::PCGSampler();
+            config.sampler = create_sampler_config(*graph->integrator, config.spp, scene->camera->resolution());
+            config.spp = config.sampler.spp;
             auto image = render::render_unified(config, *scene);
             write_generic_image(image, graph->output_path);
         } else if (auto bdpt = graph->integrator->as<scene::BDPT>()) {
@@ -292,7 +549,8 @@ namespace akari {
             config.min_depth = bdpt->min_depth;
             config.max_depth = bdpt->max_depth;
             config.spp = bdpt->spp;
-            config.sampler = render::PCGSampler();
+            config.sampler = create_sampler_config(*graph->integrator, config.spp, scene->camera->resolution());
+            config.spp = config.sampler.spp;
             auto image = render::render_bdpt(config, *scene);
             write_generic_image(image, graph->output_path);
         } else if (auto gpt = graph->integrator->as<scene::GuidedPathTracer>()) {
@@ -300,7 +558,9 @@ namespace akari {
             config.min_depth = gpt->min_depth;
             config.max_depth = gpt->max_depth;
             config.spp = gpt->spp;
-            config.sampler = render::PCGSampler();
+            config.sampler = create_sampler_config(*graph->integrator, config.spp, scene->camera->resolution());
+            config.spp = config.sampler.spp;
+            config.control = control;
             if (gpt->metropolized) {
                 (void)render::render_metropolized_ppg(config, *scene);
             } else {
@@ -312,7 +572,8 @@ namespace akari {
             config.min_depth = vpl->min_depth;
             config.max_depth = vpl->max_depth;
             config.spp = vpl->spp;
-            config.sampler = render::PCGSampler();
+            config.sampler = create_sampler_config(*graph->integrator, config.spp, scene->camera->resolution());
+            config.spp = config.sampler.spp;
             auto image = render::render_ir(config, *scene);
             write_generic_image(image, graph->output_path);
         } else if (auto smcmc = graph->integrator->as<scene::SMCMC>()) {
@@ -320,6 +581,7 @@ namespace akari {
             config.min_depth = smcmc->min_depth;
             config.max_depth = smcmc->max_depth;
             config.spp = smcmc->spp;
+            config.control = control;
             auto image = render::render_smcmc(config, *scene);
             write_generic_image(image, graph->output_path);
         } else if (auto mcmc = graph->integrator->as<scene::MCMC>()) {
@@ -327,8 +589,16 @@ namespace akari {
             config.min_depth = mcmc->min_depth;
             config.max_depth = mcmc->max_depth;
             config.spp = mcmc->spp;
+            config.control = control;
             auto image = render::render_mlt(config, *scene);
             write_generic_image(image, graph->output_path);
         }
+        const auto seconds  = timer.seconds_since_start();
+        const auto counters = stats::snapshot();
+        stats::print(counters, seconds);
+        spdlog::info("scratch arenas: {:.2f} MB high water, {:.2f} MB reserved",
+                     thread::arena_high_water_mark() / 1048576.0, thread::arena_bytes_reserved() / 1048576.0);
+        memory::print(memory::report());
+        stats::write_json(counters, seconds, fs::path(graph->output_path).replace_extension(".stats.json").string());
     }
 } // namespace akari
\ No newline at end of file
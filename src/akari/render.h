@@ -18,7 +18,10 @@
 #include <akari/bluenoise.h>
 #include <akari/image.h>
 #include <akari/scenegraph.h>
+#include <akari/memory.h>
 #include <array>
+#include <atomic>
+#include <chrono>
 namespace akari::scene {
     class SceneGraph;
 }
@@ -213,34 +216,111 @@ namespace akari::render {
         } while (i >= l);
         return (i + p) % l;
     }
+    inline uint32_t reverse_bits32(uint32_t n) {
+        n = (n << 16) | (n >> 16);
+        n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+        n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+        n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+        n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+        return n;
+    }
+    // spreads the lower 32 bits of x to the even bits of the result
+    inline uint64_t left_shift2(uint64_t x) {
+        x &= 0xffffffff;
+        x = (x ^ (x << 16)) & 0x0000ffff0000ffff;
+        x = (x ^ (x << 8)) & 0x00ff00ff00ff00ff;
+        x = (x ^ (x << 4)) & 0x0f0f0f0f0f0f0f0f;
+        x = (x ^ (x << 2)) & 0x3333333333333333;
+        x = (x ^ (x << 1)) & 0x5555555555555555;
+        return x;
+    }
+    inline uint64_t encode_morton2(uint32_t x, uint32_t y) { return (left_shift2(y) << 1) | left_shift2(x); }
+    // hash-based Owen scrambling of a 32-bit fixed point sample (Laine and Karras, with the constants of pbrt-v4)
+    inline uint32_t fast_owen_scramble(uint32_t v, uint32_t seed) {
+        v = reverse_bits32(v);
+        v ^= v * 0x3d20adea;
+        v += seed;
+        v *= (seed >> 16) | 1;
+        v ^= v * 0x05526c56;
+        v ^= v * 0x53a22864;
+        return reverse_bits32(v);
+    }
+    // Owen-scrambled point a of the first (dimension 0) or second (dimension 1) Sobol dimension
+    inline Float sobol_sample(uint64_t a, int dimension, uint32_t scramble) {
+        uint32_t v = 0;
+        if (dimension == 0) {
+            v = reverse_bits32(uint32_t(a));
+        } else {
+            // the generator matrix of the second dimension is Pascal's triangle mod 2
+            for (uint32_t c = 0x80000000; a != 0; a >>= 1, c ^= c >> 1) {
+                if (a & 1)
+                    v ^= c;
+            }
+        }
+        v = fast_owen_scramble(v, scramble);
+        return std::min(v * 0x1p-32f, OneMinusEpsilon);
+    }
+    // Points of the first pmj02bn set sorted into the pixels of a tile_size x tile_size block, spp points per pixel
+    // relative to the pixel corner. spp is rounded up to a power of 4 so that every pixel receives the same number of
+    // points, and the tile is shrunk until the block fits in the table.
+    struct PMJ02BNPixelSamples {
+        int tile_size = 0;
+        int spp       = 0;
+        std::vector<vec2> samples;
+        AKR_EXPORT PMJ02BNPixelSamples(int spp, int tile_size);
+        const vec2 &operator()(const ivec2 &pixel, int sample_index) const {
+            const int px = pixel.x % tile_size, py = pixel.y % tile_size;
+            return samples[(px + py * tile_size) * spp + sample_index];
+        }
+    };
+    // Immutable description of the sampler of a render. The per-pixel states are created from it on the stack with
+    // create_sampler; tables shared by all pixels are built once by build_sampler_tables.
     struct SamplerConfig {
         enum Type {
             PCG,
             LCG,
             PMJ02BN,
+            ZSOBOL,
         };
         Type type           = Type::PCG;
         int pixel_tile_size = 16;
         int spp             = 16;
+        ivec2 resolution    = ivec2(1);
+        uint64_t seed       = 0;
+        std::shared_ptr<const PMJ02BNPixelSamples> pmj02bn_pixel_samples;
     };
+    // Progressive multi-jittered (0,2) samples with blue-noise Cranley-Patterson rotations across pixels. The pixel
+    // table is owned by the SamplerConfig and shared read-only between all pixels.
     class PMJ02BNSampler {
-        int spp = 0;
-        int seed;
-        int dimension = 0, sample_index = 0;
+        int spp              = 1;
+        uint32_t width       = 1;
+        uint64_t seed        = 0;
+        int dimension        = 0, sample_index = 0;
+        uint32_t next_sample = 0;
         ivec2 pixel;
-        std::shared_ptr<vec2[]> pixel_samples;
-        int pixel_tile_size = 16;
+        const PMJ02BNPixelSamples *pixel_samples = nullptr;
+
+        uint64_t hash_dimension() const {
+            return mix_bits(((uint64_t)pixel.x << 48) ^ ((uint64_t)pixel.y << 32) ^ ((uint64_t)dimension << 16) ^
+                            seed);
+        }
 
       public:
-        void start_pixel_sample(ivec2 p, uint32_t idx, uint32_t dim) {
-            pixel        = p;
-            sample_index = idx;
-            dimension    = std::max(2u, dim);
+        PMJ02BNSampler() = default;
+        PMJ02BNSampler(const PMJ02BNPixelSamples *pixel_samples, const ivec2 &resolution, uint64_t seed = 0)
+            : spp(pixel_samples->spp), width(std::max(1, resolution.x)), seed(seed), pixel_samples(pixel_samples) {}
+        // idx is the index of the pixel in scanline order
+        void set_sample_index(uint64_t idx, uint32_t first_sample = 0) {
+            pixel       = ivec2(int(idx % width), int(idx / width));
+            next_sample = first_sample;
+        }
+        // samples past spp reuse the pixel table and the permutations of the first spp samples
+        void start_next_sample() {
+            sample_index = int(next_sample++ % uint32_t(spp));
+            dimension    = 0;
         }
         Float next1d() {
-            uint64_t hash =
-                mix_bits(((uint64_t)pixel.x << 48) ^ ((uint64_t)pixel.y << 32) ^ ((uint64_t)dimension << 16) ^ seed);
-            int index   = permutation_element(sample_index, spp, hash);
+            int index   = permutation_element(sample_index, spp, uint32_t(hash_dimension()));
             Float delta = blue_nosie(dimension, pixel);
             ++dimension;
             return std::min((index + delta) / spp, OneMinusEpsilon);
@@ -248,20 +328,15 @@ namespace akari::render {
         vec2 next2d() {
             if (dimension == 0) {
                 // Return pmj02bn pixel sample
-                int px = pixel.x % pixel_tile_size, py = pixel.y % pixel_tile_size;
-                int offset = (px + py * pixel_tile_size) * spp;
                 dimension += 2;
-                return (pixel_samples.get())[offset + sample_index];
-
+                return (*pixel_samples)(pixel, sample_index);
             } else {
                 // Compute index for 2D pmj02bn sample
                 int index       = sample_index;
                 int pmjInstance = dimension / 2;
                 if (pmjInstance >= N_PMJ02BN_SETS) {
                     // Permute index to be used for pmj02bn sample array
-                    uint64_t hash = mix_bits(((uint64_t)pixel.x << 48) ^ ((uint64_t)pixel.y << 32) ^
-                                             ((uint64_t)dimension << 16) ^ seed);
-                    index         = permutation_element(sample_index, spp, hash);
+                    index = permutation_element(sample_index, spp, uint32_t(hash_dimension()));
                 }
 
                 // Return randomized pmj02bn sample for current dimension
@@ -277,33 +352,121 @@ namespace akari::render {
                 return {std::min(u.x, OneMinusEpsilon), std::min(u.y, OneMinusEpsilon)};
             }
         }
-        void start_next_sample() {}
     };
 
+    // Owen-scrambled Sobol points shared by all pixels (Ahmed and Wonka, "Screen-Space Blue-Noise Diffusion of Monte
+    // Carlo Sampling Error via Hierarchical Ordering of Pixels"). The points of a pixel are a Morton-ordered block of
+    // the sequence with the base-4 digits of the index randomly permuted per dimension, so that the error is
+    // distributed as blue noise over the image. Every 1D and 2D request uses the first two Sobol dimensions with its
+    // own scrambling seed, so any number of dimensions is supported. Converges best with power-of-two spp; samples
+    // past the next power of two start a differently scrambled sequence.
+    class ZSobolSampler {
+        uint32_t width         = 1;
+        int log2_spp           = 0;
+        int n_base4_digits     = 0;
+        uint64_t seed          = 0;
+        uint64_t pixel_morton  = 0;
+        uint32_t next_sample   = 0;
+        uint64_t morton_index  = 0;
+        uint64_t sequence_seed = 0;
+        uint32_t dimension     = 0;
+
+        uint64_t sample_index() const {
+            static constexpr uint8_t permutations[24][4] = {
+                {0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+                {1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+                {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+                {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2}};
+            uint64_t index       = 0;
+            const bool odd_log2  = log2_spp & 1;
+            const int last_digit = odd_log2 ? 1 : 0;
+            for (int i = n_base4_digits - 1; i >= last_digit; i--) {
+                const int shift       = 2 * i - (odd_log2 ? 1 : 0);
+                const uint64_t higher = morton_index >> (shift + 2);
+                const int p           = (mix_bits(higher ^ (0x55555555u * dimension)) >> 24) % 24;
+                index |= uint64_t(permutations[p][(morton_index >> shift) & 3]) << shift;
+            }
+            if (odd_log2) {
+                index |= (morton_index & 1) ^ (mix_bits((morton_index >> 1) ^ (0x55555555u * dimension)) & 1);
+            }
+            return index;
+        }
+
+      public:
+        ZSobolSampler() = default;
+        ZSobolSampler(uint32_t spp, const ivec2 &resolution, uint64_t seed = 0)
+            : width(std::max(1, resolution.x)), seed(seed) {
+            while ((1u << log2_spp) < std::max(1u, spp))
+                log2_spp++;
+            int log2_res = 0;
+            while ((1 << log2_res) < std::max(resolution.x, resolution.y))
+                log2_res++;
+            n_base4_digits = log2_res + (log2_spp + 1) / 2;
+        }
+        // idx is the index of the pixel in scanline order
+        void set_sample_index(uint64_t idx, uint32_t first_sample = 0) {
+            pixel_morton = encode_morton2(uint32_t(idx % width), uint32_t(idx / width));
+            next_sample  = first_sample;
+        }
+        void start_next_sample() {
+            const uint32_t s = next_sample++;
+            morton_index     = (pixel_morton << log2_spp) | (s & ((1u << log2_spp) - 1));
+            sequence_seed    = mix_bits(seed ^ (s >> log2_spp));
+            dimension        = 0;
+        }
+        Float next1d() {
+            const uint64_t index = sample_index();
+            const uint64_t hash  = mix_bits((uint64_t(dimension) << 32) ^ sequence_seed);
+            dimension++;
+            return sobol_sample(index, 0, uint32_t(hash));
+        }
+        vec2 next2d() {
+            const uint64_t index = sample_index();
+            const uint64_t hash  = mix_bits((uint64_t(dimension) << 32) ^ sequence_seed);
+            dimension += 2;
+            return vec2(sobol_sample(index, 0, uint32_t(hash)), sobol_sample(index, 1, uint32_t(hash >> 32)));
+        }
+    };
+
+    // Each sample of a pixel draws from its own stream, so that a pixel can resume at any sample.
     class PCGSampler {
+        uint64_t seed        = 0;
+        uint64_t pixel       = 0;
+        uint32_t next_sample = 0;
         Rng rng;
 
       public:
-        void set_sample_index(uint64_t idx) { rng = Rng(idx); }
+        void set_sample_index(uint64_t idx, uint32_t first_sample = 0) {
+            pixel       = idx;
+            next_sample = first_sample;
+        }
         Float next1d() { return rng.uniform_float(); }
         vec2 next2d() { return vec2(next1d(), next1d()); }
-        void start_next_sample() {}
-        PCGSampler(uint64_t seed = 0u) : rng(seed) {}
+        void start_next_sample() { rng = Rng(mix_bits(mix_bits(seed ^ pixel) ^ next_sample++)); }
+        PCGSampler(uint64_t seed = 0u) : seed(seed), rng(seed) {}
     };
     class LCGSampler {
-        uint32_t seed;
+        uint32_t state;
+        uint64_t seed        = 0;
+        uint64_t pixel       = 0;
+        uint32_t next_sample = 0;
 
       public:
-        void set_sample_index(uint64_t idx) { seed = idx & 0xffffffff; }
+        void set_sample_index(uint64_t idx, uint32_t first_sample = 0) {
+            pixel       = idx;
+            next_sample = first_sample;
+        }
         Float next1d() {
-            seed = (1103515245 * seed + 12345);
-            return (Float)seed / (Float)0xFFFFFFFF;
+            state = (1103515245 * state + 12345);
+            return (Float)state / (Float)0xFFFFFFFF;
         }
         vec2 next2d() { return vec2(next1d(), next1d()); }
-        void start_next_sample() {}
-        LCGSampler(uint64_t seed = 0u) : seed(seed) {}
+        void start_next_sample() { state = uint32_t(mix_bits(mix_bits(seed ^ pixel) ^ next_sample++)); }
+        LCGSampler(uint64_t seed = 0u) : state(uint32_t(seed)), seed(seed) {}
     };
 
+    // Primary sample space state of a Markov chain. It owns a growing vector and is kept by the chain; the path tracers
+    // see it through a SamplerHandle.
     struct MLTSampler {
         struct PrimarySample {
             Float value;
@@ -321,9 +484,9 @@ namespace akari::render {
                 last_modification_iteration = last_modified_backup;
             }
         };
-        explicit MLTSampler(unsigned int seed) : rng(seed) {}
+        explicit MLTSampler(unsigned int seed, Allocator<> alloc = Allocator<>()) : rng(seed), X(alloc) {}
         Rng rng;
-        std::vector<PrimarySample> X;
+        astd::pmr::vector<PrimarySample> X;
         uint64_t current_iteration = 0;
         bool large_step            = true;
         uint64_t last_large_step   = 0;
@@ -429,20 +592,83 @@ namespace akari::render {
         Rng rng;
         astd::pmr::vector<Float> Xs;
     };
-    struct Sampler : Variant<LCGSampler, PCGSampler, MLTSampler, ReplaySampler> {
+    // Non-owning reference to a sampler whose state does not fit in a Sampler, such as the primary samples of a chain
+    template <class S>
+    struct SamplerHandle {
+        S *sampler = nullptr;
+        explicit SamplerHandle(S *sampler) : sampler(sampler) {}
+        Float next1d() { return sampler->next1d(); }
+        vec2 next2d() { return sampler->next2d(); }
+        void start_next_sample() { sampler->start_next_sample(); }
+        void set_sample_index(uint64_t idx, uint32_t) { sampler->set_sample_index(idx); }
+    };
+    // Per-pixel sampler state. Every alternative is a few trivially copyable words, so that it lives on the stack of
+    // the thread that renders the pixel.
+    struct Sampler : Variant<LCGSampler, PCGSampler, PMJ02BNSampler, ZSobolSampler, SamplerHandle<MLTSampler>,
+                             SamplerHandle<ReplaySampler>> {
         using Variant::Variant;
         Sampler() : Sampler(PCGSampler()) {}
         Float next1d() { AKR_VAR_DISPATCH(next1d); }
         vec2 next2d() { AKR_VAR_DISPATCH(next2d); }
         void start_next_sample() { AKR_VAR_DISPATCH(start_next_sample); }
-        void set_sample_index(uint64_t idx) { AKR_VAR_DISPATCH(set_sample_index, idx); }
+        void set_sample_index(uint64_t idx, uint32_t first_sample = 0) {
+            AKR_VAR_DISPATCH(set_sample_index, idx, first_sample);
+        }
     };
+    static_assert(std::is_trivially_copyable_v<PCGSampler> && std::is_trivially_copyable_v<LCGSampler> &&
+                  std::is_trivially_copyable_v<PMJ02BNSampler> && std::is_trivially_copyable_v<ZSobolSampler>);
+    static_assert(sizeof(Sampler) <= 80);
+
+    // Builds the tables the config shares between all pixels, once per render. The low discrepancy samplers only
+    // support some sample counts, spp is rounded up to the next one (a power of 4 for PMJ02BN, of 2 for ZSobol);
+    // renderers take their spp from the config afterwards.
+    AKR_EXPORT void build_sampler_tables(SamplerConfig &config);
+    // State of the pixel with the given index in scanline order, positioned so that the next start_next_sample
+    // begins sample first_sample of the pixel
+    inline Sampler create_sampler(const SamplerConfig &config, uint64_t pixel, uint32_t first_sample = 0) {
+        Sampler sampler;
+        switch (config.type) {
+        case SamplerConfig::LCG:
+            sampler = LCGSampler(config.seed);
+            break;
+        case SamplerConfig::PMJ02BN:
+            AKR_ASSERT(config.pmj02bn_pixel_samples);
+            sampler = PMJ02BNSampler(config.pmj02bn_pixel_samples.get(), config.resolution, config.seed);
+            break;
+        case SamplerConfig::ZSOBOL:
+            sampler = ZSobolSampler(config.spp, config.resolution, config.seed);
+            break;
+        default:
+            sampler = PCGSampler(config.seed);
+        }
+        sampler.set_sample_index(pixel, first_sample);
+        return sampler;
+    }
 
     struct Film {
-        Array2D<Spectrum> radiance;
-        Array2D<Float> weight;
-        Array2D<std::array<AtomicFloat, Spectrum::size>> splats;
-        explicit Film(const ivec2 &dimension) : radiance(dimension), weight(dimension), splats(dimension) {}
+        Array2D<Spectrum, Allocator<Spectrum>> radiance;
+        Array2D<Float, Allocator<Float>> weight;
+        Array2D<std::array<AtomicFloat, Spectrum::size>, Allocator<std::array<AtomicFloat, Spectrum::size>>> splats;
+        explicit Film(const ivec2 &dimension, Allocator<> alloc = Allocator<>(memory::buffer_resource(memory::Film)))
+            : radiance(dimension, alloc), weight(dimension, alloc), splats(dimension, alloc) {
+            if (thread::affinity() != thread::ThreadAffinity::None) {
+                first_touch();
+            }
+        }
+        // Clears the film with the 16x16 tile decomposition used by the renderers, so that with pinned threads
+        // each tile is stored on the NUMA node of the thread that renders it
+        void first_touch() {
+            thread::discard_pages(radiance.data(), sizeof(Spectrum) * hprod(resolution()));
+            thread::discard_pages(weight.data(), sizeof(Float) * hprod(resolution()));
+            thread::discard_pages(splats.data(), sizeof(splats(0, 0)) * hprod(resolution()));
+            thread::parallel_for(thread::blocked_range<2>(resolution(), ivec2(16, 16)), [&](ivec2 id, uint32_t) {
+                radiance(id) = Spectrum(0.0);
+                weight(id)   = 0.0;
+                for (auto &s : splats(id)) {
+                    s.set(0.0);
+                }
+            });
+        }
         void add_sample(const ivec2 &p, const Spectrum &sample, Float weight_) {
             weight(p) += weight_;
             radiance(p) += sample;
@@ -496,6 +722,16 @@ namespace akari::render {
             });
             return image;
         }
+        // samples per pixel, for the renderers that add every sample with weight 1
+        Image sample_count_image() const {
+            Image image({"Y"}, resolution());
+            thread::parallel_for(resolution().y, [&](uint32_t y, uint32_t) {
+                for (int x = 0; x < resolution().x; x++) {
+                    image(x, y, 0) = weight(x, y);
+                }
+            });
+            return image;
+        }
     };
     struct CameraSample {
         vec2 p_lens;
@@ -830,29 +1066,15 @@ namespace akari::render {
         [[nodiscard]] std::optional<BSDFSample> sample(const vec2 &u, const Vec3 &wo) const;
         [[nodiscard]] BSDFValue albedo() const { return BSDFValue::with_specular((R + T) * 0.5); }
     };
-    class MixBSDF {
-      public:
-        Float fraction;
-        const BSDFClosure *bsdf_A = nullptr;
-        const BSDFClosure *bsdf_B = nullptr;
-        MixBSDF(Float fraction, const BSDFClosure *bsdf_A, const BSDFClosure *bsdf_B)
-            : fraction(fraction), bsdf_A(bsdf_A), bsdf_B(bsdf_B) {}
-        [[nodiscard]] Float evaluate_pdf(const Vec3 &wo, const Vec3 &wi) const;
-        [[nodiscard]] BSDFValue evaluate(const Vec3 &wo, const Vec3 &wi) const;
-        [[nodiscard]] BSDFType type() const;
-        std::optional<BSDFSample> sample(const vec2 &u, const Vec3 &wo) const;
-        BSDFValue albedo() const;
-    };
-
     /*
-    All BSDFClosure except MixBSDF must have *only* one of Diffuse, Glossy, Specular
-
-
+    Every BSDFClosure must have *only* one of Diffuse, Glossy, Specular
+    Mixtures are represented by the lobes of BSDF
     */
     class BSDFClosure : public Variant<DiffuseBSDF, MicrofacetReflection, SpecularReflection, SpecularTransmission,
-                                       FresnelSpecular, MixBSDF> {
+                                       FresnelSpecular> {
       public:
         using Variant::Variant;
+        BSDFClosure() : BSDFClosure(DiffuseBSDF(Spectrum(0.0))) {}
         [[nodiscard]] Float evaluate_pdf(const Vec3 &wo, const Vec3 &wi) const {
             AKR_VAR_DISPATCH(evaluate_pdf, wo, wi);
         }
@@ -869,27 +1091,62 @@ namespace akari::render {
         Vec2 u1;
         const Vec3 wo;
     };
+    // Weighted sum of up to MAX_LOBES closures stored inline, the weights sum to one.
+    // The lobe to sample is selected with u0.
     class BSDF {
-        std::optional<BSDFClosure> closure_;
+      public:
+        static constexpr int MAX_LOBES = 2;
+
+      private:
+        std::array<BSDFClosure, MAX_LOBES> lobes;
+        std::array<Float, MAX_LOBES> weights = {};
+        int n_lobes                          = 0;
         Frame frame;
         Float choice_pdf = 1.0f;
 
       public:
         BSDF(const Frame &frame) : frame(frame) {}
-        bool null() const { return !closure_.has_value(); }
-        void set_closure(const BSDFClosure &closure) { closure_ = closure; }
+        bool null() const { return n_lobes == 0; }
+        void set_closure(const BSDFClosure &closure) {
+            n_lobes = 0;
+            add_lobe(1.0f, closure);
+        }
+        void add_lobe(Float weight, const BSDFClosure &closure) {
+            AKR_ASSERT(n_lobes < MAX_LOBES);
+            lobes[n_lobes]   = closure;
+            weights[n_lobes] = weight;
+            n_lobes++;
+        }
+        int lobe_count() const { return n_lobes; }
+        const BSDFClosure &lobe(int i) const { return lobes[i]; }
+        Float lobe_weight(int i) const { return weights[i]; }
         void set_choice_pdf(Float pdf) { choice_pdf = pdf; }
-        const BSDFClosure &closure() const { return *closure_; }
         [[nodiscard]] Float evaluate_pdf(const Vec3 &wo, const Vec3 &wi) const {
-            auto pdf = closure().evaluate_pdf(frame.world_to_local(wo), frame.world_to_local(wi));
+            auto wo_  = frame.world_to_local(wo);
+            auto wi_  = frame.world_to_local(wi);
+            Float pdf = 0.0f;
+            for (int i = 0; i < n_lobes; i++) {
+                pdf += weights[i] * lobes[i].evaluate_pdf(wo_, wi_);
+            }
             return pdf * choice_pdf;
         }
         [[nodiscard]] BSDFValue evaluate(const Vec3 &wo, const Vec3 &wi) const {
-            auto f = closure().evaluate(frame.world_to_local(wo), frame.world_to_local(wi));
+            auto wo_    = frame.world_to_local(wo);
+            auto wi_    = frame.world_to_local(wi);
+            BSDFValue f = BSDFValue::zero();
+            for (int i = 0; i < n_lobes; i++) {
+                f = f + weights[i] * lobes[i].evaluate(wo_, wi_);
+            }
             return f;
         }
 
-        [[nodiscard]] BSDFType type() const { return closure().type(); }
+        [[nodiscard]] BSDFType type() const {
+            auto ty = BSDFType::Unset;
+            for (int i = 0; i < n_lobes; i++) {
+                ty = ty | lobes[i].type();
+            }
+            return ty;
+        }
         [[nodiscard]] bool is_pure_delta() const {
             auto ty = type();
             if (BSDFType::Unset == (ty & BSDFType::Specular))
@@ -900,15 +1157,35 @@ namespace akari::render {
                 return false;
             return true;
         }
-        [[nodiscard]] bool match_flags(BSDFType flag) const { return closure().match_flags(flag); }
+        [[nodiscard]] bool match_flags(BSDFType flag) const { return ((uint32_t)type() & (uint32_t)flag) != 0; }
         std::optional<BSDFSample> sample(const BSDFSampleContext &ctx) const {
             auto wo = frame.world_to_local(ctx.wo);
-            if (auto sample = closure().sample(ctx.u1, wo)) {
-                sample->wi = frame.local_to_world(sample->wi);
-                sample->pdf *= choice_pdf;
-                return sample;
+            int sel = 0;
+            Float u = ctx.u0;
+            while (sel + 1 < n_lobes && u >= weights[sel]) {
+                u -= weights[sel];
+                sel++;
+            }
+            auto sample = lobes[sel].sample(ctx.u1, wo);
+            if (!sample) {
+                return std::nullopt;
             }
-            return std::nullopt;
+            if (n_lobes > 1) {
+                sample->f   = weights[sel] * sample->f;
+                sample->pdf = weights[sel] * sample->pdf;
+                // delta lobes cannot be evaluated in the direction sampled by another lobe
+                if ((sample->type & BSDFType::Specular) == BSDFType::Unset) {
+                    for (int i = 0; i < n_lobes; i++) {
+                        if (i != sel) {
+                            sample->f   = sample->f + weights[i] * lobes[i].evaluate(wo, sample->wi);
+                            sample->pdf = sample->pdf + weights[i] * lobes[i].evaluate_pdf(wo, sample->wi);
+                        }
+                    }
+                }
+            }
+            sample->wi = frame.local_to_world(sample->wi);
+            sample->pdf *= choice_pdf;
+            return sample;
         }
     };
 
@@ -992,12 +1269,20 @@ namespace akari::render {
         const scene::Mesh *mesh  = nullptr;
         const Material *material = nullptr;
         const Medium *medium     = nullptr;
+        // vertices and normals are already in world space, either the transform is the identity or they point to
+        // the geometry cache of the scene
+        bool world_space = false;
 
         Triangle get_triangle(int prim_id) const {
             Triangle trig;
             for (int i = 0; i < 3; i++) {
-                trig.vertices[i] = transform.apply_vector(vertices[indices[prim_id][i]]);
-                trig.normals[i]  = transform.apply_normal(normals[indices[prim_id][i]]);
+                if (world_space) {
+                    trig.vertices[i] = vertices[indices[prim_id][i]];
+                    trig.normals[i]  = normals[indices[prim_id][i]];
+                } else {
+                    trig.vertices[i] = transform.apply_point(vertices[indices[prim_id][i]]);
+                    trig.normals[i]  = transform.apply_normal(normals[indices[prim_id][i]]);
+                }
                 if (!texcoords.empty())
                     trig.texcoords[i] = texcoords[indices[prim_id][i]];
                 else {
@@ -1080,30 +1365,51 @@ namespace akari::render {
         }
     };
 
+    // Hit point on a mesh instance. The triangle is referenced through shape and prim_id rather than copied,
+    // only the geometry every bounce needs is computed up front.
     struct SurfaceInteraction {
-        Triangle triangle;
+        const MeshInstance *shape = nullptr;
+        int prim_id               = -1;
+        vec2 uv;
         Vec3 p;
         Vec3 ng, ns;
         vec2 texcoords;
-        Vec3 dndu, dndv;
         Vec3 dpdu, dpdv;
-        const MeshInstance *shape = nullptr;
-        SurfaceInteraction(const vec2 &uv, const Triangle &triangle)
-            : triangle(triangle), p(triangle.p(uv)), ng(triangle.ng()), ns(triangle.ns(uv)),
-              texcoords(triangle.texcoord(uv)) {
-            dpdu                 = triangle.dpdu(uv[0]);
-            dpdv                 = triangle.dpdu(uv[1]);
-            std::tie(dndu, dndv) = triangle.dnduv(uv);
-        }
-        const Light *light() const { return triangle.light; }
-        const Material *material() const { return triangle.material; }
+        SurfaceInteraction(const MeshInstance *shape, int prim_id, const vec2 &uv)
+            : shape(shape), prim_id(prim_id), uv(uv) {
+            const auto &idx = shape->indices[prim_id];
+            const auto &v0  = shape->vertices[idx[0]];
+            const auto &v1  = shape->vertices[idx[1]];
+            const auto &v2  = shape->vertices[idx[2]];
+            p               = lerp3(v0, v1, v2, uv);
+            dpdu            = v1 - v0;
+            dpdv            = v2 - v0;
+            ns              = lerp3(shape->normals[idx[0]], shape->normals[idx[1]], shape->normals[idx[2]], uv);
+            if (!shape->world_space) {
+                // interpolated in object space, the transform is linear
+                p    = shape->transform.apply_point(p);
+                dpdu = shape->transform.apply_vector(dpdu);
+                dpdv = shape->transform.apply_vector(dpdv);
+                ns   = shape->transform.apply_normal(ns);
+            }
+            ng = normalize(cross(dpdu, dpdv));
+            ns = normalize(ns);
+            if (!shape->texcoords.empty()) {
+                texcoords = lerp3(shape->texcoords[idx[0]], shape->texcoords[idx[1]], shape->texcoords[idx[2]], uv);
+            } else {
+                texcoords = lerp3(vec2(0, 1), vec2(0, 0), vec2(1, 1), uv);
+            }
+        }
+        const Light *light() const { return shape->lights.empty() ? nullptr : shape->lights[prim_id]; }
+        const Material *material() const { return shape->material; }
         const Medium *medium() const { return shape->medium; }
+        // derivatives of the shading normal, computed on demand since only manifold walks need them
+        std::pair<Vec3, Vec3> dnduv() const { return shape->get_triangle(prim_id).dnduv(uv); }
+        // dndu and dndv are left unset, see dnduv()
         ShadingPoint sp() const {
             ShadingPoint sp_;
             sp_.n         = ns;
             sp_.texcoords = texcoords;
-            sp_.dndu      = dndu;
-            sp_.dndv      = dndv;
             sp_.dpdu      = dpdu;
             sp_.dpdv      = dpdv;
             return sp_;
@@ -1206,6 +1512,7 @@ namespace akari::render {
         LightRaySample sample_emission(Sampler &sampler) const { AKR_VAR_DISPATCH(sample_emission, sampler); }
         LightSample sample_incidence(const LightSampleContext &ctx) const { AKR_VAR_DISPATCH(sample_incidence, ctx); }
     };
+    // Compact hit record returned by the acceleration structure, see SurfaceInteraction for the shading data
     struct Intersection {
         Float t = Inf;
         Vec2 uv;
@@ -1213,15 +1520,99 @@ namespace akari::render {
         int prim_id = -1;
         bool hit() const { return geom_id != -1; }
     };
+
+    // SoA batch of rays, traced with a single call to EmbreeAccel::intersect_stream/occlude_stream
+    struct RayStream {
+        std::vector<Float> ox, oy, oz;
+        std::vector<Float> dx, dy, dz;
+        std::vector<Float> tmin, tmax;
+        // rays share origin/direction locality (e.g. camera rays of a tile)
+        bool coherent = false;
+        size_t size() const { return ox.size(); }
+        bool empty() const { return ox.empty(); }
+        void resize(size_t n) {
+            for (auto *v : {&ox, &oy, &oz, &dx, &dy, &dz, &tmin, &tmax}) {
+                v->resize(n);
+            }
+        }
+        void reserve(size_t n) {
+            for (auto *v : {&ox, &oy, &oz, &dx, &dy, &dz, &tmin, &tmax}) {
+                v->reserve(n);
+            }
+        }
+        void clear() { resize(0); }
+        void set(size_t i, const Ray &ray) {
+            ox[i]   = ray.o.x;
+            oy[i]   = ray.o.y;
+            oz[i]   = ray.o.z;
+            dx[i]   = ray.d.x;
+            dy[i]   = ray.d.y;
+            dz[i]   = ray.d.z;
+            tmin[i] = ray.tmin;
+            tmax[i] = ray.tmax;
+        }
+        size_t push_back(const Ray &ray) {
+            auto i = size();
+            resize(i + 1);
+            set(i, ray);
+            return i;
+        }
+        Ray get(size_t i) const {
+            return Ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]), tmin[i], tmax[i]);
+        }
+    };
+    // SoA hit records of a RayStream; geom_id == -1 marks a miss
+    struct HitStream {
+        std::vector<Float> t;
+        std::vector<Float> u, v;
+        std::vector<int> geom_id, prim_id;
+        size_t size() const { return t.size(); }
+        void resize(size_t n) {
+            t.resize(n);
+            u.resize(n);
+            v.resize(n);
+            geom_id.resize(n);
+            prim_id.resize(n);
+        }
+        bool hit(size_t i) const { return geom_id[i] != -1; }
+        Intersection get(size_t i) const {
+            Intersection isct;
+            isct.t       = t[i];
+            isct.uv      = vec2(u[i], v[i]);
+            isct.geom_id = geom_id[i];
+            isct.prim_id = prim_id[i];
+            return isct;
+        }
+    };
     struct Scene;
     class EmbreeAccel {
       public:
         virtual void build(const Scene &scene, const std::shared_ptr<scene::SceneGraph> &scene_graph) = 0;
         virtual std::optional<Intersection> intersect1(const Ray &ray) const                          = 0;
         virtual bool occlude1(const Ray &ray) const                                                   = 0;
-        virtual Bounds3f world_bounds() const                                                         = 0;
+        // hits is resized to rays.size()
+        virtual void intersect_stream(const RayStream &rays, HitStream &hits) const = 0;
+        // occluded[i] is set to 1 if rays[i] is blocked
+        virtual void occlude_stream(const RayStream &rays, std::vector<uint8_t> &occluded) const = 0;
+        virtual Bounds3f world_bounds() const                                                    = 0;
+    };
+    // trade-off of the acceleration structure between build time, memory and traversal speed
+    enum class AccelProfile {
+        Auto,        // picked by create_scene from the scene size, the sample budget and the free memory
+        Fast,        // quick builds for previews
+        HighQuality, // slow builds, fastest traversal
+        Compact,     // less memory at some traversal cost
+        Robust,      // conservative intersection tests
     };
-    std::shared_ptr<EmbreeAccel> create_embree_accel();
+    // "auto", "fast", "high-quality", "compact" or "robust"
+    AKR_EXPORT std::optional<AccelProfile> parse_accel_profile(const std::string &name);
+    AKR_EXPORT const char *accel_profile_name(AccelProfile profile);
+#ifdef AKR_BACKEND_EMBREE
+    std::shared_ptr<EmbreeAccel> create_embree_accel(AccelProfile profile = AccelProfile::HighQuality);
+#endif
+    // native two-level BVH with 4- or 8-wide nodes, per-mesh BVHs are cached in cache_dir unless it is empty
+    std::shared_ptr<EmbreeAccel> create_bvh_accel(const std::string &cache_dir, int width = 8,
+                                                  AccelProfile profile = AccelProfile::HighQuality);
 
     struct PowerLightSampler {
         PowerLightSampler(Allocator<> alloc, BufferView<const Light *> lights_, const std::vector<Float> &power)
@@ -1259,8 +1650,14 @@ namespace akari::render {
         Allocator<> allocator;
         std::optional<LightSampler> light_sampler;
         astd::pmr::monotonic_buffer_resource *rsrc;
+        // account scene objects and lights in their memory categories
+        std::unique_ptr<memory::TrackingResource> scene_tracker, light_tracker;
+        // world-space vertices and normals of transformed instances, see MeshInstance::world_space
+        std::vector<astd::pmr::vector<vec3>> geometry_cache;
         std::optional<SurfaceInteraction> intersect(const Ray &ray) const;
         bool occlude(const Ray &ray) const;
+        void intersect_stream(const RayStream &rays, HitStream &hits) const;
+        void occlude_stream(const RayStream &rays, std::vector<uint8_t> &occluded) const;
         Scene()              = default;
         Scene(const Scene &) = delete;
         ~Scene();
@@ -1268,19 +1665,71 @@ namespace akari::render {
 
     std::shared_ptr<const Scene> create_scene(Allocator<>, const std::shared_ptr<scene::SceneGraph> &scene_graph);
 
+    // Shared between a renderer and whoever drives it, possibly from another thread.
+    // Renderers check can_start() before each pass and should_stop() at pixel or chain granularity inside a pass;
+    // when they stop early they return what they have accumulated, with every pixel weighted by the samples it
+    // actually received.
+    class RenderControl {
+      public:
+        using clock = std::chrono::steady_clock;
+        RenderControl() : start_time(clock::now()) {}
+        // seconds, <= 0 for no limit
+        explicit RenderControl(double time_limit) : RenderControl() { this->time_limit = time_limit; }
+        // restarts the clock the time limit is measured from
+        void start() { start_time = clock::now(); }
+        void set_time_limit(double seconds) { time_limit = seconds; }
+        bool has_time_limit() const { return time_limit > 0.0; }
+        // safe to call from a signal handler
+        void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+        bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+        double elapsed_seconds() const {
+            return std::chrono::duration<double>(clock::now() - start_time).count();
+        }
+        bool should_stop() const { return cancelled() || (has_time_limit() && elapsed_seconds() >= time_limit); }
+        // whether a pass that is expected to take `estimated_seconds` still fits into the budget
+        bool can_start(double estimated_seconds) const {
+            return !cancelled() && (!has_time_limit() || elapsed_seconds() + estimated_seconds <= time_limit);
+        }
+
+      private:
+        std::atomic_bool cancelled_{false};
+        double time_limit = 0.0;
+        clock::time_point start_time;
+    };
+
     // experimental path space denoising
     struct PSDConfig {
         size_t filter_radius = 8;
     };
     struct PTConfig {
-        Sampler sampler;
+        SamplerConfig sampler;
         int min_depth = 3;
         int max_depth = 5;
-        int spp       = 16;
+        // upper bound on the samples per pixel when control has a time limit or sampling is adaptive
+        int spp                = 16;
+        RenderControl *control = nullptr;
+        // adaptive sampling: adaptive_min_spp uniform samples, then more samples for the pixels whose relative
+        // standard error is above adaptive_threshold until the mean error over the image reaches adaptive_target
+        bool adaptive            = false;
+        int adaptive_min_spp     = 16;
+        Float adaptive_threshold = 0.02;
+        Float adaptive_target    = 0.0;
+        // progressive rendering: spp_per_pass samples per pixel over the whole frame per pass. 0 renders tile by tile,
+        // or in passes of DEFAULT_SPP_PER_PASS with a control or checkpoint.
+        // After each pass the film is written to checkpoint (if set), which a restarted render resumes from.
+        static constexpr int DEFAULT_SPP_PER_PASS = 4;
+        int spp_per_pass                          = 0;
+        std::string checkpoint;
     };
     Film render_pt(PTConfig config, const Scene &scene);
+    // checkpoints of the progressive passes of render_pt: the film and the samples per pixel already taken
+    void write_pt_checkpoint(const fs::path &path, const PTConfig &config, const Film &film, uint32_t spp_done);
+    // restores the film and returns the samples per pixel already taken, 0 if there is no usable checkpoint
+    uint32_t load_pt_checkpoint(const fs::path &path, const PTConfig &config, Film &film);
+    // same estimator as render_pt, but paths are advanced stage by stage in batches
+    Film render_pt_wavefront(PTConfig config, const Scene &scene);
     struct UPTConfig {
-        Sampler sampler;
+        SamplerConfig sampler;
         int min_depth = 3;
         int max_depth = 5;
         int spp       = 16;
@@ -1305,7 +1754,7 @@ namespace akari::render {
     }
 
     struct IRConfig {
-        Sampler sampler;
+        SamplerConfig sampler;
         int min_depth = 3;
         int max_depth = 5;
         uint32_t spp  = 16;
@@ -1315,7 +1764,7 @@ namespace akari::render {
     Image render_ir(IRConfig config, const Scene &scene);
 
     struct SMSConfig {
-        Sampler sampler;
+        SamplerConfig sampler;
         int min_depth = 3;
         int max_depth = 5;
         int spp       = 16;
@@ -1324,7 +1773,7 @@ namespace akari::render {
     // sms single scatter
     Film render_sms_ss(SMSConfig config, const Scene &scene);
     struct BDPTConfig {
-        Sampler sampler;
+        SamplerConfig sampler;
         int min_depth = 3;
         int max_depth = 5;
         int spp       = 16;
@@ -1333,11 +1782,12 @@ namespace akari::render {
     Image render_bdpt(PTConfig config, const Scene &scene);
 
     struct MLTConfig {
-        int num_bootstrap = 100000;
-        int num_chains    = 1024;
-        int min_depth     = 3;
-        int max_depth     = 5;
-        int spp           = 16;
+        int num_bootstrap      = 100000;
+        int num_chains         = 1024;
+        int min_depth          = 3;
+        int max_depth          = 5;
+        int spp                = 16;
+        RenderControl *control = nullptr;
     };
     Image render_mlt(MLTConfig config, const Scene &scene);
     Image render_smcmc(MLTConfig config, const Scene &scene);
@@ -92,12 +92,15 @@ namespace akari::render {
             if (auto glossy_refl = closure.get<MicrofacetReflection>()) {
                 return glm::smoothstep(0.1f, 0.6f, glossy_refl->roughness);
             }
-            if (auto mix = closure.get<MixBSDF>()) {
-                return (1.0f - mix->fraction) * ir_sample_fraction(*mix->bsdf_A) +
-                       mix->fraction * ir_sample_fraction(*mix->bsdf_B);
-            }
             return 1.0;
         }
+        static Float ir_sample_fraction(const BSDF &bsdf) {
+            Float frac = 0.0;
+            for (int i = 0; i < bsdf.lobe_count(); i++) {
+                frac += bsdf.lobe_weight(i) * ir_sample_fraction(bsdf.lobe(i));
+            }
+            return frac;
+        }
         static Float mis_weight(Float pdf_A, Float pdf_B) {
             pdf_A *= pdf_A;
             pdf_B *= pdf_B;
@@ -106,29 +109,26 @@ namespace akari::render {
     } // namespace ir
     Image render_ir(IRConfig config, const Scene &scene) {
         Film film(scene.camera->resolution());
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
-        }
-        auto vpl_sampler = config.sampler;
-        std::vector<Sampler> samplers(hprod(scene.camera->resolution()));
-        for (size_t i = 0; i < samplers.size(); i++) {
-            samplers[i] = config.sampler;
-            samplers[i].set_sample_index(i);
-        }
-        astd::pmr::monotonic_buffer_resource vpl_buf(astd::pmr::new_delete_resource());
+        // the VPLs get the index past the last pixel, so that they do not share a sequence with a pixel
+        Sampler vpl_sampler = create_sampler(config.sampler, hprod(scene.camera->resolution()));
+        // the VPL vector grows while it is generated; a pool reuses the blocks it leaves behind
+        astd::pmr::unsynchronized_pool_resource vpl_pool;
         for (uint32_t pass = 0; pass < config.spp; pass++) {
+            // frees the VPLs of the previous pass along with their BSDFs
+            vpl_pool.release();
             vpl_sampler.start_next_sample();
-            Allocator<> vpl_alloc(&vpl_buf);
+            Allocator<> vpl_alloc(&vpl_pool);
             Float max_radiance = 0.0;
             auto vpls = ir::generate_vpls(config, scene, vpl_sampler, vpl_alloc, max_radiance);
             auto kernel = [&](ivec2 id, uint32_t tid) {
-                Sampler &sampler = samplers[id.x + id.y * film.resolution().x];
+                Sampler sampler = create_sampler(config.sampler, id.x + id.y * film.resolution().x, pass);
+                sampler.start_next_sample();
                 Spectrum L(0.0);
                 // Spectrum beta(1.0);
                 auto camera_sample = scene.camera->generate_ray(sampler.next2d(), sampler.next2d(), id);
                 Ray ray = camera_sample.ray;
-                auto alloc = Allocator<>(buffers[tid]);
+                ArenaFrame frame(thread::arena(tid));
+                auto alloc = frame.allocator();
                 // auto rec_sampler = sampler;
 #if 1
                 auto estimate = [&](const Ray ray, Spectrum beta, const int depth,
@@ -161,8 +161,8 @@ namespace akari::render {
                     if (!material)
                         return;
                     auto bsdf = material->evaluate(sampler, alloc, *si);
-                    if (si->triangle.light) {
-                        auto light = si->triangle.light;
+                    if (si->light()) {
+                        auto light = si->light();
                         Spectrum I = beta * light->Le(wo, si->sp());
                         if (depth == 0 || BSDFType::Unset != (prev_bsdf_type & BSDFType::Specular)) {
                             L += I;
@@ -175,7 +175,7 @@ namespace akari::render {
                             L += weight_bsdf * I;
                         }
                     }
-                    auto ir_frac = ir::ir_sample_fraction(bsdf.closure());
+                    auto ir_frac = ir::ir_sample_fraction(bsdf);
                     AKR_ASSERT(ir_frac >= 0.0 && ir_frac <= 1.0);
                     // Direct lighting
                     if (depth == 0 || ir_frac < 1.0 - 1e-3) {
@@ -313,8 +313,8 @@ namespace akari::render {
                     if (!material)
                         break;
                     auto bsdf = material->evaluate(sampler, alloc, *si);
-                    if (si->triangle.light) {
-                        auto light = si->triangle.light;
+                    if (si->light()) {
+                        auto light = si->light();
                         if (depth == 0 || BSDFType::Unset != (prev_bsdf_type & BSDFType::Specular)) {
                             Spectrum I = beta * light->Le(wo, si->sp());
                             L += I;
@@ -390,16 +390,11 @@ namespace akari::render {
                     depth++;
                 }
 #endif
-                buffers[tid]->release();
                 L = clamp_zero(L);
                 L = min(L, Spectrum(5.0));
                 film.add_sample(id, L, 1.0);
             };
             thread::parallel_for(thread::blocked_range<2>(film.resolution(), ivec2(16, 16)), kernel);
-            vpl_buf.release();
-        }
-        for (auto buf : buffers) {
-            delete buf;
         }
         spdlog::info("render ir done");
         return film.to_rgb_image();
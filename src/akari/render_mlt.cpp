@@ -16,6 +16,7 @@
 #include <spdlog/spdlog.h>
 #include <akari/render.h>
 #include <akari/render_mlt.h>
+#include <akari/profile.h>
 #include <numeric>
 namespace akari::render {
     void accept_markov_chain_and_splat(mlt::MLTStats &stats, Rng &rng, const mlt::RadianceRecord &proposal,
@@ -25,10 +26,10 @@ namespace akari::render {
             T(chain.current.radiance) == 0.0
                 ? 1.0f
                 : std::max<Float>(0.0, std::min<Float>(1.0, T(proposal.radiance) / T(chain.current.radiance)));
-        auto &mlt_sampler = *chain.sampler.get<MLTSampler>();
+        auto &mlt_sampler = chain.sampler;
         if (mlt_sampler.large_step) {
-            stats.acc_b.add(T(proposal.radiance));
-            stats.n_large++;
+            chain.large_step_sum += T(proposal.radiance);
+            chain.n_large_steps++;
         }
         // Float weight1 = (accept + (mlt_sampler.large_step ? 1.0 : 0.0)) /
         // (T(proposal.radiance) / b + mlt_sampler.large_step_prob);
@@ -78,8 +79,11 @@ namespace akari::render {
             {
 
                 astd::pmr::monotonic_buffer_resource resource;
+                // the bootstrap samplers grow and drop their primary sample vectors one after another
+                astd::pmr::unsynchronized_pool_resource sampler_pool;
                 for (auto seed : seeds) {
-                    Sampler sampler = MLTSampler(seed);
+                    MLTSampler mlt_sampler(seed, Allocator<>(&sampler_pool));
+                    Sampler sampler = SamplerHandle(&mlt_sampler);
                     sampler.start_next_sample();
                     ivec2 p_film = glm::min(scene.camera->resolution() - 1,
                                             ivec2(sampler.next2d() * vec2(scene.camera->resolution())));
@@ -94,12 +98,13 @@ namespace akari::render {
             std::uniform_real_distribution<> dist;
             astd::pmr::monotonic_buffer_resource resource;
             for (int i = 0; i < config.num_chains; i++) {
-                auto [idx, _] = distribution.sample_discrete(dist(rd));
-                auto chain = MarkovChain(MLTSampler(seeds[idx]));
-                chain.sampler.start_next_sample();
+                auto [idx, _]   = distribution.sample_discrete(dist(rd));
+                auto chain      = MarkovChain(MLTSampler(seeds[idx]));
+                Sampler sampler = SamplerHandle(&chain.sampler);
+                sampler.start_next_sample();
                 ivec2 p_film = glm::min(scene.camera->resolution() - 1,
-                                        ivec2(chain.sampler.next2d() * vec2(scene.camera->resolution())));
-                auto L = estimator(p_film, Allocator<>(&resource), scene, chain.sampler);
+                                        ivec2(sampler.next2d() * vec2(scene.camera->resolution())));
+                auto L = estimator(p_film, Allocator<>(&resource), scene, sampler);
                 AKR_ASSERT(T(L) > 0.0);
                 chain.current = RadianceRecord{p_film, L};
                 chains.emplace_back(chain);
@@ -125,28 +130,58 @@ namespace akari::render {
         Film film(scene.camera->resolution());
         spdlog::info("{} {}", b, mutations_per_chain);
         MLTStats stats;
-        thread::parallel_for(config.num_chains, [&](uint32_t id, uint32_t tid) {
-            astd::pmr::monotonic_buffer_resource resource;
-            auto &chain = chains[id];
-            auto &mlt_sampler = *chain.sampler.get<MLTSampler>();
+        std::vector<Rng> rngs;
+        for (int id = 0; id < config.num_chains; id++) {
             Rng rng(id);
-            mlt_sampler.rng = Rng(rng.uniform_u32());
-            for (size_t m = 0; m < mutations_per_chain; m++) {
-                chain.sampler.start_next_sample();
-                const ivec2 p_film = glm::min(scene.camera->resolution() - 1,
-                                              ivec2(chain.sampler.next2d() * vec2(scene.camera->resolution())));
-                const auto L =
-                    render_pt_pixel_wo_emitter_direct(pt_config, Allocator<>(&resource), scene, chain.sampler, p_film);
-
-                const RadianceRecord proposal{p_film, L};
-                accept_markov_chain_and_splat(stats, rng, proposal, chain, film);
-                resource.release();
+            chains[id].sampler.rng = Rng(rng.uniform_u32());
+            rngs.emplace_back(rng);
+        }
+        // the chains advance by about one sample per pixel per round, so that a time budget stops them together
+        const size_t mutations_per_round =
+            std::max<size_t>(1, size_t(hprod(scene.camera->resolution())) / size_t(config.num_chains));
+        auto *control = config.control;
+        std::atomic_uint64_t n_mutations(0);
+        Timer timer;
+        double round_time = 0.0;
+        for (size_t done = 0; done < mutations_per_chain; done += mutations_per_round) {
+            if (control && !control->can_start(round_time)) {
+                spdlog::info("out of time after {} of {} mutations per chain", done, mutations_per_chain);
+                break;
             }
-        });
-        b = (b * config.num_bootstrap + stats.acc_b.value()) / (config.num_bootstrap + stats.n_large.load());
-        spdlog::info("acceptance rate:{}%", stats.accepts * 100 / (stats.accepts + stats.rejects));
+            const size_t n = std::min(mutations_per_round, mutations_per_chain - done);
+            AKR_TRACE_SCOPE("mlt round");
+            timer.start();
+            thread::parallel_for(config.num_chains, [&](uint32_t id, uint32_t tid) {
+                ArenaFrame frame(thread::arena(tid));
+                auto &chain = chains[id];
+                auto &rng   = rngs[id];
+                for (size_t m = 0; m < n; m++) {
+                    if (control && control->should_stop())
+                        break;
+                    n_mutations++;
+                    Sampler sampler = SamplerHandle(&chain.sampler);
+                    sampler.start_next_sample();
+                    const ivec2 p_film = glm::min(scene.camera->resolution() - 1,
+                                                  ivec2(sampler.next2d() * vec2(scene.camera->resolution())));
+                    const auto L       = render_pt_pixel_wo_emitter_direct(pt_config, frame.allocator(), scene,
+                                                                           sampler, p_film);
+
+                    const RadianceRecord proposal{p_film, L};
+                    accept_markov_chain_and_splat(stats, rng, proposal, chain, film);
+                    frame.reset();
+                }
+            });
+            timer.stop();
+            round_time = timer.elapsed_seconds();
+        }
+        auto [acc_b, n_large] = large_step_stats(chains);
+        b                     = (b * config.num_bootstrap + acc_b) / (config.num_bootstrap + n_large);
+        AKR_TRACE_COUNTER("mlt acceptance",
+                          double(stats.accepts) / std::max<size_t>(1, stats.accepts + stats.rejects));
+        spdlog::info("acceptance rate:{}%", stats.accepts * 100 / std::max<size_t>(1, stats.accepts + stats.rejects));
         auto array = film.to_array2d();
-        array *= Spectrum(b / config.spp);
+        // normalized by the mutations actually made, in case the chains were stopped early
+        array *= Spectrum(b * double(hprod(scene.camera->resolution())) / std::max<uint64_t>(1, n_mutations));
         return array2d_to_rgb(array);
     }
 } // namespace akari::render
\ No newline at end of file
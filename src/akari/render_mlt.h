@@ -20,17 +20,28 @@ namespace akari::render::mlt {
         Spectrum radiance = Spectrum(0);
     };
     struct MarkovChain {
-        explicit MarkovChain(MLTSampler sampler) : sampler(sampler) {}
-        Sampler sampler;
+        explicit MarkovChain(MLTSampler sampler) : sampler(std::move(sampler)) {}
+        // chain state, handed to the path tracers through a SamplerHandle
+        MLTSampler sampler;
         RadianceRecord current;
+        // contributions of large steps, kept per chain so that the normalization is reproducible
+        double large_step_sum  = 0.0;
+        uint64_t n_large_steps = 0;
     };
     inline auto T(const Spectrum &s) { return hmax(s); };
     struct MLTStats {
-        AtomicDouble acc_b;
-        std::atomic_uint64_t n_large;
         std::atomic_uint64_t accepts, rejects;
-        MLTStats() : acc_b(0.0), n_large(0), accepts(0), rejects(0) {}
+        MLTStats() : accepts(0), rejects(0) {}
     };
+    // (sum of T over all large steps, number of large steps), independent of thread count and schedule
+    inline std::pair<double, uint64_t> large_step_stats(const std::vector<MarkovChain> &chains) {
+        return thread::parallel_map_reduce(
+            chains.size(), std::pair<double, uint64_t>(0.0, 0),
+            [&](size_t i) { return std::make_pair(chains[i].large_step_sum, chains[i].n_large_steps); },
+            [](const std::pair<double, uint64_t> &a, const std::pair<double, uint64_t> &b) {
+                return std::make_pair(a.first + b.first, a.second + b.second);
+            });
+    }
 } // namespace akari::render::mlt
 
 namespace akari::render {
@@ -124,6 +124,7 @@ namespace akari::render {
                 return pdf_A / (pdf_A + pdf_B);
             }
             CameraSample camera_ray(const Camera *camera, const ivec2 &p) noexcept {
+                stats::add(stats::CameraRays);
                 CameraSample sample = camera->generate_ray(sampler->next2d(), sampler->next2d(), p);
                 return sample;
             }
@@ -218,8 +219,8 @@ namespace akari::render {
             std::optional<SurfaceVertex> on_surface_scatter(const Vec3 &wo, SurfaceInteraction &si,
                                                             const std::optional<PathVertex> &prev_vertex) noexcept {
                 auto *material = si.material();
-                if (si.triangle.light) {
-                    on_hit_light(si.triangle.light, wo, si.sp(), prev_vertex);
+                if (si.light()) {
+                    on_hit_light(si.light(), wo, si.sp(), prev_vertex);
                     return std::nullopt;
                 } else if (depth < max_depth) {
                     auto u0 = sampler->next1d();
@@ -234,8 +235,10 @@ namespace akari::render {
                     const Float bsdfSamplingFraction = is_delta_bsdf ? 1.0 : dTree->selection_prob();
 
                     if (is_delta_bsdf || u0 < bsdfSamplingFraction) {
-                        if (!sample || sample->pdf == 0.0)
+                        if (!sample || sample->pdf == 0.0) {
+                            stats::add(stats::BSDFSampleFailures);
                             return std::nullopt;
+                        }
                         bsdf_pdf = sample->pdf;
                         sample->pdf *= bsdfSamplingFraction;
 
@@ -253,6 +256,7 @@ namespace akari::render {
                         dtree_pdf   = sample->pdf;
                         AKR_CHECK(sample->pdf >= 0);
                         if (sample->pdf == 0.0) {
+                            stats::add(stats::BSDFSampleFailures);
                             return std::nullopt;
                         }
                         sample->f    = bsdf.evaluate(wo, sample->wi);
@@ -266,6 +270,7 @@ namespace akari::render {
                     AKR_CHECK(sample->pdf >= 0.0);
                     AKR_CHECK(hmin(sample->f()) >= 0.0f);
                     if (std::isnan(sample->pdf) || sample->pdf == 0.0f) {
+                        stats::add(stats::BSDFSampleFailures);
                         return std::nullopt;
                     }
                     vertex.bsdf         = bsdf;
@@ -324,12 +329,15 @@ namespace akari::render {
                         if (continue_prob > 0.0 && continue_prob > sampler->next1d()) {
                             accumulate_beta(Spectrum(1.0 / continue_prob));
                         } else {
+                            stats::add(stats::RussianRouletteTerminations);
                             break;
                         }
                     }
                     ray         = vertex->ray;
                     prev_vertex = PathVertex(*vertex);
                 }
+                stats::add(stats::Paths);
+                stats::add(stats::PathVertices, depth);
                 L = clamp_zero(L);
                 if (training) {
                     for (int i = 0; i < n_vertices; i++) {
@@ -372,19 +380,15 @@ namespace akari::render {
         std::shared_ptr<STree> sTree(new STree(scene.accel->world_bounds()));
         bool useNEE = true;
         RatioStat non_zero_path;
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
-        }
-        std::vector<Sampler> samplers(hprod(scene.camera->resolution()));
-        for (size_t i = 0; i < samplers.size(); i++) {
-            samplers[i] = config.sampler;
-            samplers[i].set_sample_index(i);
-        }
+        auto *control               = config.control;
         uint32_t pass               = 0;
         uint32_t accumulatedSamples = 0;
         bool last_iter              = false;
-        for (pass = 0; accumulatedSamples < config.spp; pass++) {
+        bool stopped                = false;
+        Timer timer;
+        double frame_time = 0.0;
+        for (pass = 0; accumulatedSamples < config.spp && !stopped; pass++) {
+            AKR_TRACE_SCOPE("ppg pass");
             non_zero_path.clear();
             size_t samples       = (1ull << pass) * config.spp_per_pass;
             auto nextPassSamples = (2u << pass) * config.spp_per_pass;
@@ -393,21 +397,31 @@ namespace akari::render {
                 last_iter = true;
             }
             spdlog::info("Learning pass {}, spp:{}", pass + 1, samples);
-            accumulatedSamples += samples;
             Film film(scene.camera->resolution());
             Array2D<Spectrum> variance(scene.camera->resolution());
             Array2D<VarianceTracker<Spectrum>> var_trackers(scene.camera->resolution());
             ProgressReporter reporter(samples);
             for (uint32_t s = 0; s < samples; s++) {
+                // Stopping is only checked between frames of one sample per pixel, so that a pass cut short by the
+                // time budget or a cancel still ends with the same sample count in every pixel. The pixel variances
+                // and the SDTree refinement below rely on it.
+                if (control && !control->can_start(frame_time)) {
+                    spdlog::info("out of time, pass {} stopped at {} of {} spp", pass + 1, s, samples);
+                    samples = s;
+                    stopped = true;
+                    break;
+                }
+                timer.start();
                 thread::parallel_for(thread::blocked_range<2>(film.resolution(), ivec2(16, 16)), [&](ivec2 id,
                                                                                                      uint32_t tid) {
                     auto Li = [&](const ivec2 p, Sampler &sampler) -> Spectrum {
+                        ArenaFrame frame(thread::arena(tid));
                         ppg::GuidedPathTracer pt;
                         pt.min_depth  = config.min_depth;
                         pt.max_depth  = config.max_depth;
                         pt.n_vertices = 0;
                         pt.vertices =
-                            BufferView(Allocator<>(buffers[tid])
+                            BufferView(frame.allocator()
                                            .allocate_object<ppg::GuidedPathTracer::PPGVertex>(config.max_depth + 1),
                                        config.max_depth + 1);
                         pt.L        = Spectrum(0.0);
@@ -420,13 +434,13 @@ namespace akari::render {
                         pt.filter   = ppg::GuidedPathTracer::Filter::NEAREST; // pass >= 3 ?
                                                                               // ppg::GuidedPathTracer::Filter::SPATIAL
                                                                               // : ppg::GuidedPathTracer::Filter::BOX;
-                        pt.allocator = Allocator<>(buffers[tid]);
+                        pt.allocator = frame.allocator();
                         pt.run_megakernel(&scene.camera.value(), p);
                         non_zero_path.accumluate(!is_black(pt.L));
-                        buffers[tid]->release();
                         return pt.L;
                     };
-                    Sampler &sampler = samplers[id.x + id.y * film.resolution().x];
+                    Sampler sampler =
+                        create_sampler(config.sampler, id.x + id.y * film.resolution().x, accumulatedSamples + s);
                     // VarianceTracker<Spectrum> var;
 
                     sampler.start_next_sample();
@@ -434,8 +448,11 @@ namespace akari::render {
                     var_trackers(id).update(L);
                     film.add_sample(id, L, 1.0);
                 });
+                timer.stop();
+                frame_time = timer.elapsed_seconds();
                 reporter.update();
             }
+            accumulatedSamples += samples;
             thread::parallel_for(thread::blocked_range<2>(film.resolution(), ivec2(16, 16)),
                                  [&](ivec2 id, uint32_t tid) {
                                      if (samples >= 2)
@@ -457,7 +474,9 @@ namespace akari::render {
                                              V[c][i] = variance(id)[c];
                                          });
                     std::sort(V[c].begin(), V[c].end());
-                    avg_var[c] = std::accumulate(V[c].begin() + Q1, V[c].begin() + Q2, 0.0) / Q;
+                    avg_var[c] = thread::parallel_map_reduce(
+                                     Q, 0.0, [&](size_t i) { return double(V[c][Q1 + i]); }, std::plus<double>()) /
+                                 Q;
                 }
 
                 // Spectrum avg_var = variance.sum() / hprod(variance.dimension());
@@ -465,15 +484,13 @@ namespace akari::render {
                 spdlog::info("variance: {}", average(avg_var));
             }
             spdlog::info("non zero path:{}%", non_zero_path.ratio() * 100);
-            if (!last_iter) {
+            if (!last_iter && !stopped) {
                 spdlog::info("Refining SDTree; pass: {}", pass + 1);
                 spdlog::info("nodes: {}", sTree->nodes.size());
+                AKR_TRACE_COUNTER("SDTree nodes", sTree->nodes.size());
                 sTree->refine(STREE_THRESHOLD * std::sqrt(double(samples) / 4));
             }
         }
-        for (auto buf : buffers) {
-            delete buf;
-        }
         spdlog::info("render ppg done");
         return sTree;
     }
@@ -504,6 +521,10 @@ namespace akari::render {
                 cnt++;
             }
         }
+        if (all_samples.empty()) {
+            spdlog::warn("render ppg stopped before a pass with at least 2 spp was completed");
+            sum_weights = 1.0;
+        }
         Film thetas(scene.camera->resolution());
         thread::parallel_for(thread::blocked_range<2>(thetas.resolution(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
             Sampler sampler = PCGSampler(id.x);
@@ -544,15 +565,8 @@ namespace akari::render {
         std::shared_ptr<STree> sTree(new STree(scene.accel->world_bounds()));
         bool useNEE = true;
         RatioStat non_zero_path;
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
-        }
-        std::vector<Sampler> samplers(hprod(scene.camera->resolution()));
-        for (size_t i = 0; i < samplers.size(); i++) {
-            samplers[i] = config.sampler;
-            samplers[i].set_sample_index(i);
-        }
+        // samples per pixel taken by the non-metropolized passes so far
+        uint32_t mc_samples = 0;
         MLTStats stats;
         auto mc_sample_sdtree = [&](int samples, bool training) {
             non_zero_path.clear();
@@ -561,12 +575,13 @@ namespace akari::render {
             thread::parallel_for(
                 thread::blocked_range<2>(film.resolution(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
                     auto Li = [&](const ivec2 p, Sampler &sampler) -> Spectrum {
+                        ArenaFrame frame(thread::arena(tid));
                         ppg::GuidedPathTracer pt;
                         pt.min_depth  = config.min_depth;
                         pt.max_depth  = config.max_depth;
                         pt.n_vertices = 0;
                         pt.vertices =
-                            BufferView(Allocator<>(buffers[tid])
+                            BufferView(frame.allocator()
                                            .allocate_object<ppg::GuidedPathTracer::PPGVertex>(config.max_depth + 1),
                                        config.max_depth + 1);
                         pt.L         = Spectrum(0.0);
@@ -576,13 +591,14 @@ namespace akari::render {
                         pt.useNEE    = useNEE;
                         pt.training  = training;
                         pt.sTree     = sTree;
-                        pt.allocator = Allocator<>(buffers[tid]);
+                        pt.allocator = frame.allocator();
                         pt.run_megakernel(&scene.camera.value(), p);
                         non_zero_path.accumluate(!is_black(pt.L));
-                        buffers[tid]->release();
                         return pt.L;
                     };
-                    Sampler &sampler = samplers[id.x + id.y * film.resolution().x];
+                    if (config.control && config.control->should_stop())
+                        return;
+                    Sampler sampler = create_sampler(config.sampler, id.x + id.y * film.resolution().x, mc_samples);
                     VarianceTracker<Spectrum> var;
                     for (int s = 0; s < samples; s++) {
                         sampler.start_next_sample();
@@ -597,6 +613,7 @@ namespace akari::render {
             spdlog::info("nodes: {}", sTree->nodes.size());
             spdlog::info("non zero path:{}%", non_zero_path.ratio() * 100);
             sTree->refine(STREE_THRESHOLD * std::sqrt(samples));
+            mc_samples += samples;
             return std::make_pair(film.to_rgb_image(), variance);
         };
         auto mcmc_sample_sdtree = [&](int n_chains, int spp, bool training) {
@@ -612,6 +629,7 @@ namespace akari::render {
             m.spp           = spp;
 
             std::vector<MarkovChain> chains;
+            std::atomic_uint64_t n_mutations(0);
             double b            = 0.0;
             std::tie(chains, b) = init_markov_chains(
                 m, scene, [&](ivec2 p_film, Allocator<> alloc, const Scene &scene, Sampler &sampler) {
@@ -635,18 +653,17 @@ namespace akari::render {
                 });
 
             thread::parallel_for(n_chains, [&](uint32_t id, uint32_t tid) {
-                astd::pmr::monotonic_buffer_resource resource;
                 auto &chain       = chains[id];
-                auto &mlt_sampler = *chain.sampler.get<MLTSampler>();
                 Rng rng(id);
-                mlt_sampler.rng = Rng(rng.uniform_u32());
+                chain.sampler.rng = Rng(rng.uniform_u32());
                 auto Li         = [&](const ivec2 p, Sampler &sampler) -> Spectrum {
+                    ArenaFrame frame(thread::arena(tid));
                     ppg::GuidedPathTracer pt;
                     pt.min_depth  = config.min_depth;
                     pt.max_depth  = config.max_depth;
                     pt.n_vertices = 0;
                     pt.vertices =
-                        BufferView(Allocator<>(buffers[tid])
+                        BufferView(frame.allocator()
                                        .allocate_object<ppg::GuidedPathTracer::PPGVertex>(config.max_depth + 1),
                                    config.max_depth + 1);
                     pt.L            = Spectrum(0.0);
@@ -657,17 +674,20 @@ namespace akari::render {
                     pt.training     = training;
                     pt.sTree        = sTree;
                     pt.metropolized = true;
-                    pt.allocator    = Allocator<>(buffers[tid]);
+                    pt.allocator    = frame.allocator();
                     pt.run_megakernel(&scene.camera.value(), p);
                     non_zero_path.accumluate(!is_black(pt.L));
-                    buffers[tid]->release();
                     return pt.L - pt.emitter_direct;
                 };
                 for (size_t s = 0; s < mutations_per_chain; s++) {
-                    chain.sampler.start_next_sample();
+                    if (config.control && config.control->should_stop())
+                        break;
+                    n_mutations++;
+                    Sampler sampler = SamplerHandle(&chain.sampler);
+                    sampler.start_next_sample();
                     const ivec2 p_film = glm::min(scene.camera->resolution() - 1,
-                                                  ivec2(chain.sampler.next2d() * vec2(scene.camera->resolution())));
-                    const auto L       = Li(p_film, chain.sampler);
+                                                  ivec2(sampler.next2d() * vec2(scene.camera->resolution())));
+                    const auto L       = Li(p_film, sampler);
                     const RadianceRecord proposal{p_film, L};
                     accept_markov_chain_and_splat(stats, rng, proposal, chain, film);
                 }
@@ -677,14 +697,18 @@ namespace akari::render {
             spdlog::info("nodes: {}", sTree->nodes.size());
             spdlog::info("non zero path:{}%", non_zero_path.ratio() * 100);
             sTree->refine(STREE_THRESHOLD * std::sqrt(spp));
-            b          = (b * m.num_bootstrap + stats.acc_b.value()) / (m.num_bootstrap + stats.n_large.load());
-            auto array = film.to_array2d();
-            array *= Spectrum(b / spp);
+            auto [acc_b, n_large] = large_step_stats(chains);
+            b                     = (b * m.num_bootstrap + acc_b) / (m.num_bootstrap + n_large);
+            auto array            = film.to_array2d();
+            // normalized by the mutations actually made, in case the chains were stopped early
+            array *= Spectrum(b * double(hprod(scene.camera->resolution())) / std::max<uint64_t>(1, n_mutations));
             return array2d_to_rgb(array);
         };
         uint32_t pass               = 0;
         uint32_t accumulatedSamples = 0;
         bool last_iter              = false;
+        Timer timer;
+        double time_per_spp = 0.0;
         for (pass = 0; accumulatedSamples < config.spp; pass++) {
             non_zero_path.clear();
             size_t samples;
@@ -694,6 +718,12 @@ namespace akari::render {
                 samples   = (uint32_t)config.spp - accumulatedSamples;
                 last_iter = true;
             }
+            if (config.control && !config.control->can_start(time_per_spp * samples)) {
+                spdlog::info("out of time after {} passes", pass);
+                break;
+            }
+            AKR_TRACE_SCOPE("mppg pass");
+            timer.start();
             accumulatedSamples += samples;
             spdlog::info("Pass {}, spp:{}", pass + 1, samples);
             std::optional<Image> image;
@@ -704,6 +734,8 @@ namespace akari::render {
                 image        = std::move(col_var.first);
             }
             write_hdr(*image, fmt::format("mppg_pass{}.exr", pass + 1));
+            timer.stop();
+            time_per_spp = timer.elapsed_seconds() / samples;
         }
         return rgb_image(ivec2(1));
     }
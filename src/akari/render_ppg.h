@@ -17,6 +17,8 @@
 #include <spdlog/spdlog.h>
 #include <akari/render.h>
 #include <akari/thread.h>
+#include <akari/profile.h>
+#include <akari/memory.h>
 namespace akari::render {
     struct AdamOptimizer {
         int t = 0;
@@ -524,9 +526,20 @@ namespace akari::render {
             auto sz = hmax(box.size()) * 0.5f;
             auto centroid = box.centroid();
             this->box = Bounds3f{centroid - vec3(sz), centroid + vec3(sz)};
+            footprint.set(bytes());
         }
 
         Bounds3f box;
+        memory::Footprint footprint{memory::SDTree};
+        // storage of the spatial tree and of all quadtrees
+        size_t bytes() const {
+            size_t total = nodes.capacity() * sizeof(STreeNode);
+            for (auto &node : nodes) {
+                total += (node.dTree.building.nodes.capacity() + node.dTree.sampling.nodes.capacity()) *
+                         sizeof(QTreeNode);
+            }
+            return total;
+        }
 
         vec3 sample(const vec3 &p, const vec2 &u, const vec2 &u2) {
             return nodes.at(0).sample(box.offset(p), u, u2, nodes);
@@ -576,24 +589,28 @@ namespace akari::render {
         void refine(size_t maxSample) {
             // spdlog::info("refine({})", maxSample);
             AKR_CHECK(maxSample > 0);
-            for (auto &i : nodes) {
-                if (i.isLeaf()) {
-                    i.dTree.refine();
+            AKR_TRACE_SCOPE("SDTree refine");
+            // the rebuilt quadtrees are allocated and first touched by the pool threads
+            thread::parallel_for(nodes.size(), [&](size_t i, uint32_t) {
+                if (nodes[i].isLeaf()) {
+                    nodes[i].dTree.refine();
                 }
-            }
+            });
             refine(0, maxSample, 0);
             for (auto &i : nodes) {
                 i.nSample = 0;
             }
+            footprint.set(bytes());
         }
     };
 
     struct PPGConfig {
-        Sampler sampler;
+        SamplerConfig sampler;
         int min_depth = 3;
         int max_depth = 5;
         uint32_t spp = 16;
         uint32_t spp_per_pass = 4;
+        RenderControl *control = nullptr;
     };
     std::shared_ptr<STree> render_ppg(std::vector<std::pair<Array2D<Spectrum>, Spectrum>> &all_samples,
                                       PPGConfig config, const Scene &scene);
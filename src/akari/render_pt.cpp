@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <fstream>
 #include <akari/util.h>
 #include <akari/pathtracer.h>
 #include <spdlog/spdlog.h>
@@ -28,53 +29,285 @@ namespace akari::render {
         AKR_ASSERT(hmax(pt.L) >= 0.0 && hmax(pt.emitter_direct) >= 0.0);
         return std::make_pair(pt.visitor.emitter_direct, pt.L);
     }
-    Film render_pt(PTConfig config, const Scene &scene) {
-        Film film(scene.camera->resolution());
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
+    namespace pt {
+        static constexpr uint64_t CHECKPOINT_MAGIC   = 0x31504b434b524124ull; // "$ARKCKP1"
+        static constexpr uint32_t CHECKPOINT_VERSION = 1;
+        struct CheckpointHeader {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t spectrum_size;
+            int32_t width, height;
+            // sampler progress: every pixel has taken the first spp_done samples of its sequence
+            uint32_t spp_done;
+            uint32_t spp;
+            uint32_t sampler_type;
+            int32_t min_depth, max_depth;
+            uint32_t pad;
+            uint64_t sampler_seed;
+            uint64_t reserved[2];
+        };
+        static_assert(sizeof(CheckpointHeader) == 72);
+
+        static CheckpointHeader checkpoint_header(const PTConfig &config, const Film &film, uint32_t spp_done) {
+            CheckpointHeader header{};
+            header.magic         = CHECKPOINT_MAGIC;
+            header.version       = CHECKPOINT_VERSION;
+            header.spectrum_size = sizeof(Spectrum);
+            header.width         = film.resolution().x;
+            header.height        = film.resolution().y;
+            header.spp_done      = spp_done;
+            header.spp           = config.spp;
+            header.sampler_type  = config.sampler.type;
+            header.min_depth     = config.min_depth;
+            header.max_depth     = config.max_depth;
+            header.sampler_seed  = config.sampler.seed;
+            return header;
         }
-        ProgressReporter reporter(hprod(film.resolution()));
-        thread::parallel_for(thread::blocked_range<2>(film.resolution(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
-            Sampler sampler = config.sampler;
-            sampler.set_sample_index(id.y * film.resolution().x + id.x);
-            for (int s = 0; s < config.spp; s++) {
-                sampler.start_next_sample();
-                auto L = render_pt_pixel(config, Allocator<>(buffers[tid]), scene, sampler, id);
-                buffers[tid]->release();
-                film.add_sample(id, L, 1.0);
+    } // namespace pt
+
+    // Film with the radiance and weight (sample count) of each pixel followed by the splats
+    void write_pt_checkpoint(const fs::path &path, const PTConfig &config, const Film &film, uint32_t spp_done) {
+        AKR_TRACE_SCOPE("write checkpoint");
+        const auto header   = pt::checkpoint_header(config, film, spp_done);
+        const size_t pixels = hprod(film.resolution());
+        std::vector<Float> splats(pixels * Spectrum::size);
+        for (size_t i = 0; i < pixels; i++) {
+            for (size_t c = 0; c < Spectrum::size; c++) {
+                splats[i * Spectrum::size + c] = film.splats.data()[i][c].value();
+            }
+        }
+        // replaced in one step, so that a render killed while writing keeps the previous checkpoint
+        auto tmp = path;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out.write((const char *)&header, sizeof(header));
+            out.write((const char *)film.radiance.data(), sizeof(Spectrum) * pixels);
+            out.write((const char *)film.weight.data(), sizeof(Float) * pixels);
+            out.write((const char *)splats.data(), sizeof(Float) * splats.size());
+            if (!out) {
+                spdlog::warn("failed to write checkpoint {}", tmp.string());
+                return;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp, path, ec);
+        if (ec) {
+            spdlog::warn("failed to write checkpoint {}: {}", path.string(), ec.message());
+            fs::remove(tmp, ec);
+        }
+    }
+    uint32_t load_pt_checkpoint(const fs::path &path, const PTConfig &config, Film &film) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return 0;
+        }
+        pt::CheckpointHeader header{};
+        in.read((char *)&header, sizeof(header));
+        const auto expected = pt::checkpoint_header(config, film, header.spp_done);
+        if (!in || header.magic != expected.magic || header.version != expected.version ||
+            header.spectrum_size != expected.spectrum_size || header.width != expected.width ||
+            header.height != expected.height || header.sampler_type != expected.sampler_type ||
+            header.sampler_seed != expected.sampler_seed || header.min_depth != expected.min_depth ||
+            header.max_depth != expected.max_depth) {
+            spdlog::warn("ignoring checkpoint {} of a different render", path.string());
+            return 0;
+        }
+        // ZSobol and PMJ02BN lay the samples of a pixel out for the total spp, so only the random samplers extend
+        if (header.spp != expected.spp) {
+            if (config.sampler.type == SamplerConfig::ZSOBOL || config.sampler.type == SamplerConfig::PMJ02BN) {
+                spdlog::warn("ignoring checkpoint {} rendered for {} spp, the sampler needs {} spp", path.string(),
+                             header.spp, config.spp);
+                return 0;
+            }
+            spdlog::info("checkpoint was rendered for {} spp, continuing to {} spp", header.spp, config.spp);
+        }
+        const size_t pixels = hprod(film.resolution());
+        std::vector<Float> splats(pixels * Spectrum::size);
+        in.read((char *)film.radiance.data(), sizeof(Spectrum) * pixels);
+        in.read((char *)film.weight.data(), sizeof(Float) * pixels);
+        in.read((char *)splats.data(), sizeof(Float) * splats.size());
+        if (!in) {
+            spdlog::warn("ignoring truncated checkpoint {}", path.string());
+            film.first_touch();
+            return 0;
+        }
+        for (size_t i = 0; i < pixels; i++) {
+            for (size_t c = 0; c < Spectrum::size; c++) {
+                film.splats.data()[i][c].set(splats[i * Spectrum::size + c]);
+            }
+        }
+        return header.spp_done;
+    }
+
+    // Renders spp_per_pass samples per pixel (DEFAULT_SPP_PER_PASS if unset) over the whole frame per pass, so that
+    // every pixel has the same number of samples after each pass. The control is only checked between passes, a
+    // cancelled render finishes the current one. Each pass resumes the pixels at their sample index, giving the
+    // same sequences as rendering tile by tile; with a checkpoint file a restarted render continues bit for bit.
+    static void render_pt_progressive(const PTConfig &config, const Scene &scene, Film &film) {
+        auto *control        = config.control;
+        const auto range     = thread::blocked_range<2>(film.resolution(), ivec2(16, 16));
+        const int n_per_pass = config.spp_per_pass > 0 ? config.spp_per_pass : PTConfig::DEFAULT_SPP_PER_PASS;
+        int spp              = 0;
+        if (!config.checkpoint.empty()) {
+            spp = (int)load_pt_checkpoint(config.checkpoint, config, film);
+            if (spp > 0) {
+                spdlog::info("resuming from checkpoint {} at {} spp", config.checkpoint, spp);
+            }
+        }
+        ProgressReporter reporter((std::max(0, config.spp - spp) + n_per_pass - 1) / n_per_pass);
+        Timer timer;
+        double pass_time = 0.0;
+        while (spp < config.spp && (!control || control->can_start(pass_time))) {
+            AKR_TRACE_SCOPE("pt pass");
+            const int n = std::min(n_per_pass, config.spp - spp);
+            timer.start();
+            thread::parallel_for(range, [&](ivec2 id, uint32_t tid) {
+                Sampler sampler = create_sampler(config.sampler, id.y * film.resolution().x + id.x, spp);
+                for (int s = 0; s < n; s++) {
+                    sampler.start_next_sample();
+                    ArenaFrame frame(thread::arena(tid));
+                    auto L = render_pt_pixel(config, frame.allocator(), scene, sampler, id);
+                    film.add_sample(id, L, 1.0);
+                }
+            });
+            timer.stop();
+            pass_time = timer.elapsed_seconds();
+            spp += n;
+            if (!config.checkpoint.empty()) {
+                write_pt_checkpoint(config.checkpoint, config, film, spp);
             }
             reporter.update();
-        });
-        for (auto buf : buffers) {
-            delete buf;
+        }
+        putchar('\n');
+        if (spp < config.spp) {
+            spdlog::info("render pt stopped after {} of {} spp", spp, config.spp);
+        }
+    }
+    // Gives passes of adaptive_min_spp samples to the pixels that are above the error threshold or next to one. The
+    // neighbours keep a lone pixel whose first samples happened to agree from being dropped too early.
+    static void render_pt_adaptive(const PTConfig &config, const Scene &scene, Film &film) {
+        AKR_TRACE_SCOPE("render_pt_adaptive");
+        auto *control     = config.control;
+        const ivec2 res   = film.resolution();
+        const auto range  = thread::blocked_range<2>(res, ivec2(16, 16));
+        const int n_batch = std::clamp(config.adaptive_min_spp, 1, std::max(1, config.spp));
+        Array2D<VarianceTracker<Float>> trackers(res);
+        // relative standard error of the mean; the offset keeps nearly black pixels from being refined forever
+        Array2D<Float> error(res);
+        Array2D<uint8_t> active(res);
+        active.fill(1);
+        Timer timer;
+        double pass_time = 0.0;
+        int spp          = 0;
+        for (int pass = 0; spp < config.spp; pass++) {
+            if (control && !control->can_start(pass_time)) {
+                spdlog::info("render pt stopped after adaptive pass {}", pass);
+                break;
+            }
+            AKR_TRACE_SCOPE("adaptive pass");
+            const int n = std::min(n_batch, config.spp - spp);
+            std::atomic_bool cut_short{false};
+            timer.start();
+            thread::parallel_for(range, [&](ivec2 id, uint32_t tid) {
+                if (!active(id))
+                    return;
+                if (control && control->should_stop()) {
+                    cut_short = true;
+                    return;
+                }
+                auto &tracker   = trackers(id);
+                Sampler sampler = create_sampler(config.sampler, id.y * res.x + id.x, tracker.count);
+                for (int s = 0; s < n; s++) {
+                    sampler.start_next_sample();
+                    ArenaFrame frame(thread::arena(tid));
+                    auto L = render_pt_pixel(config, frame.allocator(), scene, sampler, id);
+                    film.add_sample(id, L, 1.0);
+                    tracker.update(luminance(L));
+                }
+                const auto variance = tracker.variance();
+                error(id)           = variance ? std::sqrt(*variance) / (*tracker.mean + Float(0.01)) : Inf;
+            });
+            timer.stop();
+            pass_time = timer.elapsed_seconds();
+            // only completed passes count; the film and the trackers hold what a cut short pass did render
+            if (cut_short) {
+                spdlog::info("render pt stopped during adaptive pass {}", pass + 1);
+                break;
+            }
+            spp += n;
+            thread::parallel_for(res.y, [&](uint32_t y, uint32_t) {
+                for (int x = 0; x < res.x; x++) {
+                    Float e = 0;
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            const ivec2 q = glm::clamp(ivec2(x + dx, int(y) + dy), ivec2(0), res - 1);
+                            e             = std::max(e, error(q));
+                        }
+                    }
+                    active(x, y) = e > config.adaptive_threshold;
+                }
+            });
+            const auto [n_active, error_sum] = thread::parallel_map_reduce(
+                size_t(hprod(res)), std::pair<size_t, double>(0, 0.0),
+                [&](size_t i) {
+                    const ivec2 id(int(i % res.x), int(i / res.x));
+                    return std::make_pair(size_t(active(id)), double(error(id)));
+                },
+                [](const std::pair<size_t, double> &a, const std::pair<size_t, double> &b) {
+                    return std::make_pair(a.first + b.first, a.second + b.second);
+                });
+            const double mean_error = error_sum / hprod(res);
+            spdlog::info("adaptive pass {}: up to {} spp, {:.1f}% of the pixels active, mean relative error {:.4f}",
+                         pass + 1, spp, 100.0 * n_active / hprod(res), mean_error);
+            if (n_active == 0 || mean_error <= config.adaptive_target) {
+                break;
+            }
+        }
+        const double n_samples = thread::parallel_map_reduce(
+            size_t(hprod(res)), 0.0, [&](size_t i) { return double(trackers.data()[i].count); }, std::plus<double>());
+        spdlog::info("adaptive sampling: {:.2f} spp on average", n_samples / hprod(res));
+    }
+    Film render_pt(PTConfig config, const Scene &scene) {
+        AKR_TRACE_SCOPE("render_pt");
+        Film film(scene.camera->resolution());
+        const auto range = thread::blocked_range<2>(film.resolution(), ivec2(16, 16));
+        if (config.adaptive) {
+            render_pt_adaptive(config, scene, film);
+        } else if (config.spp_per_pass > 0 || !config.checkpoint.empty() || config.control) {
+            // a render that can be stopped goes in whole passes, so that it stops at the same spp in every pixel
+            render_pt_progressive(config, scene, film);
+        } else {
+            ProgressReporter reporter(hprod(film.resolution()));
+            thread::parallel_for(range, [&](ivec2 id, uint32_t tid) {
+                Sampler sampler = create_sampler(config.sampler, id.y * film.resolution().x + id.x);
+                for (int s = 0; s < config.spp; s++) {
+                    sampler.start_next_sample();
+                    ArenaFrame frame(thread::arena(tid));
+                    auto L = render_pt_pixel(config, frame.allocator(), scene, sampler, id);
+                    film.add_sample(id, L, 1.0);
+                }
+                reporter.update();
+            });
         }
         spdlog::info("render pt done");
         return film;
     }
     Image render_unified(UPTConfig config, const Scene &scene) {
         Film film(scene.camera->resolution());
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
-        }
         ProgressReporter reporter(hprod(film.resolution()));
         thread::parallel_for(thread::blocked_range<2>(film.resolution(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
-            Sampler sampler = config.sampler;
-            sampler.set_sample_index(id.y * film.resolution().x + id.x);
+            Sampler sampler = create_sampler(config.sampler, id.y * film.resolution().x + id.x);
             for (int s = 0; s < config.spp; s++) {
                 sampler.start_next_sample();
-                pt::UnifiedPathTracer<pt::NullPathVisitor> pt(&scene, &sampler, Allocator<>(buffers[tid]),
-                                                              config.min_depth, config.max_depth);
+                ArenaFrame frame(thread::arena(tid));
+                pt::UnifiedPathTracer<pt::NullPathVisitor> pt(&scene, &sampler, frame.allocator(), config.min_depth,
+                                                              config.max_depth);
                 pt.run_megakernel(&scene.camera.value(), id);
-                buffers[tid]->release();
                 film.add_sample(id, pt.L, 1.0);
             }
             reporter.update();
         });
-        for (auto buf : buffers) {
-            delete buf;
-        }
         spdlog::info("render pt done");
         return film.to_rgb_image();
     }
@@ -110,8 +343,7 @@ namespace akari::render {
             for (int x = p.x; x < upper.x; x++) {
                 for (int y = p.y; y < upper.y; y++) {
                     auto id = ivec2(x, y);
-                    Sampler sampler = config.sampler;
-                    sampler.set_sample_index(id.y * film.resolution().x + id.x);
+                    Sampler sampler = create_sampler(config.sampler, id.y * film.resolution().x + id.x);
                     for (int s = 0; s < config.spp; s++) {
                         sampler.start_next_sample();
                         // auto L = render_pt_pixel(config, Allocator<>(&rsrc), scene, sampler, id);
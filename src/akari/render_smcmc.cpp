@@ -37,13 +37,15 @@ namespace akari::render {
         struct CoherentSamples : std::array<RadianceRecord, 5> {};
         struct Tile {
             ivec2 p_center;
-            std::optional<Sampler> sampler;
+            std::optional<MLTSampler> sampler;
             TileEstimator mcmc_estimate, mc_estimate;
             CoherentSamples current;
             uint32_t n_mc_estimates = 0, n_mcmc_estimates = 0;
             double average_mc = -1;
             double average_unscaled_mcmc = -1;
             double b = 0.0;
+            double large_step_sum  = 0.0;
+            uint64_t n_large_steps = 0;
         };
     } // namespace smcmc
     Image render_smcmc(MLTConfig config, const Scene &scene) {
@@ -133,7 +135,8 @@ namespace akari::render {
         //         }
         //     }
         // }
-        auto run_uniform_global_mcmc = [&](PTConfig config, Allocator<> allocator, Sampler &sampler) {
+        auto run_uniform_global_mcmc = [&](PTConfig config, Allocator<> allocator, MLTSampler &chain) {
+            Sampler sampler = SamplerHandle(&chain);
             sampler.start_next_sample();
             ivec2 p_center =
                 glm::min(scene.camera->resolution() - 1, ivec2(sampler.next2d() * vec2(scene.camera->resolution())));
@@ -142,7 +145,8 @@ namespace akari::render {
             auto L = render_pt_pixel_wo_emitter_direct(pt_config, allocator, scene, sampler, p_film);
             return std::make_pair(p_center, L);
         };
-        auto run_mcmc = [&](PTConfig config, Allocator<> allocator, const ivec2 &p_center, Sampler &sampler) {
+        auto run_mcmc = [&](PTConfig config, Allocator<> allocator, const ivec2 &p_center, MLTSampler &chain) {
+            Sampler sampler = SamplerHandle(&chain);
             sampler.start_next_sample();
             (void)sampler.next2d();
             auto idx = std::min<int>(sampler.next1d() * 5, 4);
@@ -156,7 +160,8 @@ namespace akari::render {
             for (auto &X : base.X) {
                 Xs.push_back(X.value);
             }
-            Sampler sampler = ReplaySampler(std::move(Xs), base.rng);
+            ReplaySampler replay(std::move(Xs), base.rng);
+            Sampler sampler = SamplerHandle(&replay);
             sampler.start_next_sample();
             (void)sampler.next2d();
             (void)sampler.next1d();
@@ -178,8 +183,9 @@ namespace akari::render {
             std::vector<Float> Ts;
             {
                 astd::pmr::monotonic_buffer_resource resource;
+                astd::pmr::unsynchronized_pool_resource sampler_pool;
                 for (auto seed : seeds) {
-                    Sampler sampler = MLTSampler(seed);
+                    MLTSampler sampler(seed, Allocator<>(&sampler_pool));
                     auto [p_film, L] = run_uniform_global_mcmc(pt_config, Allocator<>(&resource), sampler);
                     Ts.push_back(T(L));
                 }
@@ -205,7 +211,7 @@ namespace akari::render {
                 auto [p_film, L] = run_uniform_global_mcmc(pt_config, Allocator<>(&resource), global_chain->sampler);
                 if (!tiles(p_film).sampler.has_value()) {
                     tiles(p_film).sampler = global_chain->sampler;
-                    tiles(p_film).sampler->get<MLTSampler>()->rng = Rng(dist(rd));
+                    tiles(p_film).sampler->rng = Rng(dist(rd));
                     tiles(p_film).p_center = p_film;
                 }
             }
@@ -253,9 +259,8 @@ namespace akari::render {
             int cnt = 1;
             for (int i = 0; i < 5; i++) {
                 if (i != X_idx) {
-                    Xs[cnt] = RadianceRecord{
-                        state.p_center + offsets[i],
-                        run_mcmc_coherent(pt_config, alloc, state.p_center, *state.sampler->get<MLTSampler>(), i)};
+                    Xs[cnt] = RadianceRecord{state.p_center + offsets[i],
+                                             run_mcmc_coherent(pt_config, alloc, state.p_center, *state.sampler, i)};
                     cnt++;
                 }
             }
@@ -271,26 +276,24 @@ namespace akari::render {
         // ensures every tile is initialized
         thread::parallel_for(thread::blocked_range<2>(tiles.dimension(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
             std::uniform_int_distribution<uint32_t> dist;
-            astd::pmr::monotonic_buffer_resource resource;
+            ArenaFrame frame(thread::arena(tid));
             if (!tiles(id).sampler.has_value()) {
                 const int num_tries = 16;
                 for (int i = 0; i < num_tries; i++) {
-                    Sampler sampler = MLTSampler(dist(rd));
-                    auto [idx, L] = run_mcmc(pt_config, Allocator<>(&resource), id, sampler);
+                    MLTSampler sampler(dist(rd));
+                    auto [idx, L] = run_mcmc(pt_config, frame.allocator(), id, sampler);
                     if (T(L) > 0.0 || i == num_tries - 1) {
                         tiles(id).sampler = sampler;
-                        tiles(id).sampler->get<MLTSampler>()->rng = Rng(dist(rd));
+                        tiles(id).sampler->rng = Rng(dist(rd));
                         tiles(id).p_center = id;
                         break;
                     }
                 }
             }
             AKR_ASSERT(tiles(id).sampler.has_value());
-            auto L = run_mcmc2(Allocator<>(&resource), tiles(id));
+            auto L = run_mcmc2(frame.allocator(), tiles(id));
             tiles(id).current = L;
         });
-        AtomicDouble acc_b(0.0);
-        std::atomic_uint64_t n_large(0);
         auto splat = [&](Tile &a, const CoherentSamples &Xs, Float weight) {
             auto G = estimator(a, Xs);
             for (int i = 0; i < 5; i++) {
@@ -343,10 +346,10 @@ namespace akari::render {
             const auto L = run_mcmc2(alloc, s);
             const auto Tnew = Ts(L);
             const auto accept = std::clamp<Float>(Tnew / Ts(s.current), 0.0, 1.0);
-            auto mlt_sampler = s.sampler->get<MLTSampler>();
+            auto *mlt_sampler = &*s.sampler;
             if (mlt_sampler->large_step) {
-                acc_b.add(Ts(L));
-                n_large++;
+                s.large_step_sum += Ts(L);
+                s.n_large_steps++;
                 splat_mc(s, L, 1.0);
                 s.n_mc_estimates++;
             }
@@ -366,17 +369,23 @@ namespace akari::render {
         };
         // run mcmc
 
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
-        }
         ProgressReporter reporter(config.spp);
+        Timer timer;
+        double pass_time = 0.0;
         for (int m = 0; m < config.spp; m++) {
+            // every pass updates each tile once and the estimators are normalized per tile,
+            // so stopping between passes leaves a consistent state
+            if (config.control && !config.control->can_start(pass_time)) {
+                spdlog::info("out of time after {} of {} passes", m, config.spp);
+                break;
+            }
+            AKR_TRACE_SCOPE("smcmc pass");
+            timer.start();
             if (m % 2 == 0) {
                 thread::parallel_for(
                     thread::blocked_range<2>(tiles.dimension(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
-                        independent_mcmc(Allocator<>(buffers[tid]), tiles(id)); //                           .
-                        buffers[tid]->release();
+                        ArenaFrame frame(thread::arena(tid));
+                        independent_mcmc(frame.allocator(), tiles(id));
                     });
 
             } else {
@@ -384,74 +393,86 @@ namespace akari::render {
                 switch (n % 4) {
                 case 0: {
                     thread::parallel_for(thread::blocked_range<1>(tiles.dimension()[1], 1), [&](int j, uint32_t tid) {
-                        auto alloc = Allocator<>(buffers[tid]);
+                        ArenaFrame frame(thread::arena(tid));
+                        auto alloc = frame.allocator();
                         int i = 0;
                         for (; i + 1 < tiles.dimension()[0]; i += 2) {
                             replica_exchange(alloc, tiles(i, j), tiles(i + 1, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                         if (i < tiles.dimension()[0]) {
                             independent_mcmc(alloc, tiles(i, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                     });
 
                 } break;
                 case 1: {
                     thread::parallel_for(thread::blocked_range<1>(tiles.dimension()[0], 1), [&](int i, uint32_t tid) {
-                        auto alloc = Allocator<>(buffers[tid]);
+                        ArenaFrame frame(thread::arena(tid));
+                        auto alloc = frame.allocator();
                         int j = 0;
                         for (; j + 1 < tiles.dimension()[1]; j += 2) {
                             replica_exchange(alloc, tiles(i, j), tiles(i, j + 1));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                         if (j < tiles.dimension()[1]) {
                             independent_mcmc(alloc, tiles(i, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                     });
                 } break;
                 case 2: {
                     thread::parallel_for(thread::blocked_range<1>(tiles.dimension()[1], 1), [&](int j, uint32_t tid) {
-                        auto alloc = Allocator<>(buffers[tid]);
+                        ArenaFrame frame(thread::arena(tid));
+                        auto alloc = frame.allocator();
                         int i = 1;
                         {
                             independent_mcmc(alloc, tiles(0, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                         for (; i + 1 < tiles.dimension()[0]; i += 2) {
                             replica_exchange(alloc, tiles(i, j), tiles(i + 1, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                         if (i < tiles.dimension()[0]) {
                             independent_mcmc(alloc, tiles(i, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                     });
                 } break;
                 case 3: {
                     thread::parallel_for(thread::blocked_range<1>(tiles.dimension()[0], 1), [&](int i, uint32_t tid) {
-                        auto alloc = Allocator<>(buffers[tid]);
+                        ArenaFrame frame(thread::arena(tid));
+                        auto alloc = frame.allocator();
                         int j = 1;
                         {
                             independent_mcmc(alloc, tiles(i, 0));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                         for (; j + 1 < tiles.dimension()[1]; j += 2) {
                             replica_exchange(alloc, tiles(i, j), tiles(i, j + 1));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                         if (j < tiles.dimension()[1]) {
                             independent_mcmc(alloc, tiles(i, j));
-                            buffers[tid]->release();
+                            frame.reset();
                         }
                     });
                 } break;
                 }
             }
+            timer.stop();
+            pass_time = timer.elapsed_seconds();
             reporter.update();
         }
-        const auto b = acc_b.value() / n_large.load();
+        const auto [acc_b, n_large] = thread::parallel_map_reduce(
+            size_t(hprod(tiles.dimension())), std::pair<double, uint64_t>(0.0, 0),
+            [&](size_t i) { return std::make_pair(tiles.data()[i].large_step_sum, tiles.data()[i].n_large_steps); },
+            [](const std::pair<double, uint64_t> &a, const std::pair<double, uint64_t> &b) {
+                return std::make_pair(a.first + b.first, a.second + b.second);
+            });
+        const auto b = acc_b / std::max<uint64_t>(1, n_large);
 
         const auto alpha = 0.05;
         const auto beta1 = 0.05, beta2 = 0.5;
@@ -533,6 +554,7 @@ namespace akari::render {
         };
 
         // reconstruction
+        AKR_TRACE_SCOPE("smcmc reconstruction");
         spdlog::info("reconstructing...");
         spdlog::info("b={}", b);
         auto output = rgb_image(tiles.dimension());
@@ -614,9 +636,6 @@ namespace akari::render {
             });
         write_hdr(unscaled, "unscaled.exr");
         write_hdr(mc, "mc.exr");
-        for (auto buf : buffers) {
-            delete buf;
-        }
         spdlog::info("render smcmc done");
         return output;
     }
@@ -53,9 +53,9 @@ namespace akari::render {
                 dpdu = si.dpdu;
                 dpdv = si.dpdv;
                 n = si.ns;
-                dndu = si.dndu;
-                dndv = si.dndv;
+                std::tie(dndu, dndv) = si.dnduv();
                 ng = si.ng;
+                shape = si.shape;
                 auto frame = Frame(n, dpdu);
                 s = frame.s;
                 t = frame.t;
@@ -381,8 +381,8 @@ namespace akari::render {
             std::optional<SurfaceVertex> on_surface_scatter(const Vec3 &wo, SurfaceInteraction &si,
                                                             const std::optional<PathVertex> &prev_vertex) noexcept {
                 auto *material = si.material();
-                if (si.triangle.light) {
-                    on_hit_light(si.triangle.light, wo, si.sp(), prev_vertex);
+                if (si.light()) {
+                    on_hit_light(si.light(), wo, si.sp(), prev_vertex);
                     return std::nullopt;
                 } else if (depth < max_depth) {
                     SurfaceVertex vertex(wo, si);
@@ -446,12 +446,9 @@ namespace akari::render {
     } // namespace sms
     Film render_sms(SMSConfig config, const Scene &scene) {
         Film film(scene.camera->resolution());
-        std::vector<astd::pmr::monotonic_buffer_resource *> buffers;
-        for (size_t i = 0; i < thread::num_work_threads(); i++) {
-            buffers.emplace_back(new astd::pmr::monotonic_buffer_resource(astd::pmr::new_delete_resource()));
-        }
         thread::parallel_for(thread::blocked_range<2>(film.resolution(), ivec2(16, 16)), [&](ivec2 id, uint32_t tid) {
             auto Li = [&](const ivec2 p, Sampler &sampler) -> Spectrum {
+                ArenaFrame frame(thread::arena(tid));
                 sms::SMSPathTracer pt;
                 pt.min_depth = config.min_depth;
                 pt.max_depth = config.max_depth;
@@ -459,21 +456,17 @@ namespace akari::render {
                 pt.beta = Spectrum(1.0);
                 pt.sampler = &sampler;
                 pt.scene = &scene;
-                pt.allocator = Allocator<>(buffers[tid]);
+                pt.allocator = frame.allocator();
                 pt.run_megakernel(&scene.camera.value(), p);
-                buffers[tid]->release();
                 return pt.L;
             };
-            Sampler sampler = config.sampler;
-            sampler.set_sample_index(id.y * film.resolution().x + id.x);
+            Sampler sampler = create_sampler(config.sampler, id.y * film.resolution().x + id.x);
             for (int s = 0; s < config.spp; s++) {
+                sampler.start_next_sample();
                 auto L = Li(id, sampler);
                 film.add_sample(id, L, 1.0);
             }
         });
-        for (auto buf : buffers) {
-            delete buf;
-        }
         spdlog::info("render sms pt done");
         return film;
     }
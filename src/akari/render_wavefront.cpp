@@ -0,0 +1,311 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <numeric>
+#include <akari/util.h>
+#include <akari/pathtracer.h>
+#include <akari/profile.h>
+#include <spdlog/spdlog.h>
+
+namespace akari::render {
+    namespace wavefront {
+        // One path in flight per pixel of a tile; every array is indexed by the pixel slot.
+        // A pixel keeps its own sampler across samples, so the random sequence of each pixel
+        // is identical to the one consumed by SimplePathTracer::run_megakernel.
+        struct PathStates {
+            std::vector<ivec2> p_film;
+            std::vector<Sampler> samplers;
+            std::vector<int> samples_left;
+            RayStream ray;
+            std::vector<Spectrum> L, beta;
+            std::vector<int> depth;
+            std::vector<uint8_t> terminated;
+            // previous scattering vertex, needed for MIS when a path hits an emitter
+            std::vector<Float> prev_pdf;
+            std::vector<BSDFType> prev_lobe;
+            std::vector<Vec3> prev_p, prev_ng;
+            size_t size() const { return p_film.size(); }
+            void resize(size_t n) {
+                p_film.resize(n);
+                samplers.resize(n);
+                samples_left.resize(n);
+                ray.resize(n);
+                L.resize(n);
+                beta.resize(n);
+                depth.resize(n);
+                terminated.resize(n);
+                prev_pdf.resize(n);
+                prev_lobe.resize(n);
+                prev_p.resize(n);
+                prev_ng.resize(n);
+            }
+        };
+
+        // Per-thread queues, reused across tiles
+        struct Queues {
+            PathStates paths;
+            std::vector<uint32_t> active, next_active;
+            RayStream rays;
+            HitStream hits;
+            std::vector<const Material *> hit_material;
+            std::vector<uint32_t> shade_order;
+            RayStream shadow_rays;
+            std::vector<uint32_t> shadow_slot;
+            std::vector<Spectrum> shadow_L;
+            std::vector<uint8_t> occluded;
+        };
+
+        class WavefrontPathTracer {
+            const PTConfig &config;
+            const Scene &scene;
+            Film &film;
+            Queues &q;
+            PathStates &paths;
+            Arena &arena;
+            Allocator<> allocator;
+
+          public:
+            WavefrontPathTracer(const PTConfig &config, const Scene &scene, Film &film, Queues &q, Arena &arena)
+                : config(config), scene(scene), film(film), q(q), paths(q.paths), arena(arena), allocator(&arena) {}
+
+            void render_tile(const ivec2 &lo, const ivec2 &hi) {
+                const ivec2 extent = hi - lo;
+                paths.resize(hprod(extent));
+                q.active.clear();
+                for (int y = lo.y; y < hi.y; y++) {
+                    for (int x = lo.x; x < hi.x; x++) {
+                        const uint32_t slot       = (y - lo.y) * extent.x + (x - lo.x);
+                        paths.p_film[slot]       = ivec2(x, y);
+                        paths.samples_left[slot] = config.spp;
+                        paths.samplers[slot]     = create_sampler(config.sampler, y * film.resolution().x + x);
+                        if (config.spp > 0) {
+                            generate_camera_ray(slot);
+                            q.active.push_back(slot);
+                        }
+                    }
+                }
+                // BSDFs only live until the end of the bounce that evaluated them
+                ArenaFrame frame(arena);
+                while (!q.active.empty()) {
+                    intersect();
+                    shade();
+                    trace_shadow_rays();
+                    advance();
+                    frame.reset();
+                }
+            }
+
+          private:
+            void generate_camera_ray(uint32_t slot) {
+                auto &sampler = paths.samplers[slot];
+                sampler.start_next_sample();
+                stats::add(stats::CameraRays);
+                CameraSample sample =
+                    scene.camera->generate_ray(sampler.next2d(), sampler.next2d(), paths.p_film[slot]);
+                paths.ray.set(slot, sample.ray);
+                paths.L[slot]          = Spectrum(0.0);
+                paths.beta[slot]       = Spectrum(1.0);
+                paths.depth[slot]      = 0;
+                paths.terminated[slot] = false;
+                paths.prev_pdf[slot]   = 0.0;
+                paths.prev_lobe[slot]  = BSDFType::Unset;
+            }
+
+            // gather the rays of all live paths into one stream and trace it
+            void intersect() {
+                const size_t n = q.active.size();
+                q.rays.resize(n);
+                bool coherent = true;
+                for (size_t i = 0; i < n; i++) {
+                    const auto slot = q.active[i];
+                    q.rays.set(i, paths.ray.get(slot));
+                    coherent = coherent && paths.depth[slot] == 0;
+                }
+                q.rays.coherent = coherent;
+                scene.intersect_stream(q.rays, q.hits);
+            }
+
+            // shade hits grouped by material; paths that escape are terminated here as well
+            void shade() {
+                const size_t n = q.active.size();
+                q.hit_material.resize(n);
+                for (size_t i = 0; i < n; i++) {
+                    q.hit_material[i] = q.hits.hit(i) ? scene.instances[q.hits.geom_id[i]].material : nullptr;
+                }
+                q.shade_order.resize(n);
+                std::iota(q.shade_order.begin(), q.shade_order.end(), 0u);
+                std::stable_sort(q.shade_order.begin(), q.shade_order.end(),
+                                 [&](uint32_t a, uint32_t b) { return q.hit_material[a] < q.hit_material[b]; });
+                q.shadow_rays.clear();
+                q.shadow_slot.clear();
+                q.shadow_L.clear();
+                for (auto i : q.shade_order) {
+                    shade_hit(i);
+                }
+            }
+
+            void shade_hit(uint32_t i) {
+                const uint32_t slot = q.active[i];
+                if (!q.hits.hit(i)) {
+                    paths.terminated[slot] = true;
+                    return;
+                }
+                auto &sampler   = paths.samplers[slot];
+                const auto isct = q.hits.get(i);
+                SurfaceInteraction si(&scene.instances[isct.geom_id], isct.prim_id, isct.uv);
+                const Vec3 wo = -q.rays.get(i).d;
+                if (auto light = si.light()) {
+                    on_hit_light(slot, light, wo, si);
+                    paths.terminated[slot] = true;
+                    return;
+                }
+                if (paths.depth[slot] >= config.max_depth) {
+                    paths.terminated[slot] = true;
+                    return;
+                }
+                auto bsdf = si.material()->evaluate(sampler, allocator, si);
+                BSDFSampleContext sample_ctx{sampler.next1d(), sampler.next2d(), wo};
+                auto sample = bsdf.sample(sample_ctx);
+                if (!sample) {
+                    stats::add(stats::BSDFSampleFailures);
+                    paths.terminated[slot] = true;
+                    return;
+                }
+                AKR_ASSERT(sample->pdf >= 0.0f);
+                if (sample->pdf == 0.0f) {
+                    stats::add(stats::BSDFSampleFailures);
+                    paths.terminated[slot] = true;
+                    return;
+                }
+                if ((sample->type & BSDFType::Specular) == BSDFType::Unset) {
+                    sample_direct_lighting(slot, si, bsdf, wo);
+                }
+                auto vertex_beta = sample->f * (std::abs(glm::dot(si.ns, sample->wi)) / sample->pdf);
+                paths.beta[slot] *= vertex_beta();
+                paths.depth[slot]++;
+                if (paths.depth[slot] > config.min_depth) {
+                    Float continue_prob = std::min<Float>(1.0, hmax(paths.beta[slot])) * 0.95;
+                    if (continue_prob > sampler.next1d()) {
+                        paths.beta[slot] *= Spectrum(1.0 / continue_prob);
+                    } else {
+                        stats::add(stats::RussianRouletteTerminations);
+                        paths.terminated[slot] = true;
+                        return;
+                    }
+                }
+                paths.ray.set(slot, Ray(si.p, sample->wi, Eps / std::abs(glm::dot(si.ng, sample->wi))));
+                paths.prev_pdf[slot]  = sample->pdf;
+                paths.prev_lobe[slot] = sample->type;
+                paths.prev_p[slot]    = si.p;
+                paths.prev_ng[slot]   = si.ng;
+            }
+
+            void on_hit_light(uint32_t slot, const Light *light, const Vec3 &wo, const SurfaceInteraction &si) {
+                Spectrum I = paths.beta[slot] * light->Le(wo, si.sp());
+                if (paths.depth[slot] != 0 && (paths.prev_lobe[slot] & BSDFType::Specular) == BSDFType::Unset) {
+                    PointGeometry ref;
+                    ref.n          = paths.prev_ng[slot];
+                    ref.p          = paths.prev_p[slot];
+                    auto light_pdf = light->pdf_incidence(ref, -wo) * scene.light_sampler->pdf(light);
+                    I *= pt::mis_weight(paths.prev_pdf[slot], light_pdf);
+                }
+                paths.L[slot] += I;
+            }
+
+            // NEE; the shadow ray is queued and resolved in trace_shadow_rays()
+            void sample_direct_lighting(uint32_t slot, const SurfaceInteraction &si, const BSDF &bsdf,
+                                        const Vec3 &wo) {
+                auto &sampler           = paths.samplers[slot];
+                auto [light, light_pdf] = scene.light_sampler->sample(sampler.next2d());
+                if (!light) {
+                    return;
+                }
+                LightSampleContext light_ctx;
+                light_ctx.u              = sampler.next2d();
+                light_ctx.p              = si.p;
+                LightSample light_sample = light->sample_incidence(light_ctx);
+                if (light_sample.pdf <= 0.0)
+                    return;
+                light_pdf *= light_sample.pdf;
+                auto f              = bsdf.evaluate(wo, light_sample.wi);
+                Float bsdf_pdf      = bsdf.evaluate_pdf(wo, light_sample.wi);
+                Spectrum throughput = light_sample.I * std::abs(dot(si.ns, light_sample.wi)) / light_pdf *
+                                      pt::mis_weight(light_pdf, bsdf_pdf);
+                Spectrum radiance = (f * throughput)();
+                if (is_black(radiance)) {
+                    return;
+                }
+                q.shadow_rays.push_back(light_sample.shadow_ray);
+                q.shadow_slot.push_back(slot);
+                q.shadow_L.push_back(paths.beta[slot] * radiance);
+            }
+
+            void trace_shadow_rays() {
+                if (q.shadow_rays.empty()) {
+                    return;
+                }
+                scene.occlude_stream(q.shadow_rays, q.occluded);
+                for (size_t i = 0; i < q.shadow_rays.size(); i++) {
+                    if (!q.occluded[i]) {
+                        paths.L[q.shadow_slot[i]] += q.shadow_L[i];
+                    }
+                }
+            }
+
+            // retire finished paths to the film and refill their slots with the pixel's next sample
+            void advance() {
+                q.next_active.clear();
+                for (auto slot : q.active) {
+                    if (!paths.terminated[slot]) {
+                        q.next_active.push_back(slot);
+                        continue;
+                    }
+                    film.add_sample(paths.p_film[slot], clamp_zero(paths.L[slot]), 1.0);
+                    stats::add(stats::Paths);
+                    stats::add(stats::PathVertices, paths.depth[slot]);
+                    if (--paths.samples_left[slot] > 0) {
+                        generate_camera_ray(slot);
+                        q.next_active.push_back(slot);
+                    }
+                }
+                std::swap(q.active, q.next_active);
+            }
+        };
+    } // namespace wavefront
+
+    Film render_pt_wavefront(PTConfig config, const Scene &scene) {
+        AKR_TRACE_SCOPE("render_pt_wavefront");
+        Film film(scene.camera->resolution());
+        const ivec2 tile_size(32, 32);
+        const ivec2 n_tiles = (film.resolution() + tile_size - ivec2(1)) / tile_size;
+        std::vector<std::unique_ptr<wavefront::Queues>> queues;
+        for (size_t i = 0; i < thread::num_work_threads(); i++) {
+            queues.emplace_back(std::make_unique<wavefront::Queues>());
+        }
+        ProgressReporter reporter(hprod(n_tiles));
+        thread::parallel_for(hprod(n_tiles), [&](size_t idx, uint32_t tid) {
+            if (config.control && config.control->should_stop())
+                return;
+            const ivec2 tile(idx % n_tiles.x, idx / n_tiles.x);
+            const ivec2 lo = tile * tile_size;
+            const ivec2 hi = glm::min(lo + tile_size, film.resolution());
+            AKR_TRACE_SCOPE("wavefront tile");
+            wavefront::WavefrontPathTracer pt(config, scene, film, *queues[tid], thread::arena(tid));
+            pt.render_tile(lo, hi);
+            reporter.update();
+        });
+        spdlog::info("render pt (wavefront) done");
+        return film;
+    }
+} // namespace akari::render
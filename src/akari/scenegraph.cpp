@@ -13,6 +13,7 @@
 // limitations under the License.
 #include <fstream>
 #include <akari/scenegraph.h>
+#include <akari/profile.h>
 #include <spdlog/spdlog.h>
 namespace akari::scene {
     Material::Material() {
@@ -43,6 +44,7 @@ namespace akari::scene {
     void Mesh::load() {
         if (loaded)
             return;
+        AKR_TRACE_SCOPE("Mesh::load");
         spdlog::info("loading {}", path);
         std::ifstream in(path, std::ios::binary);
         size_t m = 0;
@@ -68,11 +70,15 @@ namespace akari::scene {
         AKR_ASSERT(m == MAGIC);
         loaded = true;
     }
+    template <class T>
+    static void release_storage(astd::pmr::vector<T> &v) {
+        astd::pmr::vector<T>(v.get_allocator()).swap(v);
+    }
     void Mesh::unload() {
-        vertices = std::vector<vec3>();
-        normals = std::vector<vec3>();
-        texcoords = std::vector<vec2>();
-        indices = std::vector<uvec3>();
+        release_storage(vertices);
+        release_storage(normals);
+        release_storage(texcoords);
+        release_storage(indices);
         loaded = false;
     }
     void SceneGraph::commit() {
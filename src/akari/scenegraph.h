@@ -14,6 +14,7 @@
 #pragma once
 #include <akari/util.h>
 #include <akari/macro.h>
+#include <akari/memory.h>
 #include <cereal/cereal.hpp>
 namespace akari::scene {
     template <typename T>
@@ -121,12 +122,14 @@ namespace akari::scene {
         bool loaded = false;
 
       public:
-        std::vector<vec3> vertices;
-        std::vector<uvec3> indices;
-        std::vector<vec3> normals;
-        std::vector<vec2> texcoords;
+        astd::pmr::vector<vec3> vertices;
+        astd::pmr::vector<uvec3> indices;
+        astd::pmr::vector<vec3> normals;
+        astd::pmr::vector<vec2> texcoords;
         std::string path;
         AKR_SER_POLY(Object, path)
+        Mesh() : Mesh(Allocator<>(memory::buffer_resource(memory::Mesh))) {}
+        explicit Mesh(Allocator<> alloc) : vertices(alloc), indices(alloc), normals(alloc), texcoords(alloc) {}
 
         void save_to_file(const std::string &file) const;
         void load();
@@ -181,8 +184,14 @@ namespace akari::scene {
     class Integrator : public Object {
       public:
         enum class Type { Path, VPL, MCMC, SMCMC, GuidedPath, UnifiedPath, BDPT };
+        // wall-clock budget of the render in seconds, 0 for none; spp becomes an upper bound
+        double time_limit = 0.0;
+        // "pcg", "lcg", "zsobol" or "pmj02bn"
+        std::string sampler = "pcg";
+        // scrambles the sample sequences; renders with different seeds have independent noise
+        uint64_t seed = 0;
         AKR_DECL_RTTI(Integrator)
-        AKR_SER_POLY(Object)
+        AKR_SER_POLY(Object, time_limit, sampler, seed)
     };
 
     class PathTracer : public Integrator {
@@ -190,8 +199,20 @@ namespace akari::scene {
         uint32_t spp = 16;
         int32_t min_depth = 4;
         int32_t max_depth = 7;
+        bool wavefront = false;
+        // spp is an upper bound; pixels stop once their relative error is below adaptive_threshold
+        bool adaptive = false;
+        uint32_t adaptive_min_spp = 16;
+        float adaptive_threshold = 0.02;
+        // mean relative error over the image at which rendering stops
+        float adaptive_target = 0.0;
+        // renders the whole frame spp_per_pass samples at a time, 0 renders tile by tile
+        uint32_t spp_per_pass = 0;
+        // film written after each pass and resumed from when it exists
+        std::string checkpoint;
         AKR_DECL_TYPEID(PathTracer, Path)
-        AKR_SER_POLY(Integrator, spp, min_depth, max_depth)
+        AKR_SER_POLY(Integrator, spp, min_depth, max_depth, wavefront, adaptive, adaptive_min_spp, adaptive_threshold,
+                     adaptive_target, spp_per_pass, checkpoint)
     };
     class UnifiedPathTracer : public Integrator {
       public:
@@ -252,9 +273,20 @@ namespace akari::scene {
         std::vector<P<Mesh>> meshes;
         std::vector<P<Instance>> instances;
         std::string output_path = "out.png";
+        // budget in MB for world-space copies of the vertices and normals of transformed instances, 0 disables them
+        uint32_t geometry_cache_mb = 256;
+        // ray tracing backend, "embree" or "bvh"
+        std::string accel = "embree";
+        // directory of the mesh BVHs built by the "bvh" backend, empty to always rebuild them
+        std::string bvh_cache_dir;
+        // children per node of the "bvh" backend, 4 or 8
+        int bvh_width = 8;
+        // build profile of the ray tracing backend, see render::AccelProfile; "auto" picks one from the scene
+        std::string accel_profile = "high-quality";
         void commit();
         void normalize();
-        AKR_SER(camera, integrator, meshes, instances, root, output_path)
+        AKR_SER(camera, integrator, meshes, instances, root, output_path, geometry_cache_mb, accel, bvh_cache_dir,
+                bvh_width, accel_profile)
     
         std::vector<P<Object>> find(const std::string &name);
     };
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <akari/thread.h>
+#include <akari/memory.h>
 
 #include <atomic>
 #include <condition_variable>
@@ -19,122 +20,546 @@
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <limits>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <cctype>
+#include <sstream>
+#include <fstream>
+#include <spdlog/spdlog.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace akari::thread {
+    namespace thread_internal {
+        static std::once_flag flag;
+        static size_t n_threads = std::thread::hardware_concurrency();
+        static ThreadAffinity thread_affinity = ThreadAffinity::None;
+        // processors the thread calling init() could run on before it was pinned
+        static std::vector<int> caller_cpus;
+        // id of the calling thread inside the pool, -1 if it is not participating in a loop
+        static thread_local int current_tid = -1;
+
+        // parses the "0-3,8,10-11" format used by sysfs
+        static std::vector<int> parse_cpu_list(const std::string &list) {
+            std::vector<int> cpus;
+            std::istringstream in(list);
+            std::string item;
+            while (std::getline(in, item, ',')) {
+                if (item.empty() || !std::isdigit((unsigned char)item[0]))
+                    continue;
+                auto dash = item.find('-');
+                int lo    = std::stoi(item.substr(0, dash));
+                int hi    = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+                for (int cpu = lo; cpu <= hi; cpu++) {
+                    cpus.emplace_back(cpu);
+                }
+            }
+            return cpus;
+        }
+        static std::string read_line(const std::string &path) {
+            std::ifstream in(path);
+            std::string line;
+            std::getline(in, line);
+            return line;
+        }
+        // processors the calling thread may run on
+        static std::vector<int> current_cpus() {
+            std::vector<int> cpus;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &set))
+                        cpus.emplace_back(cpu);
+                }
+            }
+#endif
+            return cpus;
+        }
+        static bool pin_current_thread(const std::vector<int> &cpus) {
+            if (cpus.empty())
+                return true;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (auto cpu : cpus) {
+                CPU_SET(cpu, &set);
+            }
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+            return false;
+#endif
+        }
+        // allowed processors grouped by NUMA node; a single node if the topology is unknown
+        static std::vector<std::vector<int>> numa_nodes() {
+            auto allowed = current_cpus();
+            std::vector<std::vector<int>> nodes;
+            for (auto node : parse_cpu_list(read_line("/sys/devices/system/node/online"))) {
+                std::vector<int> cpus;
+                for (auto cpu :
+                     parse_cpu_list(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))) {
+                    if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+                        cpus.emplace_back(cpu);
+                }
+                if (!cpus.empty())
+                    nodes.emplace_back(std::move(cpus));
+            }
+            if (nodes.empty() && !allowed.empty()) {
+                nodes.emplace_back(std::move(allowed));
+            }
+            return nodes;
+        }
+        // processors of each slot, an empty list leaves the slot unpinned
+        static std::vector<std::vector<int>> affinity_masks(size_t n_slots, ThreadAffinity affinity) {
+            std::vector<std::vector<int>> masks(n_slots);
+            if (affinity == ThreadAffinity::None)
+                return masks;
+            auto nodes = numa_nodes();
+            if (nodes.empty()) {
+                spdlog::warn("thread affinity is not supported on this platform, threads are not pinned");
+                return masks;
+            }
+            size_t n_cpus = 0;
+            for (auto &cpus : nodes) {
+                n_cpus += cpus.size();
+            }
+            for (size_t tid = 0; tid < n_slots; tid++) {
+                if (affinity == ThreadAffinity::Core) {
+                    auto k = tid % n_cpus;
+                    for (auto &cpus : nodes) {
+                        if (k < cpus.size()) {
+                            masks[tid] = {cpus[k]};
+                            break;
+                        }
+                        k -= cpus.size();
+                    }
+                } else {
+                    masks[tid] = nodes[tid * nodes.size() / n_slots];
+                }
+            }
+            spdlog::info("pinning {} threads to {} processors on {} NUMA node(s)", n_slots, n_cpus, nodes.size());
+            return masks;
+        }
+    } // namespace thread_internal
+
+    // [begin, end) packed into one word, so that the owner (taking from the front) and thieves
+    // (taking from the back) race on a single CAS
+    struct alignas(64) WorkRange {
+        std::atomic<uint64_t> range{0};
+        static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t(begin) << 32u) | end; }
+        static uint32_t begin_of(uint64_t r) { return uint32_t(r >> 32u); }
+        static uint32_t end_of(uint64_t r) { return uint32_t(r); }
+        void assign(uint32_t begin, uint32_t end) { range.store(pack(begin, end), std::memory_order_release); }
+        bool empty() const {
+            auto r = range.load(std::memory_order_acquire);
+            return begin_of(r) >= end_of(r);
+        }
+        // guided: never take more than half of what is left, so that thieves still find work
+        bool pop(uint32_t n, bool guided, uint32_t &begin, uint32_t &end) {
+            auto r = range.load(std::memory_order_acquire);
+            while (true) {
+                auto b = begin_of(r), e = end_of(r);
+                if (b >= e)
+                    return false;
+                auto take = guided ? std::max<uint32_t>(1, std::min<uint32_t>(n, (e - b) / 2)) : n;
+                auto nb   = (uint32_t)std::min<uint64_t>(e, uint64_t(b) + take);
+                if (range.compare_exchange_weak(r, pack(nb, e), std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+                    begin = b;
+                    end   = nb;
+                    return true;
+                }
+            }
+        }
+        bool steal(uint32_t &begin, uint32_t &end) {
+            auto r = range.load(std::memory_order_acquire);
+            while (true) {
+                auto b = begin_of(r), e = end_of(r);
+                if (b >= e)
+                    return false;
+                auto mid = b + (e - b) / 2;
+                if (range.compare_exchange_weak(r, pack(b, mid), std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+                    begin = mid;
+                    end   = e;
+                    return true;
+                }
+            }
+        }
+    };
 
-    struct ParallelForContext {
-        std::atomic_uint32_t workIndex;
-        size_t count = 0;
-        uint32_t chunkSize = 0;
-        ParallelForContext() : workIndex(0) {}
-        const std::function<void(size_t, uint32_t)> *func = nullptr;
-        bool done() const { return workIndex >= count; }
-        ParallelForContext(const ParallelForContext &rhs)
-            : workIndex(rhs.workIndex.load()), count(rhs.count), chunkSize(rhs.chunkSize), func(rhs.func) {}
+    // Anything the pool can execute: a parallel_for loop or the task queue of a TaskGroup.
+    // Any number of jobs may be in flight; a thread waiting on one job helps executing it and the jobs published after
+    // it, which are nested in it or independent of it.
+    struct Job {
+        // threads currently inside participate(); only incremented while the job is published
+        std::atomic_uint32_t participants{0};
+        virtual ~Job() = default;
+        // called with ParallelForWorkPool::m held
+        virtual bool has_work() const = 0;
+        // executes work until none is left that has not been claimed by another thread
+        virtual void participate(uint32_t tid) = 0;
+        virtual bool done() const = 0;
     };
 
+    struct ParallelForWorkPool;
+    namespace thread_internal {
+        static std::unique_ptr<ParallelForWorkPool> pool;
+    } // namespace thread_internal
+
     struct ParallelForWorkPool {
-        std::deque<ParallelForContext> works;
         std::vector<std::thread> threads;
-        std::condition_variable hasWork, oneThreadFinished, mainWaiting;
-        std::mutex workMutex;
-        std::atomic_bool stopped;
-        std::uint32_t workId;
-        std::uint32_t nThreadFinished;
-        ParallelForWorkPool() : workId(0), nThreadFinished(0) {
-            stopped = false;
+        std::mutex m;
+        std::condition_variable has_work, job_done;
+        std::vector<Job *> jobs;
+        bool stopped = false;
+        // the last slot is lent to one thread outside of the pool at a time, so that it can help
+        std::atomic_bool caller_slot_taken{false};
+        // one per slot; a block is first touched by the thread of its slot
+        std::vector<std::unique_ptr<Arena>> arenas;
+        explicit ParallelForWorkPool(const std::vector<std::vector<int>> &masks) {
             auto n = num_work_threads();
             for (uint32_t tid = 0; tid < n; tid++) {
-                threads.emplace_back([=]() {
-                    while (!stopped) {
-                        std::unique_lock<std::mutex> lock(workMutex);
-                        while (works.empty() && !stopped) {
-                            hasWork.wait(lock);
-                        }
+                arenas.emplace_back(std::make_unique<Arena>(memory::resource(memory::Scratch)));
+            }
+            for (uint32_t tid = 0; tid + 1 < n; tid++) {
+                threads.emplace_back([=, mask = masks[tid]]() {
+                    if (!thread_internal::pin_current_thread(mask)) {
+                        spdlog::warn("failed to set the affinity of thread {}", tid);
+                    }
+                    thread_internal::current_tid = (int)tid;
+                    std::unique_lock<std::mutex> lock(m);
+                    while (true) {
+                        Job *job = nullptr;
+                        has_work.wait(lock, [&] { return stopped || (job = find_job()) != nullptr; });
                         if (stopped)
                             return;
-                        auto &loop = works.front();
-                        auto id = workId;
+                        job->participants++;
                         lock.unlock();
-                        // lock held
-                        while (!loop.done()) {
-                            auto begin = loop.workIndex.fetch_add(loop.chunkSize);
-                            for (auto i = begin; i < begin + loop.chunkSize && i < loop.count; i++) {
-                                (*loop.func)(i, tid);
-                            }
-                        }
+                        job->participate(tid);
+                        job->participants--;
                         lock.lock();
-                        nThreadFinished++;
-                        oneThreadFinished.notify_all();
-
-                        while (nThreadFinished != (uint32_t)threads.size() && workId == id) {
-                            oneThreadFinished.wait(lock);
-                        }
-
-                        if (workId == id) {
-                            workId++; // only one thread would reach here
-                            works.pop_front();
-                            if (works.empty()) {
-                                mainWaiting.notify_one();
-                            }
-                            nThreadFinished = 0;
-                        }
-                        lock.unlock();
                     }
                 });
             }
         }
-        void enqueue(const ParallelForContext &context) {
-            std::lock_guard<std::mutex> lock(workMutex);
-            works.emplace_back(context);
-            hasWork.notify_all();
+        Job *find_job() const {
+            for (auto *job : jobs) {
+                if (job->has_work())
+                    return job;
+            }
+            return nullptr;
+        }
+        void publish(Job *job) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                jobs.emplace_back(job);
+            }
+            has_work.notify_all();
+        }
+        // wakes up workers after more work was added to a published job
+        void notify_work() {
+            { std::lock_guard<std::mutex> lock(m); }
+            has_work.notify_all();
         }
-        void wait() {
-            std::unique_lock<std::mutex> lock(workMutex);
-            while (!works.empty()) {
-
-                mainWaiting.wait(lock);
+        void notify_done() {
+            { std::lock_guard<std::mutex> lock(m); }
+            job_done.notify_all();
+        }
+        // after retire() returns no thread references the job anymore
+        void retire(Job *job) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+            }
+            while (job->participants.load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+        // Older jobs are left alone: their chunks may wait on the job in turn, which would delay the wait without
+        // bound and nest one more stack frame per chunk.
+        bool help(uint32_t tid, const Job &waiting) {
+            Job *job = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                for (auto it = std::find(jobs.begin(), jobs.end(), &waiting); it != jobs.end(); ++it) {
+                    if ((*it)->has_work()) {
+                        job = *it;
+                        break;
+                    }
+                }
+                if (!job)
+                    return false;
+                job->participants++;
             }
+            job->participate(tid);
+            job->participants--;
+            return true;
         }
+        void wait(const Job &job, int tid);
         ~ParallelForWorkPool() {
-            stopped = true;
-            hasWork.notify_all();
+            {
+                std::lock_guard<std::mutex> lock(m);
+                stopped = true;
+            }
+            has_work.notify_all();
             for (auto &thr : threads) {
                 thr.join();
             }
         }
     };
-    namespace thread_internal {
-        static std::once_flag flag;
-        static std::unique_ptr<ParallelForWorkPool> pool;
-        static size_t n_threads = std::thread::hardware_concurrency();
-    } // namespace thread_internal
+
+    // Gives the calling thread a slot in the pool for the duration of a wait.
+    // Pool threads keep their own id; one outside thread at a time borrows the last slot.
+    struct SlotGuard {
+        int tid           = -1;
+        bool borrowed     = false;
+        ParallelForWorkPool *pool = nullptr;
+        explicit SlotGuard(ParallelForWorkPool *pool) : tid(thread_internal::current_tid), pool(pool) {
+            if (tid == -1 && !pool->caller_slot_taken.exchange(true)) {
+                tid                          = (int)num_work_threads() - 1;
+                borrowed                     = true;
+                thread_internal::current_tid = tid;
+            }
+        }
+        ~SlotGuard() {
+            if (borrowed) {
+                thread_internal::current_tid = -1;
+                pool->caller_slot_taken      = false;
+            }
+        }
+    };
+
+    // threads with a slot help with the job while waiting, the others sleep until the shared slot frees up
+    void ParallelForWorkPool::wait(const Job &job, int tid) {
+        if (tid >= 0) {
+            while (!job.done()) {
+                if (!help((uint32_t)tid, job)) {
+                    std::this_thread::yield();
+                }
+            }
+            return;
+        }
+        while (!job.done()) {
+            SlotGuard slot(this);
+            if (slot.tid >= 0) {
+                wait(job, slot.tid);
+                return;
+            }
+            std::unique_lock<std::mutex> lock(m);
+            job_done.wait_for(lock, std::chrono::milliseconds(1), [&] { return job.done(); });
+        }
+    }
+
+    struct ParallelForJob : Job {
+        // the auto partitioner grows a thread's chunk size until a chunk takes about this long
+        static constexpr std::chrono::microseconds target_chunk_time{50};
+        RangeFunc func;
+        size_t base         = 0;
+        uint32_t chunk_size = 0;
+        size_t n_slots      = 0;
+        std::unique_ptr<WorkRange[]> ranges;
+        std::atomic_uint32_t remaining;
+        ParallelForJob(RangeFunc func, size_t base, uint32_t count, uint32_t chunk_size, size_t n_slots)
+            : func(func), base(base), chunk_size(chunk_size), n_slots(n_slots), ranges(new WorkRange[n_slots]),
+              remaining(count) {
+            for (size_t i = 0; i < n_slots; i++) {
+                ranges[i].assign(uint32_t(uint64_t(count) * i / n_slots),
+                                 uint32_t(uint64_t(count) * (i + 1) / n_slots));
+            }
+        }
+        bool has_work() const override {
+            for (size_t i = 0; i < n_slots; i++) {
+                if (!ranges[i].empty())
+                    return true;
+            }
+            return false;
+        }
+        bool done() const override { return remaining.load() == 0; }
+        // runs chunks from its own range first, then steals
+        void participate(uint32_t tid) override {
+            using clock = std::chrono::steady_clock;
+            uint32_t begin, end;
+            auto &own           = ranges[tid];
+            const bool adaptive = chunk_size == 0;
+            uint32_t chunk      = adaptive ? 1 : chunk_size;
+            while (true) {
+                while (own.pop(chunk, adaptive, begin, end)) {
+                    if (adaptive) {
+                        auto t0 = clock::now();
+                        func(base + begin, base + end, tid);
+                        auto elapsed = clock::now() - t0;
+                        if (elapsed * 2 < target_chunk_time && end - begin == chunk) {
+                            chunk = std::min<uint32_t>(chunk * 2, 1u << 20u);
+                        } else if (elapsed > target_chunk_time * 2 && chunk > 1) {
+                            chunk /= 2;
+                        }
+                    } else {
+                        func(base + begin, base + end, tid);
+                    }
+                    if (remaining.fetch_sub(end - begin) == end - begin) {
+                        thread_internal::pool->notify_done();
+                    }
+                }
+                if (!steal(tid, begin, end)) {
+                    return;
+                }
+                own.assign(begin, end);
+            }
+        }
+        bool steal(uint32_t tid, uint32_t &begin, uint32_t &end) {
+            for (size_t k = 1; k < n_slots; k++) {
+                if (ranges[(tid + k) % n_slots].steal(begin, end)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    struct TaskGroup::Impl : Job {
+        mutable std::mutex tasks_m;
+        std::deque<std::function<void(uint32_t)>> tasks;
+        std::atomic_size_t pending{0};
+        bool has_work() const override {
+            std::lock_guard<std::mutex> lock(tasks_m);
+            return !tasks.empty();
+        }
+        bool done() const override { return pending.load() == 0; }
+        void participate(uint32_t tid) override {
+            while (true) {
+                std::function<void(uint32_t)> task;
+                {
+                    std::lock_guard<std::mutex> lock(tasks_m);
+                    if (tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task(tid);
+                if (--pending == 0) {
+                    thread_internal::pool->notify_done();
+                }
+            }
+        }
+    };
+
     size_t num_work_threads() { return thread_internal::n_threads; }
-    void parallel_for_impl(size_t count, const std::function<void(size_t, uint32_t)> &func, size_t chunkSize) {
+    void parallel_for_range(size_t count, RangeFunc func, size_t chunk_size) {
         using namespace thread_internal;
         if (!pool) {
             throw std::runtime_error("thread pool not initialized. call thread::init(num_threads);");
         }
-        ParallelForContext ctx;
-        ctx.func = &func;
-        ctx.chunkSize = (uint32_t)chunkSize;
-        ctx.count = count;
-        ctx.workIndex = 0;
-        pool->enqueue(ctx);
-        pool->wait();
+        SlotGuard slot(pool.get());
+        constexpr size_t max_job_size = std::numeric_limits<uint32_t>::max();
+        for (size_t base = 0; base < count; base += max_job_size) {
+            ParallelForJob job(func, base, (uint32_t)std::min(count - base, max_job_size), (uint32_t)chunk_size,
+                               num_work_threads());
+            pool->publish(&job);
+            if (slot.tid >= 0) {
+                job.participate((uint32_t)slot.tid);
+            }
+            pool->wait(job, slot.tid);
+            pool->retire(&job);
+        }
     }
 
-    AKR_EXPORT void init(size_t num_threads) {
+    TaskGroup::TaskGroup() : impl(std::make_unique<Impl>()) {
+        if (!thread_internal::pool) {
+            throw std::runtime_error("thread pool not initialized. call thread::init(num_threads);");
+        }
+        thread_internal::pool->publish(impl.get());
+    }
+    TaskGroup::~TaskGroup() {
+        wait();
+        thread_internal::pool->retire(impl.get());
+    }
+    void TaskGroup::run_impl(std::function<void(uint32_t)> task) {
+        impl->pending++;
+        {
+            std::lock_guard<std::mutex> lock(impl->tasks_m);
+            impl->tasks.emplace_back(std::move(task));
+        }
+        thread_internal::pool->notify_work();
+    }
+    void TaskGroup::wait() {
+        auto &pool = *thread_internal::pool;
+        SlotGuard slot(&pool);
+        if (slot.tid >= 0) {
+            impl->participate((uint32_t)slot.tid);
+        }
+        pool.wait(*impl, slot.tid);
+    }
+
+    AKR_EXPORT void init(size_t num_threads, ThreadAffinity affinity) {
         using namespace thread_internal;
         if (pool) {
             AKR_PANIC("thread::init(num_threads); called multiple times");
         }
-        n_threads = num_threads;
-        std::call_once(flag, [&]() { pool = std::make_unique<ParallelForWorkPool>(); });
+        n_threads       = std::max<size_t>(1, num_threads);
+        thread_affinity = affinity;
+        std::call_once(flag, [&]() {
+            auto masks = affinity_masks(n_threads, affinity);
+            if (!masks.back().empty()) {
+                caller_cpus = current_cpus();
+                pin_current_thread(masks.back());
+            }
+            pool = std::make_unique<ParallelForWorkPool>(masks);
+        });
     }
     void finalize() {
         using namespace thread_internal;
         pool.reset(nullptr);
+        pin_current_thread(caller_cpus);
+        caller_cpus.clear();
+        thread_affinity = ThreadAffinity::None;
+    }
+    ThreadAffinity affinity() { return thread_internal::thread_affinity; }
+    void discard_pages(void *data, size_t bytes) {
+#ifdef __linux__
+        static const auto page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+        auto begin                  = ((uintptr_t)data + page_size - 1) & ~(page_size - 1);
+        auto end                    = ((uintptr_t)data + bytes) & ~(page_size - 1);
+        if (begin < end) {
+            madvise((void *)begin, end - begin, MADV_DONTNEED);
+        }
+#else
+        (void)data;
+        (void)bytes;
+#endif
+    }
+    Arena &arena(uint32_t tid) {
+        using namespace thread_internal;
+        if (!pool) {
+            throw std::runtime_error("thread pool not initialized. call thread::init(num_threads);");
+        }
+        AKR_ASSERT(tid < pool->arenas.size());
+        return *pool->arenas[tid];
+    }
+    size_t arena_high_water_mark() {
+        size_t bytes = 0;
+        if (thread_internal::pool) {
+            for (auto &a : thread_internal::pool->arenas) {
+                bytes += a->high_water_mark();
+            }
+        }
+        return bytes;
+    }
+    size_t arena_bytes_reserved() {
+        size_t bytes = 0;
+        if (thread_internal::pool) {
+            for (auto &a : thread_internal::pool->arenas) {
+                bytes += a->bytes_reserved();
+            }
+        }
+        return bytes;
     }
     ThreadPool::ThreadPool(size_t num_threads) : stopped(false), num_active_workers(0) {
         for (size_t i = 0; i < num_threads; i++) {
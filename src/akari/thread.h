@@ -16,11 +16,13 @@
 #define AKARIRENDER_PARALLEL_HPP
 
 #include <akari/util.h>
+#include <akari/arena.h>
 #include <atomic>
 #include <functional>
 #include <future>
 #include <deque>
 #include <vector>
+#include <memory>
 #include <condition_variable>
 #include <mutex>
 
@@ -104,19 +106,42 @@ namespace akari {
         BlockedDim<N> blocked_range(const int dim, const int block) {
             return BlockedDim<N>{Vector<int, N>(dim), Vector<int, N>(block)};
         }
-        AKR_EXPORT void parallel_for_impl(size_t count, const std::function<void(size_t, uint32_t)> &func,
-                                          size_t chunkSize);
+        // Non-owning reference to a callable f(begin, end, tid) that processes items [begin, end).
+        // The pool makes one indirect call per chunk; the loop body itself is inlined into the callable.
+        class RangeFunc {
+            void *obj                                          = nullptr;
+            void (*invoke)(void *, size_t, size_t, uint32_t) = nullptr;
 
-        inline void parallel_for(size_t count, const std::function<void(size_t, uint32_t)> &func) {
-            parallel_for_impl(count, func, 1);
+          public:
+            template <class F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, RangeFunc>>>
+            RangeFunc(F &f)
+                : obj((void *)std::addressof(f)), invoke([](void *obj, size_t begin, size_t end, uint32_t tid) {
+                      (*static_cast<F *>(obj))(begin, end, tid);
+                  }) {}
+            void operator()(size_t begin, size_t end, uint32_t tid) const { invoke(obj, begin, end, tid); }
+        };
+        // chunk_size == 0 selects the auto partitioner, which sizes chunks from the measured cost per item
+        AKR_EXPORT void parallel_for_range(size_t count, RangeFunc func, size_t chunk_size);
+
+        // F :: size_t -> uint32_t tid -> void
+        template <class F>
+        void parallel_for(size_t count, F &&func, size_t chunk_size = 0) {
+            auto body = [&](size_t begin, size_t end, uint32_t tid) {
+                for (size_t i = begin; i < end; i++) {
+                    func(i, tid);
+                }
+            };
+            parallel_for_range(count, RangeFunc(body), chunk_size);
         }
-        inline void parallel_for(BlockedDim<1> blocked_dim, const std::function<void(size_t, uint32_t)> &func) {
-            parallel_for_impl(blocked_dim.dim[0], func, blocked_dim.block[0]);
+        template <class F>
+        void parallel_for(BlockedDim<1> blocked_dim, F &&func) {
+            parallel_for(blocked_dim.dim[0], std::forward<F>(func), blocked_dim.block[0]);
         }
         AKR_EXPORT size_t num_work_threads();
-        inline void parallel_for(BlockedDim<2> blocked_dim, const std::function<void(ivec2, uint32_t)> &func) {
+        template <class F>
+        void parallel_for(BlockedDim<2> blocked_dim, F &&func) {
             ivec2 tiles = (blocked_dim.dim + blocked_dim.block - ivec2(1)) / blocked_dim.block;
-            parallel_for(tiles.x * tiles.y, [&](size_t idx, int tid) {
+            parallel_for(tiles.x * tiles.y, [&](size_t idx, uint32_t tid) {
                 ivec2 t(idx % tiles.x, idx / tiles.x);
                 for (int ty = 0; ty < blocked_dim.block[1]; ty++) {
                     int y = ty + t[1] * blocked_dim.block[1];
@@ -131,9 +156,10 @@ namespace akari {
                 }
             });
         }
-        inline void parallel_for(BlockedDim<3> blocked_dim, const std::function<void(ivec3, uint32_t)> &func) {
+        template <class F>
+        void parallel_for(BlockedDim<3> blocked_dim, F &&func) {
             ivec3 tiles = (blocked_dim.dim + blocked_dim.block - ivec3(1)) / blocked_dim.block;
-            parallel_for(tiles.x * tiles.y * tiles.z, [&](size_t idx, int tid) {
+            parallel_for(tiles.x * tiles.y * tiles.z, [&](size_t idx, uint32_t tid) {
                 auto z_ = idx / (tiles.x * tiles.y);
                 auto y_ = (idx % (tiles.x * tiles.y)) / tiles.x;
                 auto x_ = (idx % (tiles.x * tiles.y)) % tiles.x;
@@ -161,27 +187,96 @@ namespace akari {
             size_t count = std::distance(begin, end);
             parallel_for(count, [&](size_t idx, uint32_t) { f(*(begin + idx)); });
         }
-        // F :: T -> size_t -> T
+        namespace detail {
+            template <class T>
+            struct alignas(64) PaddedPartial {
+                T value;
+            };
+        } // namespace detail
+        // Deterministic reduction over [0, count).
+        // The range is cut into blocks that depend on count only. Each block is folded in order into its own
+        // cache-line-padded partial, and the partials are combined pairwise in a fixed tree order, so the result
+        // is bit-identical for any number of threads.
+        // Map :: size_t -> T, Reduce :: T -> T -> T; init should be the identity of Reduce
+        template <class T, class Map, class Reduce>
+        T parallel_map_reduce(size_t count, T init, Map &&map, Reduce &&reduce) {
+            if (count == 0) {
+                return init;
+            }
+            const size_t n_blocks = std::min<size_t>(count, 256);
+            std::vector<detail::PaddedPartial<T>> partials(n_blocks, detail::PaddedPartial<T>{init});
+            parallel_for(
+                n_blocks,
+                [&](size_t block, uint32_t) {
+                    const size_t begin = count * block / n_blocks;
+                    const size_t end   = count * (block + 1) / n_blocks;
+                    T acc              = init;
+                    for (size_t i = begin; i < end; i++) {
+                        acc = reduce(acc, map(i));
+                    }
+                    partials[block].value = acc;
+                },
+                1);
+            for (size_t stride = 1; stride < n_blocks; stride *= 2) {
+                for (size_t i = 0; i + stride < n_blocks; i += 2 * stride) {
+                    partials[i].value = reduce(partials[i].value, partials[i + stride].value);
+                }
+            }
+            return partials[0].value;
+        }
+        // F :: T -> T -> T
         template <class ParIter, class T, class F>
         T parallel_reduce(ParIter begin, ParIter end, T init, F &&f) {
-            T acc = init;
-            std::mutex m;
-            size_t count = std::distance(begin, end);
-            auto block_size = (count + thread::num_work_threads() - 1) / num_work_threads();
-            parallel_for(thread::num_work_threads(), [&](size_t idx, uint32_t tid) {
-                T cache = init;
-                auto it = begin + tid * block_size;
-                for (size_t i = 0; i < block_size && it < end; i++) {
-                    cache = f(cache, *it);
-                    it++;
-                }
-                std::lock_guard<std::mutex> lock(m);
-                acc = f(acc, cache);
-            });
-            return acc;
+            return parallel_map_reduce(
+                size_t(std::distance(begin, end)), init, [&](size_t i) -> T { return *(begin + i); }, f);
         }
-        AKR_EXPORT void init(size_t num_threads);
+        // Group of tasks executed by the thread pool. wait() helps executing pending work, so task
+        // groups and parallel_for may be nested or used from several threads at the same time.
+        class AKR_EXPORT TaskGroup {
+          public:
+            struct Impl;
+            TaskGroup();
+            TaskGroup(const TaskGroup &) = delete;
+            TaskGroup &operator=(const TaskGroup &) = delete;
+            // waits for all tasks
+            ~TaskGroup();
+            // F :: () -> void or F :: uint32_t tid -> void
+            template <class F>
+            void run(F &&f) {
+                if constexpr (std::is_invocable_v<F, uint32_t>) {
+                    run_impl(std::forward<F>(f));
+                } else {
+                    run_impl([f = std::forward<F>(f)](uint32_t) mutable { f(); });
+                }
+            }
+            void wait();
+
+          private:
+            void run_impl(std::function<void(uint32_t)> task);
+            std::unique_ptr<Impl> impl;
+        };
+        // How pool threads are pinned to processors.
+        // Consecutive slots are placed on the same NUMA node; as parallel_for hands out contiguous initial ranges
+        // by slot and steals from neighbouring slots first, a tile is rendered on the same node in every pass.
+        enum class ThreadAffinity {
+            None,    // not pinned
+            Core,    // slot i runs on the i-th logical processor, NUMA node by NUMA node
+            NumaNode // slots are spread evenly over the NUMA nodes and may run on any processor of their node
+        };
+        // the calling thread is pinned as well, as it uses the last slot when it waits on pool work
+        AKR_EXPORT void init(size_t num_threads, ThreadAffinity affinity = ThreadAffinity::None);
         AKR_EXPORT void finalize();
+        AKR_EXPORT ThreadAffinity affinity();
+        // Hands the whole pages inside [data, data + bytes) back to the OS so that they are allocated again by the
+        // first thread writing to them, on the NUMA node of that thread. Their content is lost; no-op where
+        // unsupported.
+        AKR_EXPORT void discard_pages(void *data, size_t bytes);
+        // Scratch arena of a pool slot, owned by the pool and kept across loops until finalize().
+        // Only the thread currently holding slot tid may use it; wrap the allocations in an ArenaFrame.
+        AKR_EXPORT Arena &arena(uint32_t tid);
+        // sum over all slots
+        AKR_EXPORT size_t arena_high_water_mark();
+        AKR_EXPORT size_t arena_bytes_reserved();
     } // namespace thread
 
     // Wrapper around std::future<T>
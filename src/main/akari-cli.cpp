@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <iostream>
+#include <csignal>
 #include <fstream>
 #include <sstream>
 #include <akari/scenegraph.h>
@@ -20,25 +21,89 @@
 #include <akari/thread.h>
 #include <akari/serial.h>
 #include <akari/api.h>
+#include <akari/profile.h>
+#include <akari/memory.h>
 #include <cxxopts.hpp>
 using namespace akari;
+static render::RenderControl render_control;
+// the first Ctrl-C stops the render and writes what has been rendered so far, the second one terminates
+static void handle_sigint(int) {
+    render_control.cancel();
+    std::signal(SIGINT, SIG_DFL);
+}
 int main(int argc, char **argv) {
-
-    thread::init(std::thread::hardware_concurrency());
-    if (argc < 2) {
-        fprintf(stderr, "usage: akari-cli scene\n");
+    cxxopts::Options options("akari-cli", "Renders a scene description");
+    options.positional_help("scene");
+    // clang-format off
+    options.add_options()
+        ("affinity", "pin the render threads: none, core or numa", cxxopts::value<std::string>()->default_value("none"))
+        ("huge-pages", "back large render buffers with huge pages")
+        ("accel-profile", "acceleration structure build profile: auto, fast, high-quality, compact or robust",
+         cxxopts::value<std::string>())
+        ("trace", "write a Chrome trace of the render", cxxopts::value<std::string>())
+        ("scene", "scene file", cxxopts::value<std::vector<std::string>>())
+        ("h,help", "print this message");
+    // clang-format on
+    options.parse_positional({"scene"});
+    auto affinity = thread::ThreadAffinity::None;
+    std::string scene_file;
+    std::string trace_file;
+    std::string accel_profile;
+    // unknown options, bad values and extra arguments are errors instead of being mistaken for the scene file
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+        const auto affinity_name = result["affinity"].as<std::string>();
+        if (affinity_name == "core") {
+            affinity = thread::ThreadAffinity::Core;
+        } else if (affinity_name == "numa") {
+            affinity = thread::ThreadAffinity::NumaNode;
+        } else if (affinity_name != "none") {
+            throw std::runtime_error("unknown thread affinity " + affinity_name);
+        }
+        if (result.count("huge-pages")) {
+            memory::set_huge_pages(true);
+        }
+        if (result.count("accel-profile")) {
+            accel_profile = result["accel-profile"].as<std::string>();
+            if (!render::parse_accel_profile(accel_profile)) {
+                throw std::runtime_error("unknown accel profile " + accel_profile);
+            }
+        }
+        if (result.count("trace")) {
+            trace_file = result["trace"].as<std::string>();
+        }
+        if (result.count("scene") != 1) {
+            throw std::runtime_error("expected exactly one scene file");
+        }
+        scene_file = result["scene"].as<std::vector<std::string>>()[0];
+    } catch (std::exception &e) {
+        std::cerr << "error: " << e.what() << "\n" << options.help() << std::endl;
         exit(-1);
     }
+    thread::init(std::thread::hardware_concurrency(), affinity);
     try {
         scene::P<scene::SceneGraph> scene_graph;
         {
-            std::ifstream t(argv[1]);
+            AKR_TRACE_SCOPE("load scene");
+            std::ifstream t(scene_file);
             std::stringstream buffer;
             buffer << t.rdbuf();
             cereal::JSONInputArchive ar(buffer);
             ar(scene_graph);
         }
-        render_scenegraph(scene_graph);
+        if (!accel_profile.empty()) {
+            scene_graph->accel_profile = accel_profile;
+        }
+        std::signal(SIGINT, handle_sigint);
+        render_scenegraph(scene_graph, &render_control);
+        std::signal(SIGINT, SIG_DFL);
+        if (!trace_file.empty()) {
+            trace::write_chrome_trace(trace_file);
+        }
 
     } catch (std::exception &e) {
         std::cerr << "error: " << e.what() << std::endl;
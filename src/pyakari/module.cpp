@@ -21,6 +21,7 @@
 #include <akari/api.h>
 #include <akari/gpu/api.h>
 #include <akari/thread.h>
+#include <akari/profile.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<akari::scene::P<akari::scene::Object>>);
 PYBIND11_MAKE_OPAQUE(std::vector<akari::scene::P<akari::scene::Mesh>>);
@@ -134,12 +135,22 @@ namespace akari::python {
             .def_readwrite("transform", &Node::transform)
             .def_readwrite("instances", &Node::instances)
             .def_readwrite("children", &Node::children);
-        py::class_<Integrator, Object, P<Integrator>>(m, "Integrator");
+        py::class_<Integrator, Object, P<Integrator>>(m, "Integrator")
+            .def_readwrite("time_limit", &Integrator::time_limit)
+            .def_readwrite("sampler", &Integrator::sampler)
+            .def_readwrite("seed", &Integrator::seed);
         py::class_<PathTracer, Integrator, P<PathTracer>>(m, "PathTracer")
             .def(py::init<>())
             .def_readwrite("spp", &PathTracer::spp)
             .def_readwrite("min_depth", &PathTracer::min_depth)
-            .def_readwrite("max_depth", &PathTracer::max_depth);
+            .def_readwrite("max_depth", &PathTracer::max_depth)
+            .def_readwrite("wavefront", &PathTracer::wavefront)
+            .def_readwrite("adaptive", &PathTracer::adaptive)
+            .def_readwrite("adaptive_min_spp", &PathTracer::adaptive_min_spp)
+            .def_readwrite("adaptive_threshold", &PathTracer::adaptive_threshold)
+            .def_readwrite("adaptive_target", &PathTracer::adaptive_target)
+            .def_readwrite("spp_per_pass", &PathTracer::spp_per_pass)
+            .def_readwrite("checkpoint", &PathTracer::checkpoint);
         py::class_<UnifiedPathTracer, Integrator, P<UnifiedPathTracer>>(m, "UnifiedPathTracer")
             .def(py::init<>())
             .def_readwrite("spp", &UnifiedPathTracer::spp)
@@ -179,6 +190,11 @@ namespace akari::python {
             .def_readwrite("instances", &SceneGraph::instances)
             .def_readwrite("integrator", &SceneGraph::integrator)
             .def_readwrite("output_path", &SceneGraph::output_path)
+            .def_readwrite("geometry_cache_mb", &SceneGraph::geometry_cache_mb)
+            .def_readwrite("accel", &SceneGraph::accel)
+            .def_readwrite("bvh_cache_dir", &SceneGraph::bvh_cache_dir)
+            .def_readwrite("bvh_width", &SceneGraph::bvh_width)
+            .def_readwrite("accel_profile", &SceneGraph::accel_profile)
             .def("find", &SceneGraph::find);
         m.def("save_json_str", [](P<SceneGraph> scene) -> std::string {
             std::ostringstream os;
@@ -255,8 +271,14 @@ namespace akari::python {
             gpu::render_scenegraph(scenegraph, backend);
         });
 
-        m.def("thread_pool_init", thread::init);
+        py::enum_<thread::ThreadAffinity>(m, "ThreadAffinity")
+            .value("None_", thread::ThreadAffinity::None)
+            .value("Core", thread::ThreadAffinity::Core)
+            .value("NumaNode", thread::ThreadAffinity::NumaNode);
+        m.def("thread_pool_init", thread::init, py::arg("num_threads"),
+              py::arg("affinity") = thread::ThreadAffinity::None);
         m.def("thread_pool_finalize", thread::finalize);
+        m.def("write_chrome_trace", trace::write_chrome_trace);
         py::bind_vector<std::vector<P<Object>>>(m, "ObjectArray");
         py::bind_vector<std::vector<P<Mesh>>>(m, "MeshArray");
         py::bind_vector<std::vector<P<Instance>>>(m, "InstanceArray");
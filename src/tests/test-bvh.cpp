@@ -0,0 +1,164 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cmath>
+#include <random>
+#include <akari/bvh.h>
+#include <akari/thread.h>
+
+using namespace akari;
+using namespace akari::render;
+
+struct Triangles {
+    std::vector<vec3> vertices;
+    size_t size() const { return vertices.size() / 3; }
+    std::vector<Bounds3f> bounds() const {
+        std::vector<Bounds3f> r;
+        for (size_t i = 0; i < size(); i++) {
+            r.emplace_back(Bounds3f().expand(vertices[3 * i]).expand(vertices[3 * i + 1]).expand(vertices[3 * i + 2]));
+        }
+        return r;
+    }
+    bool intersect(uint32_t prim, const vec3 &o, const vec3 &d, Float tmax, Float &t) const {
+        vec2 uv;
+        return intersect_triangle(vertices[3 * prim], vertices[3 * prim + 1], vertices[3 * prim + 2], o, d, 0.0f,
+                                  tmax, t, uv);
+    }
+};
+
+static vec3 random_vec3(std::mt19937 &rng, Float lo, Float hi) {
+    std::uniform_real_distribution<Float> dist(lo, hi);
+    return vec3(dist(rng), dist(rng), dist(rng));
+}
+
+// small triangles scattered in a box and a few large ones crossing it
+static Triangles random_triangles(std::mt19937 &rng, size_t n) {
+    Triangles tris;
+    for (size_t i = 0; i < n; i++) {
+        const Float size = i % 64 == 0 ? 8.0f : 0.5f;
+        const vec3 p     = random_vec3(rng, -10.0f, 10.0f);
+        for (int k = 0; k < 3; k++) {
+            tris.vertices.emplace_back(p + random_vec3(rng, -size, size));
+        }
+    }
+    return tris;
+}
+
+// closest hit distance, Inf for a miss
+static Float intersect_linear(const Triangles &tris, const vec3 &o, const vec3 &d) {
+    Float tmax = Inf;
+    for (uint32_t i = 0; i < tris.size(); i++) {
+        Float t;
+        if (tris.intersect(i, o, d, tmax, t)) {
+            tmax = t;
+        }
+    }
+    return tmax;
+}
+
+// Traverse :: (std::bool_constant any_hit, o, d, tmax, intersect_leaf) -> bool
+template <class Traverse>
+static void check_against_linear(const Triangles &tris, const std::vector<uint32_t> &prim_indices, std::mt19937 &rng,
+                                 Traverse &&traverse) {
+    for (int i = 0; i < 2000; i++) {
+        const vec3 o         = random_vec3(rng, -15.0f, 15.0f);
+        const vec3 d         = normalize(random_vec3(rng, -15.0f, 15.0f) - o);
+        const Float expected = intersect_linear(tris, o, d);
+        auto intersect_leaf  = [&](uint32_t i, Float &tmax) {
+            Float t;
+            if (!tris.intersect(prim_indices[i], o, d, tmax, t))
+                return false;
+            tmax = t;
+            return true;
+        };
+        Float tmax     = Inf;
+        const bool hit = traverse(std::false_type(), o, d, tmax, intersect_leaf);
+        AKR_ASSERT(hit == (expected < Inf));
+        AKR_ASSERT(tmax == expected);
+        tmax = Inf;
+        AKR_ASSERT(traverse(std::true_type(), o, d, tmax, intersect_leaf) == hit);
+    }
+}
+
+static void test_traversal(const BVHBuildSettings &settings) {
+    std::mt19937 rng(7);
+    const auto tris   = random_triangles(rng, 5000);
+    const auto binary = build_bvh(tris.bounds(), settings);
+    const auto wide4  = collapse_bvh<4>(binary.nodes);
+    const auto wide8  = collapse_bvh<8>(binary.nodes);
+    const BufferView<const BVHNode> nodes(binary.nodes.data(), binary.nodes.size());
+    const BufferView<const WideBVHNode<4>> nodes4(wide4.data(), wide4.size());
+    const BufferView<const WideBVHNode<8>> nodes8(wide8.data(), wide8.size());
+    check_against_linear(tris, binary.prim_indices, rng, [&](auto any_hit, const vec3 &o, const vec3 &d, Float &tmax,
+                                                             auto &&intersect_leaf) {
+        return traverse_bvh<decltype(any_hit)::value>(nodes, o, d, 0.0f, tmax, intersect_leaf);
+    });
+    check_against_linear(tris, binary.prim_indices, rng, [&](auto any_hit, const vec3 &o, const vec3 &d, Float &tmax,
+                                                             auto &&intersect_leaf) {
+        return traverse_wide_bvh<4, decltype(any_hit)::value>(nodes4, o, d, 0.0f, tmax, intersect_leaf);
+    });
+    check_against_linear(tris, binary.prim_indices, rng, [&](auto any_hit, const vec3 &o, const vec3 &d, Float &tmax,
+                                                             auto &&intersect_leaf) {
+        return traverse_wide_bvh<8, decltype(any_hit)::value>(nodes8, o, d, 0.0f, tmax, intersect_leaf);
+    });
+}
+
+static int depth_of(const std::vector<BVHNode> &nodes, uint32_t idx) {
+    if (nodes[idx].is_leaf())
+        return 0;
+    return 1 + std::max(depth_of(nodes, idx + 1), depth_of(nodes, nodes[idx].offset));
+}
+
+// Centroids at growing distances make every SAH split cut off a single primitive. The depth has to stay within
+// the bound the traversal stacks are sized for.
+static void test_depth_bound() {
+    std::vector<Bounds3f> bounds;
+    for (int i = 0; i < 4096; i++) {
+        const Float x = std::pow(1.02f, Float(i));
+        bounds.emplace_back(Bounds3f().expand(vec3(x, 0, 0)).expand(vec3(x + 0.01f, 1, 1)));
+    }
+    BVHBuildSettings settings;
+    settings.max_leaf_size = 1;
+    const auto bvh         = build_bvh(bounds, settings);
+    AKR_ASSERT(depth_of(bvh.nodes, 0) <= MAX_BVH_DEPTH);
+}
+
+// the parallel test must not depend on the size of the triangle
+static void test_small_triangles() {
+    for (Float scale : {1.0f, 1e-3f, 1e-6f}) {
+        const vec3 v0(0, 0, 0), v1(scale, 0, 0), v2(0, scale, 0);
+        const vec3 o(0.25f * scale, 0.25f * scale, 1.0f);
+        Float t;
+        vec2 uv;
+        AKR_ASSERT(intersect_triangle(v0, v1, v2, o, vec3(0, 0, -1), 0.0f, Inf, t, uv));
+        AKR_ASSERT(std::abs(t - 1.0f) < 1e-5f);
+        // parallel to the plane of the triangle
+        AKR_ASSERT(!intersect_triangle(v0, v1, v2, vec3(-scale, 0.25f * scale, 0), vec3(1, 0, 0), 0.0f, Inf, t, uv));
+    }
+}
+
+int main() {
+    thread::init(4);
+    for (uint32_t leaf_size : {1u, 4u, 8u}) {
+        BVHBuildSettings settings;
+        settings.max_leaf_size = leaf_size;
+        test_traversal(settings);
+    }
+    BVHBuildSettings padded;
+    padded.pad_bounds = true;
+    test_traversal(padded);
+    test_depth_bound();
+    test_small_triangles();
+    thread::finalize();
+}
@@ -0,0 +1,136 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstring>
+#include <akari/render.h>
+
+using namespace akari;
+using namespace akari::render;
+
+static const ivec2 resolution(37, 23);
+
+static Film make_film(Float offset) {
+    Film film(resolution);
+    for (int y = 0; y < resolution.y; y++) {
+        for (int x = 0; x < resolution.x; x++) {
+            Spectrum s;
+            for (size_t c = 0; c < Spectrum::size; c++) {
+                s[c] = offset + Float(x) / Float(y + 1) + Float(c) / 3.0f;
+                film.splats(x, y)[c].set(offset - Float(c * x + y) / 7.0f);
+            }
+            film.radiance(x, y) = s;
+            film.weight(x, y)   = Float(x + y + 1);
+        }
+    }
+    return film;
+}
+
+static bool same_bits(Float a, Float b) { return std::memcmp(&a, &b, sizeof(Float)) == 0; }
+
+static bool same_film(const Film &a, const Film &b) {
+    for (int y = 0; y < resolution.y; y++) {
+        for (int x = 0; x < resolution.x; x++) {
+            if (!same_bits(a.weight(x, y), b.weight(x, y)))
+                return false;
+            for (size_t c = 0; c < Spectrum::size; c++) {
+                if (!same_bits(a.radiance(x, y)[c], b.radiance(x, y)[c]) ||
+                    !same_bits(a.splats(x, y)[c].value(), b.splats(x, y)[c].value()))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static PTConfig make_config(SamplerConfig::Type type, int spp) {
+    PTConfig config;
+    config.sampler.type = type;
+    config.spp          = spp;
+    config.spp_per_pass = 4;
+    return config;
+}
+
+// the film comes back bit for bit with the samples per pixel it was written at
+static void test_round_trip(const fs::path &path) {
+    for (auto type : {SamplerConfig::PCG, SamplerConfig::LCG, SamplerConfig::PMJ02BN, SamplerConfig::ZSOBOL}) {
+        const auto config = make_config(type, 64);
+        const Film film   = make_film(0.5f);
+        write_pt_checkpoint(path, config, film, 12);
+        Film loaded = make_film(-3.0f);
+        AKR_ASSERT(load_pt_checkpoint(path, config, loaded) == 12);
+        AKR_ASSERT(same_film(film, loaded));
+    }
+}
+
+// a checkpoint of a different render is ignored and leaves the film alone
+static void test_mismatch(const fs::path &path) {
+    const auto config = make_config(SamplerConfig::PCG, 64);
+    write_pt_checkpoint(path, config, make_film(0.5f), 12);
+    const Film untouched = make_film(-3.0f);
+    auto check_ignored   = [&](const PTConfig &other) {
+        Film film = make_film(-3.0f);
+        AKR_ASSERT(load_pt_checkpoint(path, other, film) == 0);
+        AKR_ASSERT(same_film(film, untouched));
+    };
+    auto other         = config;
+    other.sampler.type = SamplerConfig::LCG;
+    check_ignored(other);
+    other = config;
+    other.sampler.seed++;
+    check_ignored(other);
+    other = config;
+    other.max_depth++;
+    check_ignored(other);
+    Film larger(ivec2(resolution.x, resolution.y + 1));
+    AKR_ASSERT(load_pt_checkpoint(path, config, larger) == 0);
+
+    // random samplers continue to a larger spp
+    Film film = make_film(-3.0f);
+    AKR_ASSERT(load_pt_checkpoint(path, make_config(SamplerConfig::PCG, 128), film) == 12);
+    AKR_ASSERT(same_film(film, make_film(0.5f)));
+
+    // low discrepancy samplers lay the samples out for the total spp
+    for (auto type : {SamplerConfig::PMJ02BN, SamplerConfig::ZSOBOL}) {
+        write_pt_checkpoint(path, make_config(type, 64), make_film(0.5f), 12);
+        check_ignored(make_config(type, 128));
+        check_ignored(make_config(type, 32));
+    }
+}
+
+// a truncated file is ignored and the partly read film is cleared
+static void test_truncated(const fs::path &path) {
+    const auto config = make_config(SamplerConfig::PCG, 64);
+    write_pt_checkpoint(path, config, make_film(0.5f), 12);
+    fs::resize_file(path, fs::file_size(path) - 1);
+    Film film = make_film(-3.0f);
+    AKR_ASSERT(load_pt_checkpoint(path, config, film) == 0);
+    for (int y = 0; y < resolution.y; y++) {
+        for (int x = 0; x < resolution.x; x++) {
+            AKR_ASSERT(film.weight(x, y) == 0.0f && film.radiance(x, y)[0] == 0.0f);
+            AKR_ASSERT(film.splats(x, y)[0].value() == 0.0f);
+        }
+    }
+    fs::remove(path);
+    AKR_ASSERT(load_pt_checkpoint(path, config, film) == 0);
+}
+
+int main() {
+    thread::init(4);
+    const auto path = fs::temp_directory_path() / "akari-test-checkpoint.bin";
+    test_round_trip(path);
+    test_mismatch(path);
+    test_truncated(path);
+    fs::remove(path);
+    thread::finalize();
+}
@@ -0,0 +1,157 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <akari/pmr.h>
+
+using namespace akari;
+using namespace akari::astd;
+
+// records the live blocks and checks that each one is freed with the size and alignment it was allocated with
+class CheckedResource : public pmr::memory_resource {
+  public:
+    std::mutex m;
+    std::unordered_map<void *, std::pair<size_t, size_t>> live;
+    void *last_allocated = nullptr, *last_freed = nullptr;
+    size_t live_blocks() {
+        std::lock_guard<std::mutex> lock(m);
+        return live.size();
+    }
+
+  private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        void *p = pmr::new_delete_resource()->allocate(bytes, alignment);
+        std::lock_guard<std::mutex> lock(m);
+        live.emplace(p, std::make_pair(bytes, alignment));
+        last_allocated = p;
+        return p;
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = live.find(p);
+            AKR_ASSERT(it != live.end());
+            AKR_ASSERT(it->second == std::make_pair(bytes, alignment));
+            live.erase(it);
+            last_freed = p;
+        }
+        pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const memory_resource &other) const noexcept override { return this == &other; }
+};
+
+// blocks above the largest size class go straight to the upstream resource and come back when freed
+template <class Pool>
+static void test_large_blocks() {
+    CheckedResource upstream;
+    {
+        Pool pool(pmr::pool_options(), &upstream);
+        pmr::polymorphic_allocator<float> alloc(&pool);
+        const size_t n = 2 * pool.options().largest_required_pool_block / sizeof(float);
+        float *p       = alloc.allocate(n);
+        AKR_ASSERT(upstream.last_allocated == p);
+        p[0] = p[n - 1] = 1.0f;
+        alloc.deallocate(p, n);
+        AKR_ASSERT(upstream.last_freed == p);
+
+        // a vector grows through pooled sizes into large ones
+        std::vector<double, pmr::polymorphic_allocator<double>> v(&pool);
+        for (int i = 0; i < 100000; i++) {
+            v.push_back(i);
+        }
+        v = std::vector<double, pmr::polymorphic_allocator<double>>(&pool);
+    }
+    AKR_ASSERT(upstream.live_blocks() == 0);
+}
+
+template <class Pool>
+static void test_small_blocks() {
+    CheckedResource upstream;
+    {
+        Pool pool(pmr::pool_options(), &upstream);
+        pmr::polymorphic_allocator<> alloc(&pool);
+        std::vector<void *> blocks;
+        for (size_t i = 0; i < 10000; i++) {
+            const size_t bytes = size_t(8) << (i % 10u);
+            auto *p            = (char *)alloc.allocate_bytes(bytes, alignof(std::max_align_t));
+            AKR_ASSERT(uintptr_t(p) % alignof(std::max_align_t) == 0);
+            p[0] = p[bytes - 1] = char(i);
+            blocks.emplace_back(p);
+        }
+        for (size_t i = 0; i < blocks.size(); i++) {
+            AKR_ASSERT(((char *)blocks[i])[0] == char(i));
+            alloc.deallocate_bytes(blocks[i], size_t(8) << (i % 10u), alignof(std::max_align_t));
+        }
+        // a freed block is handed out again
+        void *p = alloc.allocate_bytes(64);
+        alloc.deallocate_bytes(p, 64);
+        AKR_ASSERT(alloc.allocate_bytes(64) == p);
+        alloc.deallocate_bytes(p, 64);
+    }
+    AKR_ASSERT(upstream.live_blocks() == 0);
+}
+
+// blocks may be freed by a thread other than the one that allocated them
+static void test_remote_free() {
+    CheckedResource upstream;
+    {
+        pmr::synchronized_pool_resource pool(pmr::pool_options(), &upstream);
+        pmr::polymorphic_allocator<> alloc(&pool);
+        std::vector<void *> blocks;
+        for (int i = 0; i < 4096; i++) {
+            blocks.emplace_back(alloc.allocate_bytes(i % 2 == 0 ? 32 : 16384));
+        }
+        std::thread([&] {
+            for (size_t i = 0; i < blocks.size(); i++) {
+                alloc.deallocate_bytes(blocks[i], i % 2 == 0 ? 32 : 16384);
+            }
+        }).join();
+        for (int i = 0; i < 4096; i++) {
+            alloc.deallocate_bytes(alloc.allocate_bytes(32), 32);
+        }
+    }
+    AKR_ASSERT(upstream.live_blocks() == 0);
+}
+
+// pools that outlive the threads that allocated from them, and threads that outlive many pools
+static void test_pool_lifetimes() {
+    CheckedResource upstream;
+    {
+        pmr::synchronized_pool_resource pool(pmr::pool_options(), &upstream);
+        pmr::polymorphic_allocator<> alloc(&pool);
+        std::thread([&] { alloc.deallocate_bytes(alloc.allocate_bytes(64), 64); }).join();
+    }
+    std::thread([&] {
+        for (int i = 0; i < 1000; i++) {
+            pmr::synchronized_pool_resource pool(pmr::pool_options(), &upstream);
+            pmr::polymorphic_allocator<> alloc(&pool);
+            void *p = alloc.allocate_bytes(32);
+            alloc.deallocate_bytes(alloc.allocate_bytes(128), 128);
+            alloc.deallocate_bytes(p, 32);
+        }
+    }).join();
+    AKR_ASSERT(upstream.live_blocks() == 0);
+}
+
+int main() {
+    test_large_blocks<pmr::synchronized_pool_resource>();
+    test_large_blocks<pmr::unsynchronized_pool_resource>();
+    test_small_blocks<pmr::synchronized_pool_resource>();
+    test_small_blocks<pmr::unsynchronized_pool_resource>();
+    test_remote_free();
+    test_pool_lifetimes();
+}
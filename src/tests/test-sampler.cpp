@@ -0,0 +1,146 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <tuple>
+#include <akari/render.h>
+
+using namespace akari;
+using namespace akari::render;
+
+// n = 2^m points form a (0,m,2)-net: every elementary interval of area 1/n holds exactly one point
+static bool is_02_net(const std::vector<vec2> &points) {
+    const uint32_t n = (uint32_t)points.size();
+    for (uint32_t nx = 1; nx <= n; nx *= 2) {
+        const uint32_t ny = n / nx;
+        std::vector<int> count(n, 0);
+        for (auto &p : points) {
+            const uint32_t x = std::min(nx - 1, uint32_t(p.x * nx));
+            const uint32_t y = std::min(ny - 1, uint32_t(p.y * ny));
+            if (count[y * nx + x]++ > 0)
+                return false;
+        }
+    }
+    return true;
+}
+static bool is_stratified(const std::vector<Float> &values) {
+    std::vector<int> count(values.size(), 0);
+    for (auto v : values) {
+        if (count[std::min(values.size() - 1, size_t(v * values.size()))]++ > 0)
+            return false;
+    }
+    return true;
+}
+
+// The samples of one pixel are a block of the Sobol sequence: every 2D draw of the pixel is a (0,2)-net and every
+// 1D draw is stratified, for even and odd powers of two.
+static void test_zsobol_stratification() {
+    for (int spp : {4, 16, 32, 64}) {
+        SamplerConfig config;
+        config.type       = SamplerConfig::ZSOBOL;
+        config.spp        = spp;
+        config.resolution = ivec2(37, 23);
+        build_sampler_tables(config);
+        for (uint64_t pixel = 0; pixel < uint64_t(hprod(config.resolution)); pixel += 17) {
+            std::vector<std::vector<vec2>> points2d(4);
+            std::vector<std::vector<Float>> points1d(2);
+            Sampler sampler = create_sampler(config, pixel);
+            for (int s = 0; s < spp; s++) {
+                sampler.start_next_sample();
+                points2d[0].emplace_back(sampler.next2d());
+                points1d[0].emplace_back(sampler.next1d());
+                points2d[1].emplace_back(sampler.next2d());
+                points2d[2].emplace_back(sampler.next2d());
+                points1d[1].emplace_back(sampler.next1d());
+                points2d[3].emplace_back(sampler.next2d());
+            }
+            for (auto &points : points2d) {
+                for (auto &p : points) {
+                    AKR_ASSERT(p.x >= 0.0f && p.x < 1.0f && p.y >= 0.0f && p.y < 1.0f);
+                }
+                AKR_ASSERT(is_02_net(points));
+            }
+            for (auto &values : points1d) {
+                AKR_ASSERT(is_stratified(values));
+            }
+        }
+    }
+}
+
+// neighbouring pixels get differently scrambled points
+static void test_zsobol_decorrelation() {
+    SamplerConfig config;
+    config.type       = SamplerConfig::ZSOBOL;
+    config.spp        = 16;
+    config.resolution = ivec2(16, 16);
+    build_sampler_tables(config);
+    Sampler a = create_sampler(config, 0), b = create_sampler(config, 1);
+    int equal = 0;
+    for (int s = 0; s < config.spp; s++) {
+        a.start_next_sample();
+        b.start_next_sample();
+        const vec2 u = a.next2d(), v = b.next2d();
+        equal += u.x == v.x && u.y == v.y;
+    }
+    AKR_ASSERT(equal < config.spp / 2);
+}
+
+// a sampler created at sample k continues exactly like one that took the first k samples
+static void test_resume() {
+    for (auto type : {SamplerConfig::PCG, SamplerConfig::LCG, SamplerConfig::ZSOBOL}) {
+        SamplerConfig config;
+        config.type       = type;
+        config.spp        = 16;
+        config.resolution = ivec2(20, 10);
+        build_sampler_tables(config);
+        for (uint64_t pixel = 0; pixel < 200; pixel += 13) {
+            Sampler straight = create_sampler(config, pixel);
+            for (uint32_t s = 0; s < 24; s++) {
+                straight.start_next_sample();
+                Sampler resumed = create_sampler(config, pixel, s);
+                resumed.start_next_sample();
+                for (int d = 0; d < 5; d++) {
+                    const vec2 u = straight.next2d(), v = resumed.next2d();
+                    AKR_ASSERT(u.x == v.x && u.y == v.y);
+                    AKR_ASSERT(straight.next1d() == resumed.next1d());
+                }
+            }
+        }
+    }
+}
+
+// the low discrepancy samplers round spp up to a count they can stratify
+static void test_spp_rounding() {
+    for (auto [type, spp, expected] : {std::make_tuple(SamplerConfig::PCG, 20, 20),
+                                       std::make_tuple(SamplerConfig::PMJ02BN, 20, 64),
+                                       std::make_tuple(SamplerConfig::PMJ02BN, 16, 16),
+                                       std::make_tuple(SamplerConfig::ZSOBOL, 20, 32),
+                                       std::make_tuple(SamplerConfig::ZSOBOL, 32, 32)}) {
+        SamplerConfig config;
+        config.type       = type;
+        config.spp        = spp;
+        config.resolution = ivec2(16, 16);
+        build_sampler_tables(config);
+        AKR_ASSERT(config.spp == expected);
+        if (type == SamplerConfig::PMJ02BN) {
+            AKR_ASSERT(config.pmj02bn_pixel_samples->spp == expected);
+        }
+    }
+}
+
+int main() {
+    test_zsobol_stratification();
+    test_zsobol_decorrelation();
+    test_resume();
+    test_spp_rounding();
+}
@@ -0,0 +1,90 @@
+// Copyright 2020 shiinamiyuki
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cmath>
+#include <cstring>
+#include <akari/thread.h>
+#include <akari/array.h>
+
+using namespace akari;
+
+// values spanning many orders of magnitude, so that any change of the summation order changes the result
+static float term(size_t i) {
+    uint32_t h = uint32_t(i) * 2654435761u;
+    h ^= h >> 15u;
+    return std::ldexp(float(h & 0xffffu) / 65536.0f, int(h % 40u) - 20);
+}
+
+// same blocks and combination tree as thread::parallel_map_reduce, evaluated by a single thread
+static float serial_sum(size_t count) {
+    if (count == 0) {
+        return 0.0f;
+    }
+    const size_t n_blocks = std::min<size_t>(count, 256);
+    std::vector<float> partials(n_blocks, 0.0f);
+    for (size_t block = 0; block < n_blocks; block++) {
+        for (size_t i = count * block / n_blocks; i < count * (block + 1) / n_blocks; i++) {
+            partials[block] += term(i);
+        }
+    }
+    for (size_t stride = 1; stride < n_blocks; stride *= 2) {
+        for (size_t i = 0; i + stride < n_blocks; i += 2 * stride) {
+            partials[i] += partials[i + stride];
+        }
+    }
+    return partials[0];
+}
+
+static float parallel_sum(size_t count) {
+    return thread::parallel_map_reduce(
+        count, 0.0f, [](size_t i) { return term(i); }, [](float a, float b) { return a + b; });
+}
+
+static bool same_bits(float a, float b) { return std::memcmp(&a, &b, sizeof(float)) == 0; }
+
+static void test_map_reduce_is_deterministic() {
+    for (size_t count : {size_t(0), size_t(1), size_t(7), size_t(255), size_t(256), size_t(1000), size_t(1) << 20u}) {
+        const float expected = serial_sum(count);
+        for (int rep = 0; rep < 8; rep++) {
+            AKR_ASSERT(same_bits(parallel_sum(count), expected));
+        }
+        // nested inside a loop that keeps the other threads busy, so that the blocks are scheduled differently
+        std::vector<float> nested(16);
+        thread::parallel_for(
+            nested.size(), [&](uint32_t i, uint32_t) { nested[i] = parallel_sum(count); }, 1);
+        for (auto s : nested) {
+            AKR_ASSERT(same_bits(s, expected));
+        }
+    }
+}
+
+static void test_empty_array_extrema() {
+    Array2D<float> a(ivec2(0));
+    AKR_ASSERT(a.max() == 0.0f && a.min() == 0.0f);
+    Array3D<float> b(ivec3(4));
+    b.resize(ivec3(0));
+    AKR_ASSERT(b.max() == 0.0f && b.min() == 0.0f);
+    Array2D<float> c(ivec2(3, 2));
+    c.fill(1.0f);
+    c(2, 1) = -4.0f;
+    c(0, 1) = 5.0f;
+    AKR_ASSERT(c.max() == 5.0f && c.min() == -4.0f);
+}
+
+int main() {
+    thread::init(4);
+    test_map_reduce_is_deterministic();
+    test_empty_array_extrema();
+    thread::finalize();
+}